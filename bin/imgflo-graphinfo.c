@@ -42,7 +42,7 @@ merge_port_info(JsonObject *port, JsonObject *port_info) {
         JsonNode *node = json_object_get_member(port_info, key);
         gboolean allowed = (g_strcmp0(key, "id") != 0);
         if (allowed && !json_object_has_member(metadata, key)) {
-            json_object_set_member(metadata, key, node);
+            json_object_set_member(metadata, key, json_node_copy(node));
         }
     }
 }
@@ -89,8 +89,19 @@ find_iip_for_inports(JsonObject *graph) {
     return ret;
 }
 
+static JsonObject *
+find_port_info(JsonArray *ports, const gchar *name) {
+    for (int i=0; i<json_array_get_length(ports); i++) {
+        JsonObject *info = json_array_get_object_element(ports, i);
+        if (g_strcmp0(json_object_get_string_member(info, "id"), name) == 0) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
 gboolean
-inject_exported_port_types(Graph *graph, JsonObject *root) {
+inject_exported_port_types(Library *lib, JsonObject *root) {
     if (json_object_has_member(root, "inports")) {
         JsonObject *inports = json_object_get_object_member(root, "inports");
 
@@ -105,26 +116,34 @@ inject_exported_port_types(Graph *graph, JsonObject *root) {
         }
 
         // Infer metadata from type information of target port
+        JsonArray *infos = library_graph_ports(lib, root, TRUE);
         GList *inport_names = json_object_get_members(inports);
         for (int i=0; i<g_list_length(inport_names); i++) {
             const gchar *name = g_list_nth_data(inport_names, i);
-            JsonObject *info = graph_inport_info(graph, name);
+            JsonObject *info = find_port_info(infos, name);
             //g_print("exported inport %s type=%s\n", name, type);
             JsonObject *port = json_object_get_object_member(inports, name);
-            merge_port_info(port, info);
+            if (info) {
+                merge_port_info(port, info);
+            }
         }
+        json_array_unref(infos);
     }
 
     if (json_object_has_member(root, "outports")) {
         JsonObject *outports = json_object_get_object_member(root, "outports");
+        JsonArray *infos = library_graph_ports(lib, root, FALSE);
         GList *outport_names = json_object_get_members(outports);
         for (int i=0; i<g_list_length(outport_names); i++) {
             const gchar *name = g_list_nth_data(outport_names, i);
-            JsonObject *info = graph_outport_info(graph, name);
+            JsonObject *info = find_port_info(infos, name);
             //g_print("exported outport %s type=%s\n", name, type);
             JsonObject *port = json_object_get_object_member(outports, name);
-            merge_port_info(port, info);
+            if (info) {
+                merge_port_info(port, info);
+            }
         }
+        json_array_unref(infos);
     }
     return TRUE;
 }
@@ -165,16 +184,10 @@ add_graphinfo(char *data, ssize_t length) {
     // Only attempt to enrich imgflo graphs. Others passed through as-is
     gchar *runtime = graph_runtime_type(root);
     if (g_strcmp0(runtime, "imgflo") == 0) {
+        // Port information comes from the Library metadata cache,
+        // so the graph does not need to be instantiated
         Library *lib = library_new();
-        Graph *graph = graph_new("default/main", lib);
-        gboolean loaded = graph_load_json_data(graph, data, length, &err);
-        if (!loaded) {
-            g_printerr("Failed to load graph: %s", err->message);
-            return NULL;
-        }
-
-        inject_exported_port_types(graph, root);
-        graph_free(graph);
+        inject_exported_port_types(lib, root);
         library_free(lib);
     }
     g_free(runtime);
@@ -247,7 +260,7 @@ main (int argc, char **argv)
             return 1;
         }
 
-        gchar *output = json_stringify(out, NULL);
+        gchar *output = json_stringify_pretty(out, NULL);
         g_print("%s", output);
         g_free(output);
 
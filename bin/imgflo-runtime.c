@@ -4,12 +4,26 @@
 
 #include "lib/utils.c"
 #include "lib/png.c"
+#include "lib/jpeg.c"
+#include "lib/webp.c"
+#include "lib/encoder.c"
+#include "lib/decoder.c"
 #include "lib/uuid.c"
 #include "lib/processor.c"
 #include "lib/library.c"
 #include "lib/graph.c"
+#include "lib/fusion.c"
 #include "lib/network.c"
 #include "lib/registry.c"
+#include "lib/cache.c"
+#include "lib/pool.c"
+#include "lib/metrics.c"
+#include "lib/msgpack.c"
+#include "lib/client.c"
+#include "lib/logring.c"
+#include "lib/batch.c"
+#include "lib/admission.c"
+#include "lib/template.c"
 #include "lib/ui.c"
 
 static void
@@ -25,6 +39,13 @@ static gchar *host = ""; // defaults to autodetect/localhost
 static gchar *defaultgraph = "";
 static gchar *ide = "http://app.flowhub.io";
 static gboolean launch_ide = FALSE;
+static gchar *graphsdir = NULL;
+static gchar *templatesdir = NULL;
+static gint preview_interval = -1;
+static gint max_renders = -1;
+static gint max_graph_renders = -1;
+static gint64 max_render_pixels = -1;
+static gboolean fusion = TRUE;
 
 static GOptionEntry entries[] = {
 	{ "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to listen on", NULL },
@@ -33,6 +54,13 @@ static GOptionEntry entries[] = {
     { "graph", 'g', 0, G_OPTION_ARG_STRING, &defaultgraph, "Default graph", NULL },
     { "ide", 'i', 0, G_OPTION_ARG_STRING, &ide, "FBP IDE to use", NULL },
     { "autolaunch", 'i', 0, G_OPTION_ARG_NONE, &launch_ide, "Automatically launch FBP IDE", NULL },
+    { "graphs", 0, 0, G_OPTION_ARG_STRING, &graphsdir, "Directory with graphs to make available as components", NULL },
+    { "templates", 0, 0, G_OPTION_ARG_STRING, &templatesdir, "Directory with graphs to render statelessly with GET /graph/<name>", NULL },
+    { "preview-interval", 0, 0, G_OPTION_ARG_INT, &preview_interval, "Minimum milliseconds between previews of a node sent to a client. 0 sends all", NULL },
+    { "max-renders", 0, 0, G_OPTION_ARG_INT, &max_renders, "Maximum render tasks queued or running. More are rejected with 503", NULL },
+    { "max-graph-renders", 0, 0, G_OPTION_ARG_INT, &max_graph_renders, "Maximum render tasks queued or running per graph", NULL },
+    { "max-render-pixels", 0, 0, G_OPTION_ARG_INT64, &max_render_pixels, "Maximum output pixels of all queued or running render tasks", NULL },
+    { "no-fusion", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &fusion, "Do not fuse chains of point filters when rendering", NULL },
 	{ NULL }
 };
 
@@ -84,6 +112,28 @@ main (int argc, char **argv)
         gegl_init(0, NULL);
 	    UiConnection *ui = ui_connection_new(host, port, extport);
 
+        if (ui && preview_interval >= 0) {
+            ui->preview_interval = preview_interval;
+        }
+        if (ui && max_renders > 0) {
+            ui->admission->max_tasks = max_renders;
+        }
+        if (ui && max_graph_renders > 0) {
+            ui->admission->max_graph_tasks = max_graph_renders;
+        }
+        if (ui && max_render_pixels > 0) {
+            ui->admission->max_pixels = max_render_pixels;
+        }
+        if (ui) {
+            ui->fusion = fusion;
+        }
+        if (ui && graphsdir) {
+            library_add_graph_directory(ui->component_lib, graphsdir);
+        }
+        if (ui && templatesdir) {
+            ui_connection_add_template_directory(ui, templatesdir);
+        }
+
         if (strlen(defaultgraph) > 0) {
             GError *err = NULL;
             Graph *g = graph_new("default/main", ui->component_lib);
@@ -10,15 +10,20 @@
 #include "lib/processor.c"
 #include "lib/library.c"
 #include "lib/graph.c"
+#include "lib/fusion.c"
 #include "lib/network.c"
 #include "lib/video.c"
 
 static gboolean process_video = FALSE;
 static gchar *node_info = NULL;
+static gchar *graphsdir = NULL;
+static gboolean optimize = FALSE;
 
 static GOptionEntry entries[] = {
     { "video", 'v', 0, G_OPTION_ARG_NONE, &process_video, "Input should be processed as a video", NULL },
     { "nodeinfo", 'i', 0, G_OPTION_ARG_STRING, &node_info, "Show info from these (comma,separated) nodes", NULL },
+    { "graphs", 0, 0, G_OPTION_ARG_STRING, &graphsdir, "Directory with graphs to make available as components", NULL },
+    { "optimize", 0, 0, G_OPTION_ARG_NONE, &optimize, "Fuse chains of point filters into single operations", NULL },
     { NULL }
 };
 
@@ -67,6 +72,9 @@ int main(int argc, char *argv[]) {
     g_print("GeglInit: { \"duration\":%f }\n", (after_init-before_init)*1000.0);
 
     Library *lib = library_new();
+    if (graphsdir) {
+        library_add_graph_directory(lib, graphsdir);
+    }
     Graph *graph = graph_new("stdin", lib);
     Network *net = network_new(graph);
 
@@ -83,6 +91,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (optimize) {
+        const gint fused = graph_fuse_point_filters(graph, TRUE);
+        g_print("Optimize: { \"fused\":%d }\n", fused);
+    }
+
     if (process_video) {
         const int frames_processed = video_process_network(net, video_progress, NULL);
         if (frames_processed <= 0) {
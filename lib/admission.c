@@ -0,0 +1,148 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Admission control for render work. Before a task is queued for the render workers it must be
+// admitted, which fails fast when too much is queued or running already, in total or for one graph,
+// or when the output pixels of everything admitted would exceed a budget.
+// Rejected requests get 503, so latency of accepted work stays predictable. Thread-safe
+
+typedef enum _AdmissionResult {
+    AdmissionAccepted = 0,
+    AdmissionQueueFull,
+    AdmissionGraphBusy,
+    AdmissionOverBudget,
+    AdmissionResults
+} AdmissionResult;
+
+static const gchar *admission_result_names[] = { "accepted", "queue_full", "graph_busy", "over_budget" };
+
+typedef struct _Admission {
+    GMutex lock;
+    guint max_tasks; // queued or running, for all graphs
+    guint max_graph_tasks; // queued or running, per graph
+    gint64 max_pixels; // output pixels of all admitted tasks
+    guint tasks;
+    gint64 pixels;
+    GHashTable *graph_tasks; // graph id -> number of tasks, as GUINT
+    gsize rejected[AdmissionResults];
+} Admission;
+
+Admission *
+admission_new(guint max_tasks, guint max_graph_tasks, gint64 max_pixels) {
+    Admission *self = g_new0(Admission, 1);
+    g_mutex_init(&self->lock);
+    self->max_tasks = max_tasks;
+    self->max_graph_tasks = max_graph_tasks;
+    self->max_pixels = max_pixels;
+    self->graph_tasks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    return self;
+}
+
+void
+admission_free(Admission *self) {
+    g_hash_table_destroy(self->graph_tasks);
+    g_mutex_clear(&self->lock);
+    g_free(self);
+}
+
+const gchar *
+admission_result_reason(AdmissionResult result) {
+    switch (result) {
+    case AdmissionQueueFull: return "Render queue is full";
+    case AdmissionGraphBusy: return "Too many renders of graph";
+    case AdmissionOverBudget: return "Too many pixels being rendered";
+    default: return "Accepted";
+    }
+}
+
+// Admit a task for @graph_id producing about @pixels output pixels.
+// If accepted, must be given back with admission_release() once the task is done.
+// A task over the pixel budget on its own is still admitted when nothing else is running
+AdmissionResult
+admission_acquire(Admission *self, const gchar *graph_id, gint64 pixels) {
+    g_return_val_if_fail(self, AdmissionQueueFull);
+    g_return_val_if_fail(graph_id, AdmissionQueueFull);
+
+    g_mutex_lock(&self->lock);
+    const guint graph_tasks = GPOINTER_TO_UINT(g_hash_table_lookup(self->graph_tasks, graph_id));
+    AdmissionResult result = AdmissionAccepted;
+    if (self->tasks >= self->max_tasks) {
+        result = AdmissionQueueFull;
+    } else if (graph_tasks >= self->max_graph_tasks) {
+        result = AdmissionGraphBusy;
+    } else if (self->tasks > 0 && self->pixels + pixels > self->max_pixels) {
+        result = AdmissionOverBudget;
+    }
+    if (result == AdmissionAccepted) {
+        self->tasks++;
+        self->pixels += pixels;
+        g_hash_table_replace(self->graph_tasks, g_strdup(graph_id), GUINT_TO_POINTER(graph_tasks+1));
+    } else {
+        self->rejected[result]++;
+    }
+    g_mutex_unlock(&self->lock);
+    return result;
+}
+
+void
+admission_release(Admission *self, const gchar *graph_id, gint64 pixels) {
+    g_return_if_fail(self);
+    g_return_if_fail(graph_id);
+
+    g_mutex_lock(&self->lock);
+    const guint graph_tasks = GPOINTER_TO_UINT(g_hash_table_lookup(self->graph_tasks, graph_id));
+    g_warn_if_fail(graph_tasks > 0 && self->tasks > 0);
+    if (graph_tasks > 1) {
+        g_hash_table_replace(self->graph_tasks, g_strdup(graph_id), GUINT_TO_POINTER(graph_tasks-1));
+    } else {
+        g_hash_table_remove(self->graph_tasks, graph_id);
+    }
+    self->tasks = (self->tasks > 0) ? self->tasks-1 : 0;
+    self->pixels = MAX(self->pixels - pixels, 0);
+    g_mutex_unlock(&self->lock);
+}
+
+// Whether @tasks tasks, for different graphs and @pixels output pixels together, can be admitted
+// at the same time when nothing else is running. If not, waiting and retrying cannot help
+gboolean
+admission_could_fit(Admission *self, guint tasks, gint64 pixels) {
+    g_return_val_if_fail(self, FALSE);
+
+    g_mutex_lock(&self->lock);
+    const gboolean fits = tasks <= self->max_tasks && (tasks <= 1 || pixels <= self->max_pixels);
+    g_mutex_unlock(&self->lock);
+    return fits;
+}
+
+// Whether @graph_id is at its limit, so more work for it would only queue up.
+// Counted as rejected, as caller is expected to drop the work
+gboolean
+admission_graph_busy(Admission *self, const gchar *graph_id) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(graph_id, FALSE);
+
+    g_mutex_lock(&self->lock);
+    const guint graph_tasks = GPOINTER_TO_UINT(g_hash_table_lookup(self->graph_tasks, graph_id));
+    const gboolean busy = graph_tasks >= self->max_graph_tasks;
+    if (busy) {
+        self->rejected[AdmissionGraphBusy]++;
+    }
+    g_mutex_unlock(&self->lock);
+    return busy;
+}
+
+void
+admission_write_metrics(Admission *self, GString *out) {
+    g_mutex_lock(&self->lock);
+    metrics_write_header(out, "imgflo_admission_rejected_total", "counter", "Render work rejected by reason");
+    for (int r=AdmissionAccepted+1; r<AdmissionResults; r++) {
+        g_string_append_printf(out, "imgflo_admission_rejected_total{reason=\"%s\"} %" G_GSIZE_FORMAT "\n",
+                               admission_result_names[r], self->rejected[r]);
+    }
+    metrics_write_value(out, "imgflo_admission_tasks", "gauge", "Admitted render tasks, queued or running",
+                        self->tasks);
+    metrics_write_value(out, "imgflo_admission_pixels", "gauge", "Estimated output pixels of admitted render tasks",
+                        self->pixels);
+    g_mutex_unlock(&self->lock);
+}
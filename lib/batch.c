@@ -0,0 +1,286 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Jobs of a POST /batch request. Body is JSON like
+//   { "jobs": [ { "graph": "g", "node": "n", "iips": { "node": { "port": value } },
+//                 "width": 200, "format": "jpeg", "quality": 80 }, ... ] }
+// Region keys are the same as for /process. Jobs for the same graph with the same IIP overrides
+// form a group, which is rendered together so upstream results are shared through GEGL caches
+
+#define BATCH_MAX_JOBS 256
+
+typedef struct _BatchJob {
+    guint index; // in request
+    gchar *node_id;
+    ProcessorRegion region;
+    ImageFormat format;
+    gint quality;
+} BatchJob;
+
+typedef struct _BatchGroup {
+    gchar *graph_id;
+    JsonObject *iips; // node -> { port -> value }, or NULL
+    gchar *key; // identifies graph and IIP overrides
+    GPtrArray *jobs; // of BatchJob
+} BatchGroup;
+
+static void
+batch_job_free(BatchJob *self) {
+    g_free(self->node_id);
+    g_free(self);
+}
+
+void
+batch_group_free(BatchGroup *self) {
+    g_free(self->graph_id);
+    if (self->iips) {
+        json_object_unref(self->iips);
+    }
+    g_free(self->key);
+    g_ptr_array_free(self->jobs, TRUE);
+    g_free(self);
+}
+
+// Same graph and overrides give the same key, regardless of member order
+static gchar *
+batch_group_key(const gchar *graph_id, JsonObject *iips) {
+    GString *key = g_string_new(graph_id);
+    GList *nodes = (iips) ? g_list_sort(json_object_get_members(iips), (GCompareFunc)g_strcmp0) : NULL;
+    for (GList *n = nodes; n; n = n->next) {
+        JsonObject *ports = json_object_get_object_member(iips, (const gchar *)n->data);
+        GList *names = g_list_sort(json_object_get_members(ports), (GCompareFunc)g_strcmp0);
+        for (GList *p = names; p; p = p->next) {
+            gchar *value = json_stringify_node(json_object_get_member(ports, (const gchar *)p->data), NULL);
+            g_string_append_printf(key, "\n%s %s %s", (const gchar *)n->data, (const gchar *)p->data, value);
+            g_free(value);
+        }
+        g_list_free(names);
+    }
+    g_list_free(nodes);
+    return g_string_free(key, FALSE);
+}
+
+// Returns NULL if member is missing or not a string
+static const gchar *
+batch_get_string(JsonObject *job, const gchar *key) {
+    JsonNode *node = json_object_get_member(job, key);
+    if (!node || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_STRING) {
+        return NULL;
+    }
+    return json_node_get_string(node);
+}
+
+// Returns FALSE if member is there but not a number
+static gboolean
+batch_get_number(JsonObject *job, const gchar *key, gdouble *out) {
+    JsonNode *node = json_object_get_member(job, key);
+    if (!node) {
+        return TRUE;
+    }
+    if (!JSON_NODE_HOLDS_VALUE(node)) {
+        return FALSE;
+    }
+    const GType type = json_node_get_value_type(node);
+    if (type != G_TYPE_INT64 && type != G_TYPE_DOUBLE) {
+        return FALSE;
+    }
+    *out = json_node_get_double(node);
+    return TRUE;
+}
+
+// IIP overrides must be an object of objects with value members
+static gboolean
+batch_iips_valid(JsonNode *iips) {
+    if (!JSON_NODE_HOLDS_OBJECT(iips)) {
+        return FALSE;
+    }
+    JsonObject *nodes = json_node_get_object(iips);
+    GList *names = json_object_get_members(nodes);
+    gboolean valid = TRUE;
+    for (GList *n = names; valid && n; n = n->next) {
+        JsonNode *ports = json_object_get_member(nodes, (const gchar *)n->data);
+        if (!JSON_NODE_HOLDS_OBJECT(ports)) {
+            valid = FALSE;
+            break;
+        }
+        GList *values = json_object_get_values(json_node_get_object(ports));
+        for (GList *v = values; v; v = v->next) {
+            valid = valid && JSON_NODE_HOLDS_VALUE((JsonNode *)v->data);
+        }
+        g_list_free(values);
+    }
+    g_list_free(names);
+    return valid;
+}
+
+static BatchJob *
+batch_job_parse(JsonObject *job, guint index, const gchar **invalid_out) {
+    const gchar *keys[] = { "x", "y", "width", "height", "scale", "maxwidth", "maxheight", "quality" };
+    gdouble values[G_N_ELEMENTS(keys)];
+    for (int i=0; i<G_N_ELEMENTS(keys); i++) {
+        values[i] = PROCESSOR_UNSET;
+        if (!batch_get_number(job, keys[i], &values[i])) {
+            *invalid_out = keys[i];
+            return NULL;
+        }
+    }
+    const gchar *node_id = batch_get_string(job, "node");
+    if (!node_id) {
+        *invalid_out = "node";
+        return NULL;
+    }
+    const ImageFormat format = json_object_has_member(job, "format") ?
+        image_format_from_name(batch_get_string(job, "format")) : ImageFormatPng;
+    if (format == ImageFormatInvalid) {
+        *invalid_out = "format";
+        return NULL;
+    }
+
+    ProcessorRegion region;
+    const gint out_of_range = processor_region_set_values(&region, values);
+    if (out_of_range >= 0) {
+        *invalid_out = keys[out_of_range];
+        return NULL;
+    }
+    if (values[7] != PROCESSOR_UNSET && !(values[7] >= 0 && values[7] <= 100)) {
+        *invalid_out = "quality";
+        return NULL;
+    }
+
+    BatchJob *self = g_new(BatchJob, 1);
+    self->index = index;
+    self->node_id = g_strdup(node_id);
+    self->region = region;
+    self->format = format;
+    self->quality = (values[7] != PROCESSOR_UNSET) ? (gint)values[7] : -1;
+    return self;
+}
+
+// Parse request body into groups of jobs, in order of first appearance.
+// Returns NULL with @error_out set if the request is invalid
+GPtrArray *
+batch_parse(const gchar *data, gsize length, guint *n_jobs_out, gchar **error_out) {
+    JsonParser *parser = json_parser_new();
+    if (!json_parser_load_from_data(parser, data, length, NULL)) {
+        g_object_unref(parser);
+        *error_out = g_strdup("Body is not valid JSON");
+        return NULL;
+    }
+    JsonNode *root = json_parser_get_root(parser);
+    JsonNode *jobs_node = (JSON_NODE_HOLDS_OBJECT(root)) ?
+        json_object_get_member(json_node_get_object(root), "jobs") : NULL;
+    if (!jobs_node || !JSON_NODE_HOLDS_ARRAY(jobs_node)) {
+        g_object_unref(parser);
+        *error_out = g_strdup("'jobs' not specified or not an array");
+        return NULL;
+    }
+    JsonArray *jobs = json_node_get_array(jobs_node);
+    const guint n_jobs = json_array_get_length(jobs);
+    if (n_jobs > BATCH_MAX_JOBS) {
+        g_object_unref(parser);
+        *error_out = g_strdup_printf("More than %d jobs", BATCH_MAX_JOBS);
+        return NULL;
+    }
+
+    GPtrArray *groups = g_ptr_array_new_with_free_func((GDestroyNotify)batch_group_free);
+    GHashTable *by_key = g_hash_table_new(g_str_hash, g_str_equal); // -> BatchGroup in groups
+    for (guint i = 0; i < n_jobs; i++) {
+        JsonNode *element = json_array_get_element(jobs, i);
+        JsonObject *job = (JSON_NODE_HOLDS_OBJECT(element)) ? json_node_get_object(element) : NULL;
+        const gchar *graph_id = (job) ? batch_get_string(job, "graph") : NULL;
+        JsonNode *iips = (job) ? json_object_get_member(job, "iips") : NULL;
+        const gchar *invalid = NULL;
+        BatchJob *parsed = NULL;
+        if (!graph_id) {
+            invalid = "graph";
+        } else if (iips && !batch_iips_valid(iips)) {
+            invalid = "iips";
+        } else {
+            parsed = batch_job_parse(job, i, &invalid);
+        }
+        if (!parsed) {
+            *error_out = g_strdup_printf("Job %u: '%s' not specified or invalid", i, invalid);
+            g_ptr_array_free(groups, TRUE);
+            groups = NULL;
+            break;
+        }
+
+        JsonObject *overrides = (iips) ? json_node_get_object(iips) : NULL;
+        gchar *key = batch_group_key(graph_id, overrides);
+        BatchGroup *group = g_hash_table_lookup(by_key, key);
+        if (group) {
+            g_free(key);
+        } else {
+            group = g_new(BatchGroup, 1);
+            group->graph_id = g_strdup(graph_id);
+            group->iips = (overrides) ? json_object_ref(overrides) : NULL;
+            group->key = key;
+            group->jobs = g_ptr_array_new_with_free_func((GDestroyNotify)batch_job_free);
+            g_ptr_array_add(groups, group);
+            g_hash_table_insert(by_key, group->key, group);
+        }
+        g_ptr_array_add(group->jobs, parsed);
+    }
+
+    g_hash_table_destroy(by_key);
+    g_object_unref(parser);
+    *n_jobs_out = n_jobs;
+    return groups;
+}
+
+// One line of the NDJSON response. @body is base64 encoded. Set @error instead if job failed
+gchar *
+batch_result_line(const BatchJob *job, const gchar *graph_id, guint status,
+                  const gchar *content_type, GBytes *body, const gchar *error) {
+    JsonObject *result = json_object_new();
+    json_object_set_int_member(result, "index", job->index);
+    json_object_set_string_member(result, "graph", graph_id);
+    json_object_set_string_member(result, "node", job->node_id);
+    json_object_set_int_member(result, "status", status);
+    if (body) {
+        gsize size = 0;
+        const guchar *data = (const guchar *)g_bytes_get_data(body, &size);
+        gchar *encoded = g_base64_encode(data, size);
+        json_object_set_string_member(result, "type", content_type);
+        json_object_set_string_member(result, "body", encoded);
+        g_free(encoded);
+    } else {
+        json_object_set_string_member(result, "error", (error) ? error : soup_status_get_phrase(status));
+    }
+
+    gsize length = 0;
+    gchar *json = json_stringify(result, &length);
+    gchar *line = g_realloc(json, length+2);
+    line[length] = '\n';
+    line[length+1] = '\0';
+    return line;
+}
+
+// Set the IIP overrides of @self on @graph. Only used on snapshots, which are discarded
+// once changed, so nobody else sees the overrides
+void
+batch_group_apply(BatchGroup *self, Graph *graph) {
+    GList *nodes = (self->iips) ? json_object_get_members(self->iips) : NULL;
+    for (GList *n = nodes; n; n = n->next) {
+        const gchar *node = (const gchar *)n->data;
+        JsonObject *ports = json_object_get_object_member(self->iips, node);
+        GList *names = json_object_get_members(ports);
+        for (GList *p = names; p; p = p->next) {
+            const gchar *port = (const gchar *)p->data;
+            GValue old = G_VALUE_INIT;
+            if (!graph_get_iip(graph, node, port, &old)) {
+                imgflo_warning("Batch: node '%s' has no property '%s'\n", node, port);
+                continue;
+            }
+            g_value_unset(&old);
+
+            GValue value = G_VALUE_INIT;
+            json_node_get_value(json_object_get_member(ports, port), &value);
+            graph_add_iip(graph, node, port, &value);
+            g_value_unset(&value);
+        }
+        g_list_free(names);
+    }
+    g_list_free(nodes);
+}
@@ -0,0 +1,95 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Least-recently-used cache of HTTP response bodies, bounded by total size
+
+typedef struct _ResponseCacheEntry {
+    gchar *key;
+    gchar *content_type;
+    GBytes *body;
+    GList *link; // in ResponseCache.lru
+} ResponseCacheEntry;
+
+typedef struct _ResponseCache {
+    GHashTable *entries; // key -> ResponseCacheEntry
+    GQueue *lru; // of ResponseCacheEntry, most recently used first
+    gsize size; // total bytes of bodies
+    gsize max_size;
+} ResponseCache;
+
+static void
+response_cache_entry_free(ResponseCacheEntry *self) {
+    g_free(self->key);
+    g_free(self->content_type);
+    g_bytes_unref(self->body);
+    g_free(self);
+}
+
+ResponseCache *
+response_cache_new(gsize max_size) {
+    ResponseCache *self = g_new(ResponseCache, 1);
+    self->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          NULL, (GDestroyNotify)response_cache_entry_free);
+    self->lru = g_queue_new();
+    self->size = 0;
+    self->max_size = max_size;
+    return self;
+}
+
+void
+response_cache_free(ResponseCache *self) {
+    g_queue_free(self->lru);
+    g_hash_table_destroy(self->entries);
+    g_free(self);
+}
+
+static void
+response_cache_remove(ResponseCache *self, ResponseCacheEntry *entry) {
+    g_queue_delete_link(self->lru, entry->link);
+    self->size -= g_bytes_get_size(entry->body);
+    g_hash_table_remove(self->entries, entry->key);
+}
+
+// Returns borrowed entry for @key, or NULL
+ResponseCacheEntry *
+response_cache_lookup(ResponseCache *self, const gchar *key) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(key, NULL);
+
+    ResponseCacheEntry *entry = g_hash_table_lookup(self->entries, key);
+    if (entry) {
+        g_queue_unlink(self->lru, entry->link);
+        g_queue_push_head_link(self->lru, entry->link);
+    }
+    return entry;
+}
+
+// Takes a reference to @body. Evicts least recently used entries to stay within max_size
+void
+response_cache_insert(ResponseCache *self, const gchar *key, const gchar *content_type, GBytes *body) {
+    g_return_if_fail(self);
+    g_return_if_fail(key);
+    g_return_if_fail(body);
+
+    const gsize size = g_bytes_get_size(body);
+    if (size > self->max_size) {
+        return;
+    }
+    ResponseCacheEntry *existing = g_hash_table_lookup(self->entries, key);
+    if (existing) {
+        response_cache_remove(self, existing);
+    }
+    while (self->size + size > self->max_size && !g_queue_is_empty(self->lru)) {
+        response_cache_remove(self, (ResponseCacheEntry *)g_queue_peek_tail(self->lru));
+    }
+
+    ResponseCacheEntry *entry = g_new(ResponseCacheEntry, 1);
+    entry->key = g_strdup(key);
+    entry->content_type = g_strdup(content_type);
+    entry->body = g_bytes_ref(body);
+    g_queue_push_head(self->lru, entry);
+    entry->link = g_queue_peek_head_link(self->lru);
+    g_hash_table_insert(self->entries, entry->key, entry);
+    self->size += size;
+}
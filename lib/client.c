@@ -0,0 +1,376 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// A WebSocket client of the runtime, with its own outbound queue.
+// Messages are only handed to libsoup while the socket is writable, so a slow client
+// queues up here where stale preview messages can be coalesced or dropped.
+// Clients which send MessagePack binary frames get binary frames back, others JSON text.
+// Clients may also ask for preview images, which are pushed as binary frames of their own
+
+#include <libsoup/soup.h>
+
+#define UI_CLIENT_HIGH_WATERMARK (1*1024*1024) // above this, droppable messages are not queued
+#define UI_CLIENT_MAX_QUEUED (32*1024*1024) // above this, client is disconnected
+
+typedef struct _UiClientMessage {
+    GBytes *data; // may be shared between clients. JSON text is NUL-terminated
+    gboolean binary; // MessagePack
+    gchar *key; // messages with same key replace each other, NULL if message must be delivered
+} UiClientMessage;
+
+// How a client wants preview images pushed. Clients with equal settings share the same frames
+typedef struct _UiClientPreviews {
+    ImageFormat format;
+    gint quality; // -1 for default
+    gint max_width; // PROCESSOR_UNSET for whole output
+    gint max_height;
+} UiClientPreviews;
+
+typedef struct _UiClient {
+    SoupWebsocketConnection *ws;
+    GQueue *outbox; // of UiClientMessage
+    GHashTable *pending; // key -> UiClientMessage in outbox
+    gsize queued_bytes;
+    guint flush_idle;
+    GSource *writable_source; // while waiting for socket to drain
+    gboolean closed;
+    gboolean binary; // client has sent MessagePack
+    UiClientPreviews *previews; // NULL unless client wants preview images pushed
+    guint dropped; // droppable messages not sent because client was too slow
+    // Notifications with the same key are sent at most once per debounce interval.
+    // Latest one held back is sent when the interval is over
+    gint64 debounce; // microseconds, 0 to send every notification
+    GHashTable *last_sent; // key -> gint64 *, monotonic time
+    GHashTable *deferred; // key -> UiClientMessage
+    guint deferred_timeout;
+} UiClient;
+
+static void
+ui_client_message_free(UiClientMessage *self) {
+    g_bytes_unref(self->data);
+    g_free(self->key);
+    g_free(self);
+}
+
+// Picks the encoding @client wants. @packed may be NULL if client does not use MessagePack
+static UiClientMessage *
+ui_client_message_new(UiClient *client, GBytes *json, GBytes *packed, const gchar *key) {
+    UiClientMessage *self = g_new(UiClientMessage, 1);
+    self->binary = client->binary && packed;
+    self->data = g_bytes_ref((self->binary) ? packed : json);
+    self->key = g_strdup(key);
+    return self;
+}
+
+UiClient *
+ui_client_new(SoupWebsocketConnection *ws) {
+    g_return_val_if_fail(ws, NULL);
+
+    UiClient *self = g_new0(UiClient, 1);
+    self->ws = g_object_ref(ws);
+    self->outbox = g_queue_new();
+    self->pending = g_hash_table_new(g_str_hash, g_str_equal);
+    self->last_sent = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    // Key is owned by the message
+    self->deferred = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)ui_client_message_free);
+    g_object_set_data(G_OBJECT(ws), "imgflo-client", self);
+    return self;
+}
+
+UiClient *
+ui_client_from_ws(SoupWebsocketConnection *ws) {
+    return (ws) ? (UiClient *)g_object_get_data(G_OBJECT(ws), "imgflo-client") : NULL;
+}
+
+static void
+ui_client_clear(UiClient *self) {
+    if (self->deferred_timeout) {
+        g_source_remove(self->deferred_timeout);
+        self->deferred_timeout = 0;
+    }
+    g_hash_table_remove_all(self->deferred);
+    g_hash_table_remove_all(self->pending);
+    g_queue_free_full(self->outbox, (GDestroyNotify)ui_client_message_free);
+    self->outbox = g_queue_new();
+    self->queued_bytes = 0;
+}
+
+void
+ui_client_free(UiClient *self) {
+    if (self->flush_idle) {
+        g_source_remove(self->flush_idle);
+    }
+    if (self->deferred_timeout) {
+        g_source_remove(self->deferred_timeout);
+    }
+    if (self->writable_source) {
+        g_source_destroy(self->writable_source);
+        g_source_unref(self->writable_source);
+    }
+    g_object_set_data(G_OBJECT(self->ws), "imgflo-client", NULL);
+    g_hash_table_destroy(self->pending);
+    g_hash_table_destroy(self->last_sent);
+    g_hash_table_destroy(self->deferred);
+    g_queue_free_full(self->outbox, (GDestroyNotify)ui_client_message_free);
+    g_object_unref(self->ws);
+    g_free(self->previews);
+    g_free(self);
+}
+
+static gboolean
+ui_client_free_idle(gpointer user_data) {
+    ui_client_free((UiClient *)user_data);
+    return FALSE;
+}
+
+// Client is going away. Actual free happens from main loop, as this may be called while sending
+void
+ui_client_close(UiClient *self) {
+    self->closed = TRUE;
+    ui_client_clear(self);
+    g_object_set_data(G_OBJECT(self->ws), "imgflo-client", NULL);
+    g_idle_add(ui_client_free_idle, self);
+}
+
+static GPollableOutputStream *
+ui_client_output_stream(UiClient *self) {
+    GIOStream *io = soup_websocket_connection_get_io_stream(self->ws);
+    GOutputStream *out = (io) ? g_io_stream_get_output_stream(io) : NULL;
+    return (out && G_IS_POLLABLE_OUTPUT_STREAM(out)) ? G_POLLABLE_OUTPUT_STREAM(out) : NULL;
+}
+
+static gboolean ui_client_flush(gpointer user_data);
+
+static gboolean
+ui_client_on_writable(GObject *stream, gpointer user_data) {
+    UiClient *self = (UiClient *)user_data;
+    g_source_unref(self->writable_source);
+    self->writable_source = NULL;
+    ui_client_flush(self);
+    return FALSE;
+}
+
+static gboolean
+ui_client_flush(gpointer user_data) {
+    UiClient *self = (UiClient *)user_data;
+    self->flush_idle = 0;
+
+    GPollableOutputStream *out = ui_client_output_stream(self);
+    while (!self->closed && !g_queue_is_empty(self->outbox)) {
+        if (soup_websocket_connection_get_state(self->ws) != SOUP_WEBSOCKET_STATE_OPEN) {
+            ui_client_clear(self);
+            break;
+        }
+        if (out && !g_pollable_output_stream_is_writable(out)) {
+            // Resume once the socket has drained
+            self->writable_source = g_pollable_output_stream_create_source(out, NULL);
+            g_source_set_callback(self->writable_source, (GSourceFunc)ui_client_on_writable, self, NULL);
+            g_source_attach(self->writable_source, NULL);
+            break;
+        }
+        UiClientMessage *msg = (UiClientMessage *)g_queue_pop_head(self->outbox);
+        if (msg->key) {
+            g_hash_table_remove(self->pending, msg->key);
+        }
+        self->queued_bytes -= g_bytes_get_size(msg->data);
+        // May emit 'closed' or 'error' synchronously, which only marks us closed
+        if (msg->binary) {
+            gsize size = 0;
+            gconstpointer data = g_bytes_get_data(msg->data, &size);
+            soup_websocket_connection_send_binary(self->ws, data, size);
+        } else {
+            soup_websocket_connection_send_text(self->ws, (const gchar *)g_bytes_get_data(msg->data, NULL));
+        }
+        ui_client_message_free(msg);
+    }
+    return FALSE;
+}
+
+// Takes ownership of @msg
+static void
+ui_client_queue(UiClient *self, UiClientMessage *msg) {
+    const gsize size = g_bytes_get_size(msg->data);
+    UiClientMessage *existing = (msg->key) ? g_hash_table_lookup(self->pending, msg->key) : NULL;
+    if (existing) {
+        // Not sent yet, client only needs the latest one
+        self->queued_bytes += size - g_bytes_get_size(existing->data);
+        g_bytes_unref(existing->data);
+        existing->data = g_bytes_ref(msg->data);
+        existing->binary = msg->binary;
+        ui_client_message_free(msg);
+        return;
+    }
+    if (msg->key && self->queued_bytes >= UI_CLIENT_HIGH_WATERMARK) {
+        self->dropped++;
+        ui_client_message_free(msg);
+        return;
+    }
+    if (self->queued_bytes + size > UI_CLIENT_MAX_QUEUED) {
+        // Client is not reading, do not let it consume unbounded memory
+        ui_client_message_free(msg);
+        ui_client_clear(self);
+        soup_websocket_connection_close(self->ws, SOUP_WEBSOCKET_CLOSE_POLICY_VIOLATION, "Client too slow");
+        return;
+    }
+
+    g_queue_push_tail(self->outbox, msg);
+    if (msg->key) {
+        g_hash_table_insert(self->pending, msg->key, msg);
+    }
+    self->queued_bytes += size;
+
+    if (!self->flush_idle && !self->writable_source) {
+        self->flush_idle = g_idle_add(ui_client_flush, self);
+    }
+}
+
+// Send held back notifications whose interval is over, and wait for the rest
+static gboolean
+ui_client_send_deferred(gpointer user_data) {
+    UiClient *self = (UiClient *)user_data;
+    self->deferred_timeout = 0;
+
+    const gint64 now = g_get_monotonic_time();
+    gint64 next = G_MAXINT64;
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, self->deferred);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        gint64 *last = (gint64 *)g_hash_table_lookup(self->last_sent, key);
+        const gint64 due = (last) ? *last + self->debounce : now;
+        if (due <= now) {
+            if (last) {
+                *last = now;
+            }
+            g_hash_table_iter_steal(&iter);
+            ui_client_queue(self, (UiClientMessage *)value);
+        } else if (due < next) {
+            next = due;
+        }
+    }
+    if (next != G_MAXINT64) {
+        self->deferred_timeout = g_timeout_add((next - now)/1000 + 1, ui_client_send_deferred, self);
+    }
+    return FALSE;
+}
+
+// Takes ownership of @msg. Notifications are debounced
+static void
+ui_client_submit(UiClient *self, UiClientMessage *msg) {
+    const gchar *key = msg->key;
+    if (key && self->debounce > 0) {
+        const gint64 now = g_get_monotonic_time();
+        gint64 *last = (gint64 *)g_hash_table_lookup(self->last_sent, key);
+        if (last && now - *last < self->debounce) {
+            g_hash_table_replace(self->deferred, msg->key, msg);
+            if (!self->deferred_timeout) {
+                const guint wait_ms = (*last + self->debounce - now)/1000 + 1;
+                self->deferred_timeout = g_timeout_add(wait_ms, ui_client_send_deferred, self);
+            }
+            return;
+        }
+        if (!last) {
+            last = g_new(gint64, 1);
+            g_hash_table_insert(self->last_sent, g_strdup(key), last);
+        }
+        *last = now;
+        // A newer notification supersedes one held back
+        g_hash_table_remove(self->deferred, key);
+    }
+    ui_client_queue(self, msg);
+}
+
+// Queue a message for sending, as NUL-terminated @json text or as MessagePack @packed,
+// depending on what the client uses. @packed may be NULL if !ui_client_is_binary().
+// If @key is set the message is a notification, which may be debounced,
+// replaced by a newer one with same key, or dropped if client is too slow
+void
+ui_client_send(UiClient *self, GBytes *json, GBytes *packed, const gchar *key) {
+    g_return_if_fail(self);
+    g_return_if_fail(json || packed);
+    if (self->closed) {
+        return;
+    }
+    ui_client_submit(self, ui_client_message_new(self, json, packed, key));
+}
+
+// Queue @frame to be sent as a binary frame as is, whatever encoding client uses.
+// Like a notification for @key, see ui_client_send()
+void
+ui_client_send_frame(UiClient *self, GBytes *frame, const gchar *key) {
+    g_return_if_fail(self);
+    g_return_if_fail(frame);
+    g_return_if_fail(key);
+    if (self->closed) {
+        return;
+    }
+    UiClientMessage *msg = g_new(UiClientMessage, 1);
+    msg->binary = TRUE;
+    msg->data = g_bytes_ref(frame);
+    msg->key = g_strdup(key);
+    ui_client_submit(self, msg);
+}
+
+gboolean
+ui_client_is_binary(UiClient *self) {
+    return self->binary;
+}
+
+// Called when client sent a MessagePack message, replies will then be in MessagePack too
+void
+ui_client_set_binary(UiClient *self) {
+    self->binary = TRUE;
+}
+
+// Push preview images with @previews, or stop if NULL
+void
+ui_client_set_previews(UiClient *self, const UiClientPreviews *previews) {
+    g_return_if_fail(self);
+    g_free(self->previews);
+    self->previews = NULL;
+    if (previews) {
+        self->previews = g_new(UiClientPreviews, 1);
+        *self->previews = *previews;
+    }
+}
+
+// Returns NULL if client does not want previews pushed
+const UiClientPreviews *
+ui_client_get_previews(UiClient *self) {
+    return self->previews;
+}
+
+// Identifies @previews settings, equal for clients which can share frames
+gchar *
+ui_client_previews_key(const UiClientPreviews *previews) {
+    return g_strdup_printf("%d %d %d %d", previews->format, previews->quality,
+                           previews->max_width, previews->max_height);
+}
+
+// Minimum time between notifications with the same key, 0 to send all of them
+void
+ui_client_set_debounce(UiClient *self, guint interval_ms) {
+    g_return_if_fail(self);
+    self->debounce = (gint64)interval_ms*1000;
+    if (self->debounce == 0) {
+        ui_client_send_deferred(self);
+    }
+}
+
+// Send pre-serialized JSON @text. Does nothing if @self is NULL, like for a client which already went away
+void
+ui_client_send_text(UiClient *self, const gchar *text) {
+    g_return_if_fail(text);
+    if (!self) {
+        return;
+    }
+    GBytes *json = g_bytes_new(text, strlen(text)+1);
+    GBytes *packed = (self->binary) ? msgpack_from_json_text(text) : NULL;
+    ui_client_send(self, json, packed, NULL);
+    g_bytes_unref(json);
+    if (packed) {
+        g_bytes_unref(packed);
+    }
+}
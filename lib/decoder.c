@@ -0,0 +1,62 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Decoding of uploaded images straight from memory into GEGL buffers
+
+#include <stdlib.h>
+#include <gegl.h>
+
+#define IMAGE_DECODE_MAX_PIXELS (64*1024*1024)
+
+// Recognizes PNG, JPEG and WebP by their signature. Returns ImageFormatInvalid otherwise
+ImageFormat
+image_format_sniff(const guint8 *data, gsize size) {
+    static const guint8 png_signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (size >= sizeof(png_signature) && memcmp(data, png_signature, sizeof(png_signature)) == 0) {
+        return ImageFormatPng;
+    }
+    if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
+        return ImageFormatJpeg;
+    }
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data+8, "WEBP", 4) == 0) {
+        return ImageFormatWebp;
+    }
+    return ImageFormatInvalid;
+}
+
+// Returns a new buffer using the decoded pixels without copying, or NULL if @data could not be decoded
+GeglBuffer *
+image_decode(const guint8 *data, gsize size) {
+    g_return_val_if_fail(data, NULL);
+
+    int width = 0;
+    int height = 0;
+    gchar *pixels = NULL;
+    const Babl *format = NULL;
+    GDestroyNotify free_pixels = g_free;
+    switch (image_format_sniff(data, size)) {
+    case ImageFormatPng:
+        pixels = png_decode_rgba(data, size, IMAGE_DECODE_MAX_PIXELS, &width, &height);
+        format = babl_format("R'G'B'A u8");
+        break;
+    case ImageFormatJpeg:
+        pixels = jpeg_decode_rgb(data, size, IMAGE_DECODE_MAX_PIXELS, &width, &height);
+        format = babl_format("R'G'B' u8");
+        break;
+    case ImageFormatWebp:
+        pixels = webp_decode_rgba(data, size, IMAGE_DECODE_MAX_PIXELS, &width, &height);
+        format = babl_format("R'G'B'A u8");
+        free_pixels = free; // allocated by libwebp
+        break;
+    default:
+        return NULL;
+    }
+    if (!pixels) {
+        return NULL;
+    }
+
+    const GeglRectangle extent = { 0, 0, width, height };
+    return gegl_buffer_linear_new_from_data(pixels, format, &extent, GEGL_AUTO_ROWSTRIDE,
+                                            free_pixels, pixels);
+}
@@ -0,0 +1,223 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Encoding of RGBA u8 buffers to the image formats imgflo can serve
+
+typedef enum _ImageFormat {
+    ImageFormatPng = 0,
+    ImageFormatJpeg,
+    ImageFormatWebp,
+    ImageFormatInvalid
+} ImageFormat;
+
+typedef struct _ImageFormatInfo {
+    ImageFormat format;
+    const gchar *name;
+    const gchar *mimetype;
+    gint default_quality; // -1 if format has no quality setting
+} ImageFormatInfo;
+
+static const ImageFormatInfo image_formats[] = {
+    { ImageFormatPng, "png", "image/png", -1 },
+    { ImageFormatJpeg, "jpeg", "image/jpeg", 85 },
+    { ImageFormatWebp, "webp", "image/webp", 80 },
+};
+
+typedef struct _ImageEncoder {
+    ImageFormat format;
+    gint quality;
+    gchar *buffer; // encoded data
+    gsize size;
+    // Incremental encoding, see image_encoder_begin()
+    PngEncoder *png;
+    JpegEncoder *jpeg;
+} ImageEncoder;
+
+const gchar *
+image_format_mimetype(ImageFormat format) {
+    g_return_val_if_fail(format < ImageFormatInvalid, NULL);
+    return image_formats[format].mimetype;
+}
+
+// Accepts "png", "jpeg", "jpg" and "webp". Returns ImageFormatInvalid otherwise
+ImageFormat
+image_format_from_name(const gchar *name) {
+    if (g_strcmp0(name, "jpg") == 0) {
+        return ImageFormatJpeg;
+    }
+    for (int i=0; i<G_N_ELEMENTS(image_formats); i++) {
+        if (g_strcmp0(name, image_formats[i].name) == 0) {
+            return image_formats[i].format;
+        }
+    }
+    return ImageFormatInvalid;
+}
+
+// Picks the supported format with the highest q-value in HTTP Accept header @accept, the first listed
+// if several have it. Wildcards and missing header give PNG, so existing clients are unaffected
+ImageFormat
+image_format_from_accept(const gchar *accept) {
+    if (!accept) {
+        return ImageFormatPng;
+    }
+    ImageFormat format = ImageFormatPng;
+    gdouble best = 0.0;
+    gchar **types = g_strsplit(accept, ",", 0);
+    for (int i=0; types[i]; i++) {
+        gchar **params = g_strsplit(types[i], ";", 0);
+        const gchar *mimetype = g_strstrip(params[0]);
+        gdouble q = 1.0;
+        for (int p=1; params[p]; p++) {
+            const gchar *param = g_strstrip(params[p]);
+            if (g_str_has_prefix(param, "q=")) {
+                q = g_ascii_strtod(param+2, NULL);
+            }
+        }
+        ImageFormat matched = ImageFormatInvalid;
+        if (g_strcmp0(mimetype, "image/*") == 0 || g_strcmp0(mimetype, "*/*") == 0) {
+            matched = ImageFormatPng;
+        }
+        for (int f=0; f<G_N_ELEMENTS(image_formats); f++) {
+            if (g_ascii_strcasecmp(mimetype, image_formats[f].mimetype) == 0) {
+                matched = image_formats[f].format;
+            }
+        }
+        if (matched != ImageFormatInvalid && q > best) {
+            format = matched;
+            best = q;
+        }
+        g_strfreev(params);
+    }
+    g_strfreev(types);
+    return format;
+}
+
+// @quality is 0-100, or < 0 for the default of @format
+ImageEncoder *
+image_encoder_new(ImageFormat format, gint quality) {
+    g_return_val_if_fail(format < ImageFormatInvalid, NULL);
+    ImageEncoder *self = g_new(ImageEncoder, 1);
+    self->format = format;
+    self->quality = (quality >= 0) ? CLAMP(quality, 0, 100) : image_formats[format].default_quality;
+    self->buffer = NULL;
+    self->size = 0;
+    self->png = NULL;
+    self->jpeg = NULL;
+    return self;
+}
+
+void
+image_encoder_free(ImageEncoder *self) {
+    if (self->png) {
+        png_encoder_free(self->png);
+    }
+    if (self->jpeg) {
+        jpeg_encoder_free(self->jpeg);
+    }
+    if (self->buffer) {
+        g_free(self->buffer);
+    }
+    g_free(self);
+}
+
+const gchar *
+image_encoder_mimetype(ImageEncoder *self) {
+    return image_format_mimetype(self->format);
+}
+
+// Whether @format can be encoded a few rows at a time. WebP needs the whole image
+gboolean
+image_format_supports_streaming(ImageFormat format) {
+    return format == ImageFormatPng || format == ImageFormatJpeg;
+}
+
+// Start incremental encoding of a @width x @height R'G'B'A u8 image.
+// Rows are given with image_encoder_write_rows(), and output taken with image_encoder_take_output()
+gboolean
+image_encoder_begin(ImageEncoder *self, int width, int height) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(image_format_supports_streaming(self->format), FALSE);
+    g_return_val_if_fail(!self->png && !self->jpeg, FALSE);
+
+    if (self->format == ImageFormatJpeg) {
+        self->jpeg = jpeg_encoder_new();
+        return jpeg_encoder_begin(self->jpeg, width, height, self->quality);
+    } else {
+        self->png = png_encoder_new();
+        return png_encoder_begin(self->png, width, height);
+    }
+}
+
+gboolean
+image_encoder_write_rows(ImageEncoder *self, const gchar *buffer, int rows) {
+    g_return_val_if_fail(self, FALSE);
+    if (self->jpeg) {
+        return jpeg_encoder_write_rows(self->jpeg, buffer, rows);
+    } else if (self->png) {
+        return png_encoder_write_rows(self->png, buffer, rows);
+    }
+    g_return_val_if_reached(FALSE);
+}
+
+gboolean
+image_encoder_finish(ImageEncoder *self) {
+    g_return_val_if_fail(self, FALSE);
+    if (self->jpeg) {
+        return jpeg_encoder_finish(self->jpeg);
+    } else if (self->png) {
+        return png_encoder_finish(self->png);
+    }
+    g_return_val_if_reached(FALSE);
+}
+
+// Moves encoded data out of the backend encoder without copying
+static gchar *
+image_encoder_steal_buffer(ImageEncoder *self, gsize *size_out) {
+    gchar **buffer = (self->jpeg) ? &self->jpeg->buffer : &self->png->buffer;
+    size_t *size = (self->jpeg) ? &self->jpeg->size : &self->png->size;
+    size_t *capacity = (self->jpeg) ? &self->jpeg->capacity : &self->png->capacity;
+    gchar *data = *buffer;
+    *size_out = *size;
+    *buffer = NULL;
+    *size = 0;
+    *capacity = 0;
+    return data;
+}
+
+// Returns encoded data produced since last call, possibly empty
+GBytes *
+image_encoder_take_output(ImageEncoder *self) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(self->png || self->jpeg, NULL);
+    gsize size = 0;
+    gchar *data = image_encoder_steal_buffer(self, &size);
+    return g_bytes_new_take(data, size);
+}
+
+// Encode R'G'B'A u8 @buffer. Result is in self->buffer and self->size
+gboolean
+image_encoder_encode_rgba(ImageEncoder *self, int width, int height, gchar *buffer) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(!self->buffer, FALSE);
+
+    gboolean success = FALSE;
+    if (self->format == ImageFormatWebp) {
+        WebpEncoder *encoder = webp_encoder_new();
+        success = webp_encoder_encode_rgba(encoder, width, height, buffer, self->quality);
+        self->buffer = encoder->buffer;
+        self->size = encoder->size;
+        encoder->buffer = NULL;
+        webp_encoder_free(encoder);
+    } else {
+        success = image_encoder_begin(self, width, height) &&
+            image_encoder_write_rows(self, buffer, height) &&
+            image_encoder_finish(self);
+        self->buffer = image_encoder_steal_buffer(self, &self->size);
+        // Output grows geometrically, give back the slack since result may live long in a cache
+        if (self->buffer && self->size > 0) {
+            self->buffer = g_realloc(self->buffer, self->size);
+        }
+    }
+    return success;
+}
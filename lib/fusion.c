@@ -0,0 +1,474 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Fusion of point-filter chains.
+// A chain like levels -> brightness-contrast -> saturation makes one pass over memory per operation.
+// It is replaced by a single generated operation which runs each pixel block through all of them.
+// One point composer, like multiply, may be part of a chain. Its aux input becomes that of the fused operation.
+// The fused operation calls process() of the original operation instances, so IIPs sent to
+// the original nodes still apply. These stay connected, so each can still be rendered on its own.
+// Built operations are persisted by Library, so a chain is only compiled once per setup
+
+static const gint FUSION_MIN_CHAIN = 2;
+static const gint FUSION_MAX_COMPOSERS = 1; // fused operation has a single aux pad
+
+static const gchar * const FUSION_TEMPLATE_HEAD =
+"/* Generated by imgflo: fused point filters %s */\n"
+"\n"
+"#define N_STAGES %d\n"
+"#define COMPOSER_STAGE %d /* stage getting the aux input, -1 if none */\n"
+"#define BLOCK_SAMPLES 1024\n"
+"\n"
+"#ifdef GEGL_PROPERTIES\n"
+"property_pointer (stages, \"Stages\", \"NULL-terminated array of the fused GeglOperation instances\")\n"
+"#else\n"
+"\n"
+"#if COMPOSER_STAGE >= 0\n"
+"#define GEGL_OP_POINT_COMPOSER\n"
+"#else\n"
+"#define GEGL_OP_POINT_FILTER\n"
+"#endif\n"
+"#ifndef GEGL_OP_NAME\n"
+"#define GEGL_OP_NAME imgflo_fused\n"
+"#endif\n"
+"#include \"gegl-op.h\"\n"
+"\n"
+"#ifndef IMGFLO_OP_NAME\n"
+"#define IMGFLO_OP_NAME(orig) orig\n"
+"#endif\n"
+"\n"
+"static const char * const stage_operations[N_STAGES] = {\n";
+
+static const gchar * const FUSION_TEMPLATE_BODY =
+"};\n"
+"\n"
+"static GeglOperation **\n"
+"get_stages(GeglOperation *operation)\n"
+"{\n"
+"    GeglProperties *o = GEGL_PROPERTIES(operation);\n"
+"    GeglOperation **stages = (GeglOperation **)o->stages;\n"
+"    if (!stages) {\n"
+"        return NULL;\n"
+"    }\n"
+"    for (int i=0; i<N_STAGES; i++) {\n"
+"        if (!stages[i] || g_strcmp0(gegl_operation_get_name(stages[i]), stage_operations[i]) != 0) {\n"
+"            return NULL;\n"
+"        }\n"
+"    }\n"
+"    return stages;\n"
+"}\n"
+"\n"
+"static void\n"
+"prepare(GeglOperation *operation)\n"
+"{\n"
+"    GeglOperation **stages = get_stages(operation);\n"
+"    if (!stages) {\n"
+"        const Babl *format = babl_format(\"RGBA float\");\n"
+"        gegl_operation_set_format(operation, \"input\", format);\n"
+"        gegl_operation_set_format(operation, \"output\", format);\n"
+"#if COMPOSER_STAGE >= 0\n"
+"        gegl_operation_set_format(operation, \"aux\", format);\n"
+"#endif\n"
+"        return;\n"
+"    }\n"
+"    for (int i=0; i<N_STAGES; i++) {\n"
+"        GeglOperationClass *klass = GEGL_OPERATION_GET_CLASS(stages[i]);\n"
+"        if (klass->prepare) {\n"
+"            klass->prepare(stages[i]);\n"
+"        }\n"
+"    }\n"
+"    gegl_operation_set_format(operation, \"input\", gegl_operation_get_format(stages[0], \"input\"));\n"
+"    gegl_operation_set_format(operation, \"output\", gegl_operation_get_format(stages[N_STAGES-1], \"output\"));\n"
+"#if COMPOSER_STAGE >= 0\n"
+"    gegl_operation_set_format(operation, \"aux\", gegl_operation_get_format(stages[COMPOSER_STAGE], \"aux\"));\n"
+"#endif\n"
+"}\n"
+"\n"
+"static gboolean\n"
+"#if COMPOSER_STAGE >= 0\n"
+"process(GeglOperation *operation, void *in_buf, void *aux_buf, void *out_buf, glong samples,\n"
+"        const GeglRectangle *roi, gint level)\n"
+"#else\n"
+"process(GeglOperation *operation, void *in_buf, void *out_buf, glong samples,\n"
+"        const GeglRectangle *roi, gint level)\n"
+"#endif\n"
+"{\n"
+"    GeglOperation **stages = get_stages(operation);\n"
+"    if (!stages) {\n"
+"        return FALSE;\n"
+"    }\n"
+"#if COMPOSER_STAGE >= 0\n"
+"    const gint aux_bpp = babl_format_get_bytes_per_pixel(gegl_operation_get_format(stages[COMPOSER_STAGE], \"aux\"));\n"
+"#endif\n"
+"\n"
+"    const Babl *in_formats[N_STAGES];\n"
+"    const Babl *out_formats[N_STAGES];\n"
+"    gint bpp = 0;\n"
+"    for (int i=0; i<N_STAGES; i++) {\n"
+"        in_formats[i] = gegl_operation_get_format(stages[i], \"input\");\n"
+"        out_formats[i] = gegl_operation_get_format(stages[i], \"output\");\n"
+"        bpp = MAX(bpp, babl_format_get_bytes_per_pixel(in_formats[i]));\n"
+"        bpp = MAX(bpp, babl_format_get_bytes_per_pixel(out_formats[i]));\n"
+"    }\n"
+"    const gint in_bpp = babl_format_get_bytes_per_pixel(in_formats[0]);\n"
+"    const gint out_bpp = babl_format_get_bytes_per_pixel(out_formats[N_STAGES-1]);\n"
+"\n"
+"    // Blocks of whole rows where possible, so each stage gets the rectangle its samples are from\n"
+"    const gboolean by_rows = roi && roi->width > 0 && (glong)roi->width*roi->height == samples;\n"
+"    const glong block_samples = (by_rows) ? MAX(1, BLOCK_SAMPLES/roi->width)*roi->width : BLOCK_SAMPLES;\n"
+"\n"
+"    // Intermediate results only ever live in these, small enough to stay in cache\n"
+"    guchar *scratch = g_malloc(3*block_samples*bpp);\n"
+"    guchar *intermediate[2] = { scratch, scratch + block_samples*bpp };\n"
+"    guchar *converted = scratch + 2*block_samples*bpp;\n"
+"\n"
+"    gboolean success = TRUE;\n"
+"    for (glong done=0; success && done<samples; done+=block_samples) {\n"
+"        const glong n = MIN(block_samples, samples-done);\n"
+"        GeglRectangle block = { 0, 0, 0, 0 };\n"
+"        const GeglRectangle *block_roi = roi;\n"
+"        if (by_rows) {\n"
+"            block.x = roi->x;\n"
+"            block.y = roi->y + done/roi->width;\n"
+"            block.width = roi->width;\n"
+"            block.height = n/roi->width;\n"
+"            block_roi = &block;\n"
+"        }\n"
+"        guchar *src = (guchar *)in_buf + done*in_bpp;\n"
+"        for (int i=0; success && i<N_STAGES; i++) {\n"
+"            if (i > 0 && out_formats[i-1] != in_formats[i]) {\n"
+"                babl_process(babl_fish(out_formats[i-1], in_formats[i]), src, converted, n);\n"
+"                src = converted;\n"
+"            }\n"
+"            guchar *dst = (i == N_STAGES-1) ? (guchar *)out_buf + done*out_bpp : intermediate[i%%2];\n"
+"#if COMPOSER_STAGE >= 0\n"
+"            if (i == COMPOSER_STAGE) {\n"
+"                GeglOperationPointComposerClass *klass = GEGL_OPERATION_POINT_COMPOSER_GET_CLASS(stages[i]);\n"
+"                guchar *aux = (aux_buf) ? (guchar *)aux_buf + done*aux_bpp : NULL;\n"
+"                success = klass->process(stages[i], src, aux, dst, n, block_roi, level);\n"
+"                src = dst;\n"
+"                continue;\n"
+"            }\n"
+"#endif\n"
+"            GeglOperationPointFilterClass *klass = GEGL_OPERATION_POINT_FILTER_GET_CLASS(stages[i]);\n"
+"            success = klass->process(stages[i], src, dst, n, block_roi, level);\n"
+"            src = dst;\n"
+"        }\n"
+"    }\n"
+"\n"
+"    g_free(scratch);\n"
+"    return success;\n"
+"}\n"
+"\n"
+"static void\n"
+"gegl_op_class_init (GeglOpClass *klass)\n"
+"{\n"
+"  GeglOperationClass *operation_class = GEGL_OPERATION_CLASS (klass);\n"
+"#if COMPOSER_STAGE >= 0\n"
+"  GEGL_OPERATION_POINT_COMPOSER_CLASS (klass)->process = process;\n"
+"#else\n"
+"  GEGL_OPERATION_POINT_FILTER_CLASS (klass)->process = process;\n"
+"#endif\n"
+"  operation_class->prepare = prepare;\n"
+"  gegl_operation_class_set_keys (operation_class,\n"
+"      \"name\",        IMGFLO_OP_NAME(\"%s\"),\n"
+"      \"title\",       \"imgflo: Fused point filters\",\n"
+"      \"categories\" , \"hidden\",\n"
+"      \"description\", \"%s\",\n"
+"  NULL);\n"
+"}\n"
+"\n"
+"#endif\n";
+
+// Generated C for a GEGL operation running @chain of operations, @composer being the point composer
+// among them or -1. Only depends on these, so it can be shared by all chains with the same signature
+gchar *
+fusion_generate_source(const gchar *name, gchar **operations, gint composer) {
+    g_return_val_if_fail(name, NULL);
+    g_return_val_if_fail(operations, NULL);
+
+    gchar *signature = g_strjoinv(",", operations);
+    GString *source = g_string_new(NULL);
+    g_string_append_printf(source, FUSION_TEMPLATE_HEAD, signature, g_strv_length(operations), composer);
+    for (int i=0; operations[i]; i++) {
+        g_string_append_printf(source, "    \"%s\",\n", operations[i]);
+    }
+    g_string_append_printf(source, FUSION_TEMPLATE_BODY, name, signature);
+    g_free(signature);
+    return g_string_free(source, FALSE);
+}
+
+static gboolean
+is_exported_node(Graph *self, const gchar *name) {
+    GHashTable *ports[] = { self->inports, self->outports };
+    for (int i=0; i<G_N_ELEMENTS(ports); i++) {
+        GHashTableIter iter;
+        gpointer value = NULL;
+        g_hash_table_iter_init(&iter, ports[i]);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            if (g_strcmp0(((GraphNodePort *)value)->node, name) == 0) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+static gboolean
+is_processor_target(Graph *self, GeglNode *node) {
+    GHashTableIter iter;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, self->processor_map);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        if (((Processor *)value)->node == node) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean
+is_composer(GeglNode *node) {
+    GeglOperation *op = gegl_node_get_gegl_operation(node);
+    return op && g_type_is_a(G_OBJECT_TYPE(op), GEGL_TYPE_OPERATION_POINT_COMPOSER);
+}
+
+static gboolean
+is_fusible(Graph *self, GeglNode *node, GHashTable *names) {
+    GeglOperation *op = gegl_node_get_gegl_operation(node);
+    if (!op || !(g_type_is_a(G_OBJECT_TYPE(op), GEGL_TYPE_OPERATION_POINT_FILTER) || is_composer(node))) {
+        return FALSE;
+    }
+    if (g_object_get_data(G_OBJECT(node), "imgflo-fused-into")) {
+        return FALSE; // already part of a fused chain
+    }
+    const gchar *name = g_hash_table_lookup(names, node);
+    return name && !is_exported_node(self, name);
+}
+
+// The node consuming the output of @node on its input pad, if there is exactly one and it is fusible
+static GeglNode *
+single_fusible_consumer(Graph *self, GeglNode *node, GHashTable *names) {
+    GeglNode **consumers = NULL;
+    const gchar **pads = NULL;
+    const gint no_consumers = gegl_node_get_consumers(node, "output", &consumers, &pads);
+    GeglNode *next = NULL;
+    if (no_consumers == 1 && g_strcmp0(pads[0], "input") == 0 && is_fusible(self, consumers[0], names)) {
+        next = consumers[0];
+    }
+    g_free(consumers);
+    g_free(pads);
+    return next;
+}
+
+// Returns GPtrArray of chains, each a GPtrArray of GeglNode from first to last
+static GPtrArray *
+find_fusible_chains(Graph *self) {
+    GHashTable *names = g_hash_table_new(g_direct_hash, g_direct_equal); // GeglNode -> name
+    GHashTableIter iter;
+    gpointer key = NULL, value = NULL;
+    g_hash_table_iter_init(&iter, self->node_map);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_hash_table_insert(names, value, key);
+    }
+
+    GPtrArray *chains = g_ptr_array_new_with_free_func((GDestroyNotify)g_ptr_array_unref);
+    GHashTable *visited = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_iter_init(&iter, self->node_map);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GeglNode *node = (GeglNode *)value;
+        if (g_hash_table_contains(visited, node) || !is_fusible(self, node, names)) {
+            continue;
+        }
+
+        // Walk back to start of chain. Processor targets must stay visible, so can only end a chain
+        GeglNode *head = node;
+        while (TRUE) {
+            GeglNode *producer = gegl_node_get_producer(head, "input", NULL);
+            if (!producer || g_hash_table_contains(visited, producer) ||
+                !is_fusible(self, producer, names) || is_processor_target(self, producer) ||
+                single_fusible_consumer(self, producer, names) != head) {
+                break;
+            }
+            head = producer;
+        }
+
+        GPtrArray *chain = g_ptr_array_new();
+        gint composers = 0;
+        for (GeglNode *n = head; n; ) {
+            composers += (is_composer(n)) ? 1 : 0;
+            if (composers > FUSION_MAX_COMPOSERS) {
+                break; // starts a chain of its own
+            }
+            g_ptr_array_add(chain, n);
+            g_hash_table_add(visited, n);
+            if (is_processor_target(self, n)) {
+                break;
+            }
+            n = single_fusible_consumer(self, n, names);
+            if (n && g_hash_table_contains(visited, n)) {
+                break;
+            }
+        }
+        if (chain->len >= FUSION_MIN_CHAIN) {
+            g_ptr_array_add(chains, chain);
+        } else {
+            g_ptr_array_unref(chain);
+        }
+    }
+
+    g_hash_table_destroy(visited);
+    g_hash_table_destroy(names);
+    return chains;
+}
+
+static gchar **
+chain_operations(GPtrArray *chain) {
+    gchar **operations = g_new0(gchar *, chain->len+1);
+    for (int i=0; i<chain->len; i++) {
+        operations[i] = g_strdup(gegl_node_get_operation(g_ptr_array_index(chain, i)));
+    }
+    return operations;
+}
+
+// Index of the point composer in @chain, or -1
+static gint
+chain_composer(GPtrArray *chain) {
+    for (int i=0; i<chain->len; i++) {
+        if (is_composer(g_ptr_array_index(chain, i))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Stages are not connected to the fused node, so changes to them are passed on explicitly
+static void
+stage_invalidated(GeglNode *stage, GeglRectangle *rect, GeglNode *fused) {
+    gpointer stages = NULL;
+    gegl_node_get(fused, "stages", &stages, NULL);
+    gegl_node_set(fused, "stages", stages, NULL);
+}
+
+// Make consumers of @chain use a single node of the fused operation @op instead
+static void
+substitute_chain(Graph *self, GPtrArray *chain, const gchar *op) {
+    GeglNode *head = g_ptr_array_index(chain, 0);
+    GeglNode *tail = g_ptr_array_index(chain, chain->len-1);
+
+    GeglOperation **stages = g_new0(GeglOperation *, chain->len+1);
+    for (int i=0; i<chain->len; i++) {
+        stages[i] = gegl_node_get_gegl_operation(g_ptr_array_index(chain, i));
+    }
+    GeglNode *fused = gegl_node_new_child(self->top, "operation", op, "stages", stages, NULL);
+    g_object_set_data_full(G_OBJECT(fused), "imgflo-fused-stages", stages, g_free);
+    for (int i=0; i<chain->len; i++) {
+        GeglNode *stage = g_ptr_array_index(chain, i);
+        g_object_set_data(G_OBJECT(stage), "imgflo-fused-into", fused);
+        g_signal_connect_object(stage, "invalidated", G_CALLBACK(stage_invalidated), fused, 0);
+    }
+
+    // Chain stays connected, so its nodes can still be rendered on their own
+    gchar *producer_pad = NULL;
+    GeglNode *producer = gegl_node_get_producer(head, "input", &producer_pad);
+    if (producer) {
+        gegl_node_connect_to(producer, producer_pad, fused, "input");
+    }
+    g_free(producer_pad);
+    const gint composer = chain_composer(chain);
+    gchar *aux_pad = NULL;
+    GeglNode *aux = (composer >= 0) ? gegl_node_get_producer(g_ptr_array_index(chain, composer), "aux", &aux_pad) : NULL;
+    if (aux) {
+        gegl_node_connect_to(aux, aux_pad, fused, "aux");
+    }
+    g_free(aux_pad);
+
+    GeglNode **consumers = NULL;
+    const gchar **pads = NULL;
+    const gint no_consumers = gegl_node_get_consumers(tail, "output", &consumers, &pads);
+    for (int i=0; i<no_consumers; i++) {
+        gegl_node_connect_to(fused, "output", consumers[i], pads[i]);
+    }
+    g_free(consumers);
+    g_free(pads);
+
+    GHashTableIter iter;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, self->processor_map);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        Processor *proc = (Processor *)value;
+        if (proc->node == tail) {
+            processor_set_target(proc, fused);
+        }
+    }
+}
+
+// Whole template, part of the name of every fused operation
+static const gchar *
+fusion_template(void) {
+    static gchar *template = NULL;
+    if (g_once_init_enter(&template)) {
+        g_once_init_leave(&template, g_strconcat(FUSION_TEMPLATE_HEAD, FUSION_TEMPLATE_BODY, NULL));
+    }
+    return template;
+}
+
+// Replace chains of point filters in @self with fused operations. Those not built yet are built
+// in the background and used by later calls, or if @wait is set, before returning.
+// Chains fused already are left as they are. Returns number of chains replaced.
+// Once no build is pending for a graph, it is not looked at again until it changes
+gint
+graph_fuse_point_filters(Graph *self, gboolean wait) {
+    g_return_val_if_fail(self, 0);
+    if (self->fused_generation == self->generation) {
+        return 0;
+    }
+
+    GPtrArray *chains = find_fusible_chains(self);
+    GPtrArray *ops = g_ptr_array_new_with_free_func(g_free); // fused operation per chain
+    const gchar *template = fusion_template();
+    gboolean pending = FALSE;
+    for (int i=0; i<chains->len; i++) {
+        GPtrArray *chain = g_ptr_array_index(chains, i);
+        gchar **operations = chain_operations(chain);
+        gchar *signature = g_strjoinv(",", operations);
+        gchar *op = library_fused_operation_name(self->component_lib, signature, template);
+        if (!gegl_has_operation(op)) {
+            gchar *source = fusion_generate_source(op, operations, chain_composer(chain));
+            if (!library_build_fused_operation(self->component_lib, op, source)) {
+                imgflo_info("Fusing %s into %s\n", signature, op);
+                pending = TRUE;
+            }
+            g_free(source);
+        }
+        g_ptr_array_add(ops, op);
+        g_free(signature);
+        g_strfreev(operations);
+    }
+    if (wait && pending) {
+        library_wait_for_compilation(self->component_lib);
+    }
+
+    gint fused = 0;
+    gboolean building = FALSE;
+    for (int i=0; i<chains->len; i++) {
+        const gchar *op = g_ptr_array_index(ops, i);
+        if (gegl_has_operation(op)) {
+            substitute_chain(self, g_ptr_array_index(chains, i), op);
+            fused++;
+        } else if (library_fused_operation_pending(self->component_lib, op)) {
+            building = TRUE;
+        } else if (wait) {
+            imgflo_warning("Could not fuse into %s, leaving chain as is", op);
+        }
+    }
+    if (!building) {
+        // Chains left are those which failed to build
+        self->fused_generation = self->generation;
+    }
+
+    g_ptr_array_unref(ops);
+    g_ptr_array_unref(chains);
+    return fused;
+}
@@ -102,7 +102,10 @@ typedef struct _Graph {
     GHashTable *processor_map;
     GHashTable *inports;
     GHashTable *outports;
+    GHashTable *subgraphs; // node name -> JsonObject with graph definition, shared with Library
     Library *component_lib; // unowned
+    guint64 generation; // increased on every change that can affect output
+    guint64 fused_generation; // at which nothing was left to fuse, G_MAXUINT64 if never
 
     // signals
     GraphNodeAdded on_node_added;
@@ -153,9 +156,12 @@ graph_new(const gchar *id, Library *lib) {
 
     self->inports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)graph_node_port_free);
     self->outports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)graph_node_port_free);
+    self->subgraphs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)json_object_unref);
 
     self->on_node_added = NULL;
     self->on_node_added_data = NULL;
+    self->generation = 0;
+    self->fused_generation = G_MAXUINT64;
 
     return self;
 }
@@ -166,6 +172,18 @@ graph_free(Graph *self) {
         return;
     }
 
+    GHashTableIter iter;
+    gpointer proc = NULL;
+    g_hash_table_iter_init(&iter, self->processor_map);
+    while (g_hash_table_iter_next(&iter, NULL, &proc)) {
+        processor_free((Processor *)proc);
+    }
+    gpointer node = NULL;
+    g_hash_table_iter_init(&iter, self->node_map);
+    while (g_hash_table_iter_next(&iter, NULL, &node)) {
+        library_release_operation(self->component_lib, gegl_node_get_operation((GeglNode *)node));
+    }
+
     g_free(self->id);
     g_object_unref(self->top);
     // FIXME: leaks memeory. Go through all nodes and processors and free
@@ -174,10 +192,106 @@ graph_free(Graph *self) {
 
     g_hash_table_destroy(self->inports);
     g_hash_table_destroy(self->outports);
+    g_hash_table_destroy(self->subgraphs);
 
     g_free(self);
 }
 
+static void
+load_graph_object(Graph *self, JsonObject *root, const gchar *prefix);
+gchar **
+graph_list_nodes(Graph *self, gint *no_nodes_out);
+
+// Subgraphs are flattened into the parent. Their nodes are named "subgraph/node"
+static gchar *
+subgraph_node_name(const gchar *prefix, const gchar *name) {
+    return (prefix) ? g_strdup_printf("%s/%s", prefix, name) : g_strdup(name);
+}
+
+// Follow exported ports of subgraph nodes down to the actual GEGL node/Processor
+// Returns TRUE if @node was a subgraph and the port could be resolved, else outputs are not set
+gboolean
+graph_resolve_port(Graph *self, GraphPortDirection dir, const gchar *node, const gchar *port,
+                   gchar **node_out, gchar **port_out)
+{
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(node, FALSE);
+    g_return_val_if_fail(node_out, FALSE);
+    g_return_val_if_fail(port_out, FALSE);
+
+    JsonObject *subgraph = g_hash_table_lookup(self->subgraphs, node);
+    if (!subgraph) {
+        return FALSE;
+    }
+
+    gchar *n = g_strdup(node);
+    gchar *p = g_strdup(port);
+    const gchar *member = (dir == GraphInPort) ? "inports" : "outports";
+    while (subgraph) {
+        JsonObject *ports = json_object_has_member(subgraph, member) ?
+                json_object_get_object_member(subgraph, member) : NULL;
+        JsonObject *exported = (ports && p && json_object_has_member(ports, p)) ?
+                json_object_get_object_member(ports, p) : NULL;
+        if (!exported) {
+            imgflo_warning("Subgraph '%s' has no exported port '%s'\n", n, p);
+            g_free(n);
+            g_free(p);
+            return FALSE;
+        }
+        gchar *inner_node = subgraph_node_name(n, json_object_get_string_member(exported, "process"));
+        gchar *inner_port = g_strdup(json_object_get_string_member(exported, "port"));
+        g_free(n);
+        g_free(p);
+        n = inner_node;
+        p = inner_port;
+        subgraph = g_hash_table_lookup(self->subgraphs, n);
+    }
+
+    *node_out = n;
+    *port_out = p;
+    return TRUE;
+}
+
+// Returns TRUE if either end of the edge is a subgraph, with @resolved set to src,srcport,tgt,tgtport
+static gboolean
+resolve_subgraph_edge(Graph *self,
+        const gchar *src, const gchar *srcport,
+        const gchar *tgt, const gchar *tgtport, gchar *resolved[4])
+{
+    const gboolean src_resolved = graph_resolve_port(self, GraphOutPort, src, srcport,
+                                                     &resolved[0], &resolved[1]);
+    const gboolean tgt_resolved = graph_resolve_port(self, GraphInPort, tgt, tgtport,
+                                                     &resolved[2], &resolved[3]);
+    if (!src_resolved) {
+        resolved[0] = g_strdup(src);
+        resolved[1] = g_strdup(srcport);
+    }
+    if (!tgt_resolved) {
+        resolved[2] = g_strdup(tgt);
+        resolved[3] = g_strdup(tgtport);
+    }
+    if (!src_resolved && !tgt_resolved) {
+        for (int i=0; i<4; i++) {
+            g_free(resolved[i]);
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+subgraph_is_recursive(Graph *self, const gchar *name, JsonObject *subgraph) {
+    gchar *ancestor = g_strdup(name);
+    gchar *sep = NULL;
+    gboolean recursive = FALSE;
+    while (!recursive && (sep = g_strrstr(ancestor, "/"))) {
+        *sep = '\0';
+        recursive = (g_hash_table_lookup(self->subgraphs, ancestor) == subgraph);
+    }
+    g_free(ancestor);
+    return recursive;
+}
+
 void
 graph_add_port(Graph *self, GraphPortDirection dir, const gchar *exported,
                  const gchar *node, const gchar *port)
@@ -185,6 +299,16 @@ graph_add_port(Graph *self, GraphPortDirection dir, const gchar *exported,
     g_return_if_fail(self);
     g_return_if_fail(dir==GraphInPort || dir==GraphOutPort);
     GHashTable *ports = (dir == GraphInPort) ? self->inports : self->outports;
+    self->generation++; // exported ports are part of network snapshots
+
+    gchar *inner_node = NULL;
+    gchar *inner_port = NULL;
+    if (graph_resolve_port(self, dir, node, port, &inner_node, &inner_port)) {
+        g_hash_table_replace(ports, g_strdup(exported), graph_node_port_new(inner_node, inner_port));
+        g_free(inner_node);
+        g_free(inner_port);
+        return;
+    }
     g_hash_table_replace(ports, g_strdup(exported), graph_node_port_new(node, port));
 }
 
@@ -194,6 +318,7 @@ graph_remove_port(Graph *self, GraphPortDirection dir, const gchar *exported)
 {
     g_return_if_fail(self);
     GHashTable *ports = (dir == GraphInPort) ? self->inports : self->outports;
+    self->generation++;
     g_hash_table_remove(ports, exported);
 }
 
@@ -205,6 +330,17 @@ graph_add_iip(Graph *self, const gchar *node, const gchar *port, GValue *value)
     g_return_if_fail(port);
     g_return_if_fail(value);
 
+    self->generation++;
+
+    gchar *inner_node = NULL;
+    gchar *inner_port = NULL;
+    if (graph_resolve_port(self, GraphInPort, node, port, &inner_node, &inner_port)) {
+        graph_add_iip(self, inner_node, inner_port, value);
+        g_free(inner_node);
+        g_free(inner_port);
+        return;
+    }
+
     const gchar *iip = G_VALUE_HOLDS_STRING(value) ? g_value_get_string(value) : "IIP";
 
     GeglNode *t = g_hash_table_lookup(self->node_map, node);
@@ -235,6 +371,17 @@ graph_remove_iip(Graph *self, const gchar *node, const gchar *port)
     g_return_if_fail(node);
     g_return_if_fail(port);
 
+    self->generation++;
+
+    gchar *inner_node = NULL;
+    gchar *inner_port = NULL;
+    if (graph_resolve_port(self, GraphInPort, node, port, &inner_node, &inner_port)) {
+        graph_remove_iip(self, inner_node, inner_port);
+        g_free(inner_node);
+        g_free(inner_port);
+        return;
+    }
+
     imgflo_info("\tDEL '%s' -> %s %s\n", "IIP", node, port);
 
     GeglNode *t = g_hash_table_lookup(self->node_map, node);
@@ -248,6 +395,33 @@ graph_remove_iip(Graph *self, const gchar *node, const gchar *port)
     }
 }
 
+// Current value of the property IIPs to @node @port set, following subgraph ports.
+// Returns FALSE if there is no such property, else @value_out must be unset by caller
+gboolean
+graph_get_iip(Graph *self, const gchar *node, const gchar *port, GValue *value_out)
+{
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(node, FALSE);
+    g_return_val_if_fail(port, FALSE);
+    g_return_val_if_fail(value_out, FALSE);
+
+    gchar *inner_node = NULL;
+    gchar *inner_port = NULL;
+    if (graph_resolve_port(self, GraphInPort, node, port, &inner_node, &inner_port)) {
+        const gboolean found = graph_get_iip(self, inner_node, inner_port, value_out);
+        g_free(inner_node);
+        g_free(inner_port);
+        return found;
+    }
+
+    GeglNode *t = g_hash_table_lookup(self->node_map, node);
+    if (!t || !gegl_node_find_property(t, port)) {
+        return FALSE;
+    }
+    gegl_node_get_property(t, port, value_out);
+    return TRUE;
+}
+
 void
 graph_add_node(Graph *self, const gchar *name, const gchar *component)
 {
@@ -255,6 +429,8 @@ graph_add_node(Graph *self, const gchar *name, const gchar *component)
     g_return_if_fail(name);
     g_return_if_fail(component);
 
+    self->generation++;
+
     if (g_strcmp0(component, "Processor") == 0) {
         Processor *proc = processor_new();
         g_hash_table_insert(self->processor_map, (gpointer)g_strdup(name), (gpointer)proc);
@@ -265,6 +441,17 @@ graph_add_node(Graph *self, const gchar *name, const gchar *component)
         return;
     }
 
+    JsonObject *subgraph = library_get_graph(self->component_lib, component);
+    if (subgraph) {
+        if (subgraph_is_recursive(self, name, subgraph)) {
+            imgflo_warning("Subgraph '%s' (%s) includes itself\n", name, component);
+            return;
+        }
+        imgflo_info("\tInlining subgraph %s(%s)\n", name, component);
+        g_hash_table_replace(self->subgraphs, g_strdup(name), json_object_ref(subgraph));
+        load_graph_object(self, subgraph, name);
+        return;
+    }
 
     gchar *op = library_get_operation_name(self->component_lib, component);
     // FIXME: check that operation is correct
@@ -273,6 +460,7 @@ graph_add_node(Graph *self, const gchar *name, const gchar *component)
     g_return_if_fail(n);
 
     imgflo_info("\t%s(%s)\n", name, op);
+    library_use_operation(self->component_lib, op);
     g_hash_table_insert(self->node_map, (gpointer)g_strdup(name), (gpointer)n);
     if (self->on_node_added) {
         self->on_node_added(self, name, n, NULL, self->on_node_added_data);
@@ -287,6 +475,33 @@ graph_remove_node(Graph *self, const gchar *name)
     g_return_if_fail(self);
     g_return_if_fail(name);
 
+    self->generation++;
+
+    if (g_hash_table_contains(self->subgraphs, name)) {
+        imgflo_info("\tDEL subgraph %s()\n", name);
+        gchar *prefix = g_strdup_printf("%s/", name);
+        gint no_nodes = 0;
+        gchar **nodes = graph_list_nodes(self, &no_nodes);
+        for (int i=0; i<no_nodes; i++) {
+            if (g_str_has_prefix(nodes[i], prefix)) {
+                graph_remove_node(self, nodes[i]);
+            }
+        }
+        g_strfreev(nodes);
+
+        GHashTableIter iter;
+        gpointer key = NULL;
+        g_hash_table_iter_init(&iter, self->subgraphs);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            if (g_str_has_prefix((const gchar *)key, prefix)) {
+                g_hash_table_iter_remove(&iter);
+            }
+        }
+        g_hash_table_remove(self->subgraphs, name);
+        g_free(prefix);
+        return;
+    }
+
     Processor *p = g_hash_table_lookup(self->processor_map, name);
     if (p) {
         imgflo_info("\tDeleting Processor '%s'\n", name);
@@ -299,6 +514,7 @@ graph_remove_node(Graph *self, const gchar *name)
     g_return_if_fail(n);
 
     imgflo_info("\t DEL %s()\n", name);
+    library_release_operation(self->component_lib, gegl_node_get_operation(n));
     g_hash_table_remove(self->node_map, name);
     gegl_node_remove_child(self->top, n);
 }
@@ -362,6 +578,17 @@ graph_add_edge(Graph *self,
     g_return_if_fail(srcport);
     g_return_if_fail(tgtport);
 
+    self->generation++;
+
+    gchar *resolved[4];
+    if (resolve_subgraph_edge(self, src, srcport, tgt, tgtport, resolved)) {
+        graph_add_edge(self, resolved[0], resolved[1], resolved[2], resolved[3]);
+        for (int i=0; i<4; i++) {
+            g_free(resolved[i]);
+        }
+        return;
+    }
+
     Processor *p = g_hash_table_lookup(self->processor_map, tgt);
     if (p) {
         GeglNode *s = g_hash_table_lookup(self->node_map, src);
@@ -393,6 +620,17 @@ graph_remove_edge(Graph *self,
     g_return_if_fail(srcport);
     g_return_if_fail(tgtport);
 
+    self->generation++;
+
+    gchar *resolved[4];
+    if (resolve_subgraph_edge(self, src, srcport, tgt, tgtport, resolved)) {
+        graph_remove_edge(self, resolved[0], resolved[1], resolved[2], resolved[3]);
+        for (int i=0; i<4; i++) {
+            g_free(resolved[i]);
+        }
+        return;
+    }
+
     Processor *p = g_hash_table_lookup(self->processor_map, tgt);
     if (p) {
         GeglNode *s = g_hash_table_lookup(self->node_map, src);
@@ -412,12 +650,9 @@ graph_remove_edge(Graph *self,
     gegl_node_disconnect(t, tgtport);
 }
 
-void
-graph_load_json(Graph *self, JsonParser *parser) {
-
-    JsonNode *rootnode = json_parser_get_root(parser);
-    g_assert(JSON_NODE_HOLDS_OBJECT(rootnode));
-    JsonObject *root = json_node_get_object(rootnode);
+// Load processes and connections of @root. When @prefix is set, @root is a subgraph named @prefix
+static void
+load_graph_object(Graph *self, JsonObject *root, const gchar *prefix) {
 
     // Processes
     JsonObject *processes = json_object_get_object_member(root, "processes");
@@ -428,7 +663,9 @@ graph_load_json(Graph *self, JsonParser *parser) {
         const gchar *name = g_list_nth_data(process_names, i);
         JsonObject *proc = json_object_get_object_member(processes, name);
         const gchar *component = json_object_get_string_member(proc, "component");
-        graph_add_node(self, name, component);
+        gchar *node_name = subgraph_node_name(prefix, name);
+        graph_add_node(self, node_name, component);
+        g_free(node_name);
     }
 
     //g_free(process_names); crashes??
@@ -440,17 +677,18 @@ graph_load_json(Graph *self, JsonParser *parser) {
         JsonObject *conn = json_array_get_object_element(connections, i);
 
         JsonObject *tgt = json_object_get_object_member(conn, "tgt");
-        const gchar *tgt_proc = json_object_get_string_member(tgt, "process");
+        gchar *tgt_proc = subgraph_node_name(prefix, json_object_get_string_member(tgt, "process"));
         const gchar *tgt_port = json_object_get_string_member(tgt, "port");
 
         JsonNode *srcnode = json_object_get_member(conn, "src");
         if (srcnode) {
             // Connection
             JsonObject *src = json_object_get_object_member(conn, "src");
-            const gchar *src_proc = json_object_get_string_member(src, "process");
+            gchar *src_proc = subgraph_node_name(prefix, json_object_get_string_member(src, "process"));
             const gchar *src_port = json_object_get_string_member(src, "port");
 
             graph_add_edge(self, src_proc, src_port, tgt_proc, tgt_port);
+            g_free(src_proc);
         } else {
             // IIP
             JsonNode *datanode = json_object_get_member(conn, "data");
@@ -461,7 +699,18 @@ graph_load_json(Graph *self, JsonParser *parser) {
             graph_add_iip(self, tgt_proc, tgt_port, &value);
             g_value_unset(&value);
         }
+        g_free(tgt_proc);
     }
+}
+
+void
+graph_load_json(Graph *self, JsonParser *parser) {
+
+    JsonNode *rootnode = json_parser_get_root(parser);
+    g_assert(JSON_NODE_HOLDS_OBJECT(rootnode));
+    JsonObject *root = json_node_get_object(rootnode);
+
+    load_graph_object(self, root, NULL);
 
     // Exported ports
     if (json_object_has_member(root, "inports")) {
@@ -558,6 +807,78 @@ graph_visit_edges(Graph *self, GraphEdgeVisitFunc visit_func, gpointer user_data
     g_strfreev(nodes);
 }
 
+static void
+copy_edge_func(Graph *graph, const GraphEdge *edge, gpointer user_data) {
+    Graph *copy = (Graph *)user_data;
+    GeglNode *s = (edge->src_name) ? g_hash_table_lookup(copy->node_map, edge->src_name) : NULL;
+    Processor *p = g_hash_table_lookup(copy->processor_map, edge->tgt_name);
+    GeglNode *t = g_hash_table_lookup(copy->node_map, edge->tgt_name);
+    if (s && p) {
+        processor_set_target(p, s);
+    } else if (s && t) {
+        gegl_node_connect_to(s, edge->src_port, t, edge->tgt_port);
+    }
+}
+
+// Independent copy of @self, with the same nodes, edges, property values and exported ports.
+// For rendering on another thread while @self keeps changing. Processors of the copy are not running
+Graph *
+graph_copy(Graph *self) {
+    g_return_val_if_fail(self, NULL);
+
+    Graph *copy = graph_new(self->id, self->component_lib);
+    copy->generation = self->generation;
+
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, self->node_map);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GeglNode *node = (GeglNode *)value;
+        const gchar *op = gegl_node_get_operation(node);
+        GeglNode *n = gegl_node_new_child(copy->top, "operation", op, NULL);
+        library_use_operation(copy->component_lib, op);
+
+        guint n_properties = 0;
+        GParamSpec **properties = gegl_operation_list_properties(op, &n_properties);
+        for (int i=0; i<n_properties; i++) {
+            GParamSpec *prop = properties[i];
+            if ((prop->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE || (prop->flags & G_PARAM_CONSTRUCT_ONLY)) {
+                continue;
+            }
+            const gchar *id = g_param_spec_get_name(prop);
+            GValue v = G_VALUE_INIT;
+            gegl_node_get_property(node, id, &v);
+            gegl_node_set_property(n, id, &v);
+            g_value_unset(&v);
+        }
+        g_free(properties);
+        g_hash_table_insert(copy->node_map, g_strdup((const gchar *)key), n);
+    }
+
+    g_hash_table_iter_init(&iter, self->processor_map);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        Processor *proc = processor_new();
+        proc->max_size = ((Processor *)value)->max_size;
+        g_hash_table_insert(copy->processor_map, g_strdup((const gchar *)key), proc);
+    }
+    graph_visit_edges(self, copy_edge_func, copy);
+
+    GHashTable *ports[2][2] = { { self->inports, copy->inports }, { self->outports, copy->outports } };
+    for (int i=0; i<2; i++) {
+        g_hash_table_iter_init(&iter, ports[i][0]);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            const GraphNodePort *port = (const GraphNodePort *)value;
+            g_hash_table_insert(ports[i][1], g_strdup((const gchar *)key), graph_node_port_new(port->node, port->port));
+        }
+    }
+    g_hash_table_iter_init(&iter, self->subgraphs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_hash_table_insert(copy->subgraphs, g_strdup((const gchar *)key), json_object_ref((JsonObject *)value));
+    }
+    return copy;
+}
+
 JsonObject *
 graph_edge_to_json(const GraphEdge *edge) {
     g_return_val_if_fail(edge, NULL);
@@ -610,7 +931,7 @@ graph_inport_info(Graph *self, const char *port) {
 
     gchar *operation = component2geglop(component);
     g_free(component);
-    JsonArray *ports = library_inports_for_operation(operation);
+    JsonArray *ports = library_get_inports(self->component_lib, operation);
     g_free(operation);
     g_return_val_if_fail(ports, NULL);
 
@@ -637,7 +958,7 @@ graph_outport_info(Graph *self, const char *port) {
 
     gchar *operation = component2geglop(component);
     g_free(component);
-    JsonArray *ports = library_outports_for_operation(operation);
+    JsonArray *ports = library_get_outports(self->component_lib, operation);
     g_free(operation);
     g_return_val_if_fail(ports, NULL);
 
@@ -0,0 +1,102 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Helpers for writing point-filter components which compilers can auto-vectorize.
+// Available to all components built with 'make component', including component:source ones.
+//
+//    #include "imgflo-op.h"
+//    ...
+//    IMGFLO_MAP_RGBA(in_buf, out_buf, samples, px,
+//        imgflo_float4_clamp(px * gain + offset, 0.0f, 1.0f));
+//
+// Each output pixel may only depend on the input pixel at the same position.
+// GEGL may process in-place, so input and output can be the same buffer. Pointers are therefore
+// not restrict, and IMGFLO_VECTORIZE tells the compiler that iterations are independent instead.
+
+#ifndef IMGFLO_OP_H
+#define IMGFLO_OP_H
+
+#include <string.h>
+
+// Four floats, one RGBA pixel. Arithmetic operators work per lane
+typedef float imgflo_float4 __attribute__((vector_size(16)));
+
+// Tell the compiler that iterations are independent
+#if defined(__clang__)
+#define IMGFLO_VECTORIZE _Pragma("clang loop vectorize(enable) interleave(enable)")
+#elif defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define IMGFLO_VECTORIZE _Pragma("GCC ivdep")
+#else
+#define IMGFLO_VECTORIZE
+#endif
+
+// GEGL does not guarantee 16 byte alignment of buffers. memcpy compiles to a single unaligned load/store
+static inline imgflo_float4
+imgflo_float4_load(const float *p) {
+    imgflo_float4 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void
+imgflo_float4_store(float *p, imgflo_float4 v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline imgflo_float4
+imgflo_float4_splat(float x) {
+    const imgflo_float4 v = { x, x, x, x };
+    return v;
+}
+
+static inline imgflo_float4
+imgflo_float4_set(float r, float g, float b, float a) {
+    const imgflo_float4 v = { r, g, b, a };
+    return v;
+}
+
+static inline imgflo_float4
+imgflo_float4_clamp(imgflo_float4 v, float lo, float hi) {
+    for (int i=0; i<4; i++) {
+        v[i] = (v[i] < lo) ? lo : ((v[i] > hi) ? hi : v[i]);
+    }
+    return v;
+}
+
+// Keep alpha of @original, take color from @v
+static inline imgflo_float4
+imgflo_float4_with_alpha(imgflo_float4 v, imgflo_float4 original) {
+    v[3] = original[3];
+    return v;
+}
+
+// For "RGBA float" and "RaGaBaA float" formats.
+// Evaluates @expr for every pixel, with @px bound to the input pixel as imgflo_float4
+#define IMGFLO_MAP_RGBA(in_buf, out_buf, samples, px, expr) \
+    do { \
+        const float *imgflo_in_ = (const float *)(in_buf); \
+        float *imgflo_out_ = (float *)(out_buf); \
+        const long imgflo_samples_ = (samples); \
+        IMGFLO_VECTORIZE \
+        for (long imgflo_i_ = 0; imgflo_i_ < imgflo_samples_; imgflo_i_++) { \
+            const imgflo_float4 px = imgflo_float4_load(imgflo_in_ + 4*imgflo_i_); \
+            imgflo_float4_store(imgflo_out_ + 4*imgflo_i_, (expr)); \
+        } \
+    } while (0)
+
+// For any float format where all components are treated the same, like "Y float" or "RGB float".
+// Evaluates @expr for every component, with @v bound to the input value as float
+#define IMGFLO_MAP_COMPONENTS(in_buf, out_buf, samples, components, v, expr) \
+    do { \
+        const float *imgflo_in_ = (const float *)(in_buf); \
+        float *imgflo_out_ = (float *)(out_buf); \
+        const long imgflo_n_ = (samples)*(components); \
+        IMGFLO_VECTORIZE \
+        for (long imgflo_i_ = 0; imgflo_i_ < imgflo_n_; imgflo_i_++) { \
+            const float v = imgflo_in_[imgflo_i_]; \
+            imgflo_out_[imgflo_i_] = (expr); \
+        } \
+    } while (0)
+
+#endif // IMGFLO_OP_H
@@ -0,0 +1,264 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+// libjpeg calls exit() on errors by default, jump back out instead
+typedef struct {
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} JpegErrorManager;
+
+#define JPEG_BLOCK_SIZE 4096
+
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t capacity; // allocated size of buffer
+  struct jpeg_compress_struct cinfo;
+  JpegErrorManager err;
+  struct jpeg_destination_mgr dest;
+  JOCTET block[JPEG_BLOCK_SIZE]; // compressor output, moved to buffer when full
+  JSAMPLE *row; // RGB, converted from input
+  int width;
+  gboolean started;
+} JpegEncoder;
+
+static void
+jpeg_error_exit(j_common_ptr cinfo)
+{
+    JpegErrorManager *err = (JpegErrorManager *)cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    imgflo_warning("JPEG %s failed: %s", (cinfo->is_decompressor) ? "decoding" : "encoding", message);
+    longjmp(err->jump, 1);
+}
+
+static void
+jpeg_encoder_append(JpegEncoder *self, const JOCTET *data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    const size_t new_size = self->size + length;
+    if (new_size > self->capacity) {
+        size_t capacity = (self->capacity) ? self->capacity : 4*JPEG_BLOCK_SIZE;
+        while (capacity < new_size) {
+            capacity *= 2;
+        }
+        self->buffer = g_realloc(self->buffer, capacity);
+        self->capacity = capacity;
+    }
+    memcpy(self->buffer + self->size, data, length);
+    self->size += length;
+}
+
+// Destination manager writing into self->buffer, so output is available while encoding
+static void
+jpeg_dest_init(j_compress_ptr cinfo) {
+    JpegEncoder *self = (JpegEncoder *)cinfo->client_data;
+    self->dest.next_output_byte = self->block;
+    self->dest.free_in_buffer = JPEG_BLOCK_SIZE;
+}
+
+static boolean
+jpeg_dest_empty(j_compress_ptr cinfo) {
+    JpegEncoder *self = (JpegEncoder *)cinfo->client_data;
+    jpeg_encoder_append(self, self->block, JPEG_BLOCK_SIZE);
+    self->dest.next_output_byte = self->block;
+    self->dest.free_in_buffer = JPEG_BLOCK_SIZE;
+    return TRUE;
+}
+
+static void
+jpeg_dest_term(j_compress_ptr cinfo) {
+    JpegEncoder *self = (JpegEncoder *)cinfo->client_data;
+    jpeg_encoder_append(self, self->block, JPEG_BLOCK_SIZE - self->dest.free_in_buffer);
+    self->dest.next_output_byte = self->block;
+    self->dest.free_in_buffer = JPEG_BLOCK_SIZE;
+}
+
+JpegEncoder *
+jpeg_encoder_new(void) {
+    JpegEncoder *self = g_new0(JpegEncoder, 1);
+    self->buffer = NULL;
+    self->size = 0;
+    self->cinfo.err = jpeg_std_error(&self->err.base);
+    self->err.base.error_exit = jpeg_error_exit;
+    jpeg_create_compress(&self->cinfo);
+    self->cinfo.client_data = self;
+    self->dest.init_destination = jpeg_dest_init;
+    self->dest.empty_output_buffer = jpeg_dest_empty;
+    self->dest.term_destination = jpeg_dest_term;
+    self->cinfo.dest = &self->dest;
+    return self;
+}
+
+void
+jpeg_encoder_free(JpegEncoder *self) {
+    jpeg_destroy_compress(&self->cinfo);
+    g_free(self->row);
+    if (self->buffer) {
+        g_free(self->buffer);
+    }
+    g_free(self);
+}
+
+// Start encoding an RGBA u8 image. Rows are then given with jpeg_encoder_write_rows().
+// JPEG has no alpha channel, it is dropped. @quality is 0-100
+gboolean
+jpeg_encoder_begin(JpegEncoder *self, int width, int height, int quality) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(!self->started, FALSE);
+    g_return_val_if_fail(width > 0, FALSE);
+    g_return_val_if_fail(height > 0, FALSE);
+
+    if (setjmp(self->err.jump)) {
+        return FALSE;
+    }
+    self->width = width;
+    self->row = g_malloc(3*width);
+    self->cinfo.image_width = width;
+    self->cinfo.image_height = height;
+    self->cinfo.input_components = 3;
+    self->cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&self->cinfo);
+    jpeg_set_quality(&self->cinfo, CLAMP(quality, 0, 100), TRUE);
+    jpeg_start_compress(&self->cinfo, TRUE);
+    self->started = TRUE;
+    return TRUE;
+}
+
+gboolean
+jpeg_encoder_write_rows(JpegEncoder *self, const gchar *buffer, int rows) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(self->started, FALSE);
+    g_return_val_if_fail(buffer, FALSE);
+
+    if (setjmp(self->err.jump)) {
+        return FALSE;
+    }
+    const size_t bytes_per_row = 4*self->width;
+    for (int y = 0; y < rows; y++) {
+        const guchar *rgba = (const guchar *)buffer + y*bytes_per_row;
+        for (int x = 0; x < self->width; x++) {
+            self->row[3*x+0] = rgba[4*x+0];
+            self->row[3*x+1] = rgba[4*x+1];
+            self->row[3*x+2] = rgba[4*x+2];
+        }
+        jpeg_write_scanlines(&self->cinfo, &self->row, 1);
+    }
+    return TRUE;
+}
+
+gboolean
+jpeg_encoder_finish(JpegEncoder *self) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(self->started, FALSE);
+
+    if (setjmp(self->err.jump)) {
+        return FALSE;
+    }
+    jpeg_finish_compress(&self->cinfo);
+    return TRUE;
+}
+
+gboolean
+jpeg_encoder_encode_rgba(JpegEncoder *self, int width, int height, gchar *buffer, int quality) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(buffer, FALSE);
+
+    return jpeg_encoder_begin(self, width, height, quality) &&
+        jpeg_encoder_write_rows(self, buffer, height) &&
+        jpeg_encoder_finish(self);
+}
+
+// Source manager reading from memory. libjpeg's own jpeg_mem_src() is not in all versions
+static void
+jpeg_src_init(j_decompress_ptr cinfo) {
+}
+
+static boolean
+jpeg_src_fill(j_decompress_ptr cinfo) {
+    // Data ended early. Like libjpeg does for files, insert an end marker and decode what we got
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void
+jpeg_src_skip(j_decompress_ptr cinfo, long count) {
+    if (count <= 0) {
+        return;
+    }
+    if ((size_t)count > cinfo->src->bytes_in_buffer) {
+        jpeg_src_fill(cinfo);
+    } else {
+        cinfo->src->next_input_byte += count;
+        cinfo->src->bytes_in_buffer -= count;
+    }
+}
+
+static void
+jpeg_src_term(j_decompress_ptr cinfo) {
+}
+
+// Decode JPEG @data in memory to RGB u8. Images larger than @max_pixels are refused.
+// Returns pixels to be freed with g_free(), or NULL on error
+gchar *
+jpeg_decode_rgb(const guint8 *data, size_t size, gint64 max_pixels, int *width_out, int *height_out) {
+    g_return_val_if_fail(data, NULL);
+
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager err;
+    struct jpeg_source_mgr src;
+    // Assigned after setjmp, so must not be kept in a register
+    gchar * volatile pixels = NULL;
+
+    cinfo.err = jpeg_std_error(&err.base);
+    err.base.error_exit = jpeg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        g_free(pixels);
+        return NULL;
+    }
+    jpeg_create_decompress(&cinfo);
+    src.init_source = jpeg_src_init;
+    src.fill_input_buffer = jpeg_src_fill;
+    src.skip_input_data = jpeg_src_skip;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = jpeg_src_term;
+    src.next_input_byte = (const JOCTET *)data;
+    src.bytes_in_buffer = size;
+    cinfo.src = &src;
+
+    jpeg_read_header(&cinfo, TRUE);
+    if ((gint64)cinfo.image_width*cinfo.image_height > max_pixels) {
+        imgflo_warning("JPEG decoding failed: image too large");
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    const int width = cinfo.output_width;
+    const int height = cinfo.output_height;
+    const size_t bytes_per_row = 1*3*width;
+    pixels = g_malloc(bytes_per_row*height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = (JSAMPROW)(pixels + cinfo.output_scanline*bytes_per_row);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    *width_out = width;
+    *height_out = height;
+    return pixels;
+}
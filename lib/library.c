@@ -7,7 +7,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <glib/gstdio.h>
 #include <json-glib/json-glib.h>
 #include <gegl-plugin.h>
 
@@ -41,18 +43,28 @@ icon_for_op(const gchar *op, const gchar *categories) {
     // TODO: go through all GEGL categories and operations, find more appropriate icons
     // http://gegl.org/operations.html
     // http://fortawesome.github.io/Font-Awesome/icons/
-    // PERFORMANCE: build up a hashmap once, lookup on-demand afterwards
+    static GHashTable *icons = NULL; // op -> icon, filled on-demand
+    if (!icons) {
+        icons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    const gchar *icon = g_hash_table_lookup(icons, op);
+    if (icon) {
+        return icon;
+    }
+
     if (g_strcmp0(op, "gegl:crop") == 0) {
-        return "crop";
+        icon = "crop";
     } else if (g_strstr_len(op, -1, "save") != NULL) {
-        return "save";
+        icon = "save";
     } else if (g_strstr_len(op, -1, "load") != NULL) {
-        return "file-o";
+        icon = "file-o";
     } else if (g_strstr_len(op, -1, "text") != NULL) {
-        return "font";
+        icon = "font";
     } else {
-        return "picture-o";
+        icon = "picture-o";
     }
+    g_hash_table_insert(icons, g_strdup(op), (gpointer)icon);
+    return icon;
 }
 
 
@@ -370,17 +382,228 @@ struct _Library;
 
 static const gchar * const SETSOURCE_COMP_PREFIX = "imgflo-setsource-";
 static const gchar * const SETSOURCE_COMP_FORMAT = "imgflo-setsource-%s-%d"; // basename, rev
+static const gchar * const FUSED_OP_PREFIX = "imgflo-fused-";
+
+typedef enum _LibraryCompileStatus {
+    LibraryCompileQueued = 0,
+    LibraryCompileStarted,
+    LibraryCompileSucceeded,
+    LibraryCompileFailed
+} LibraryCompileStatus;
+
+// @output is the compiler output when status is LibraryCompileFailed, else NULL
+typedef void (* LibraryCompileCallback)
+    (struct _Library *library, const gchar *component, LibraryCompileStatus status,
+     const gchar *output, gpointer user_data);
+
+// A pending or running build of a component:source revision
+typedef struct _LibraryCompileJob {
+    struct _Library *library; // NULL if Library was freed while job was running
+    gchar *component;
+    gint revision;
+    GFile *file;
+    gchar *cache_key; // see compile_cache_key()
+    gboolean fused; // a fused operation, see library_build_fused_operation()
+} LibraryCompileJob;
+
+// A graph made available as a component. Gets inlined into the Graph using it
+typedef struct _LibraryGraph {
+    gchar *path; // file to load from, NULL if set from source
+    JsonNode *root; // parsed on first use, then shared by all users
+} LibraryGraph;
+
+static LibraryGraph *
+library_graph_new(const gchar *path, JsonNode *root) {
+    LibraryGraph *self = g_new(LibraryGraph, 1);
+    self->path = g_strdup(path);
+    self->root = root;
+    return self;
+}
+
+static void
+library_graph_free(LibraryGraph *self) {
+    if (!self) {
+        return;
+    }
+    if (self->root) {
+        json_node_free(self->root);
+    }
+    g_free(self->path);
+    g_free(self);
+}
 
-typedef void (* LibraryComponentChangedCallback) (struct _Library *library, gchar *op, gpointer user_data);
-LibraryComponentChangedCallback on_component_changed;
-gpointer on_component_changed_data;
+// A successfully built revision of a component:source component
+typedef struct _LibraryRevision {
+    gchar *component;
+    gint revision;
+} LibraryRevision;
+
+static LibraryRevision *
+library_revision_new(const gchar *component, gint revision) {
+    LibraryRevision *self = g_new(LibraryRevision, 1);
+    self->component = g_strdup(component);
+    self->revision = revision;
+    return self;
+}
+
+static void
+library_revision_free(LibraryRevision *self) {
+    g_free(self->component);
+    g_free(self);
+}
 
 typedef struct _Library {
     gchar *source_path;
     gchar *build_path;
     GHashTable *setsource_components;
+    GHashTable *graph_components; // name -> LibraryGraph
+    GHashTable *component_messages; // name -> serialized component:component message
+    GPtrArray *catalog; // of messages for all components. NULL when it needs rebuilding
+    JsonObject *metadata; // GEGL op -> { description, categories, inPorts, outPorts }
+    gchar *metadata_key; // identifies the GEGL version and modules metadata was created for
+    gchar *metadata_path; // where metadata is persisted between runs
+    gboolean metadata_dirty;
+    GQueue *compile_queue; // of LibraryCompileJob, waiting to be built
+    LibraryCompileJob *current_job; // being built, NULL if idle
+    gint last_revision; // of any setsource component, so queued builds never collide
+    GHashTable *compile_cache; // compile_cache_key() -> revision that was built from it
+    GHashTable *revisions; // setsource operation -> LibraryRevision, for all loaded revisions
+    GHashTable *operation_users; // setsource operation -> number of graph nodes using it
+    gchar *fusion_path; // where fused operations are built, and persisted between runs
+    GHashTable *fusion_builds; // fused operations this process has started building
+    GHashTable *fused_names; // chain signature -> fused operation name
+    gint fused_operations; // number of fused operations loaded
+    LibraryCompileCallback on_compile_progress;
+    gpointer on_compile_progress_data;
 } Library;
 
+#ifndef IMGFLO_GEGL_PLUGINSDIR
+#define IMGFLO_GEGL_PLUGINSDIR ""
+#endif
+
+#define METADATA_CACHE_VERSION 2 // increase whenever the fields stored per operation change
+
+// Directories GEGL loads operations from
+static gchar **
+module_directories(void) {
+    const gchar *gegl_path = g_getenv("GEGL_PATH");
+    gchar *all = g_strjoin(G_SEARCHPATH_SEPARATOR_S,
+                           (gegl_path) ? gegl_path : "", IMGFLO_GEGL_PLUGINSDIR, NULL);
+    gchar **dirs = g_strsplit(all, G_SEARCHPATH_SEPARATOR_S, 0);
+    g_free(all);
+    return dirs;
+}
+
+// Changes whenever the cache format changes, GEGL is upgraded, or operations are added, removed or changed
+static gchar *
+metadata_cache_key(void) {
+    GString *key = g_string_new(NULL);
+    gint major = 0, minor = 0, micro = 0;
+    gegl_get_version(&major, &minor, &micro);
+    g_string_append_printf(key, "imgflo-metadata-%d;gegl-%d.%d.%d", METADATA_CACHE_VERSION, major, minor, micro);
+
+    gchar **dirs = module_directories();
+    for (int i=0; dirs[i]; i++) {
+        GStatBuf st;
+        if (strlen(dirs[i]) == 0 || g_stat(dirs[i], &st) != 0) {
+            continue;
+        }
+        // Directory mtime catches added/removed modules, newest file catches replaced ones
+        glong newest = st.st_mtime;
+        GDir *dir = g_dir_open(dirs[i], 0, NULL);
+        const gchar *filename = NULL;
+        while (dir && (filename = g_dir_read_name(dir))) {
+            gchar *filepath = g_build_filename(dirs[i], filename, NULL);
+            GStatBuf file_st;
+            if (g_stat(filepath, &file_st) == 0 && file_st.st_mtime > newest) {
+                newest = file_st.st_mtime;
+            }
+            g_free(filepath);
+        }
+        if (dir) {
+            g_dir_close(dir);
+        }
+        g_string_append_printf(key, ";%s:%ld", dirs[i], newest);
+    }
+    g_strfreev(dirs);
+    return g_string_free(key, FALSE);
+}
+
+static gchar *
+metadata_cache_path(void) {
+    const gchar *dir = g_getenv("IMGFLO_CACHE_DIR");
+    if (dir) {
+        return g_build_filename(dir, "components.json", NULL);
+    }
+    return g_build_filename(g_get_user_cache_dir(), "imgflo", "components.json", NULL);
+}
+
+// Returns the cached metadata if it was created with @key, else NULL
+static JsonObject *
+metadata_cache_load(const gchar *path, const gchar *key) {
+    JsonObject *operations = NULL;
+    JsonParser *parser = json_parser_new();
+    if (json_parser_load_from_file(parser, path, NULL)) {
+        JsonNode *rootnode = json_parser_get_root(parser);
+        JsonObject *root = JSON_NODE_HOLDS_OBJECT(rootnode) ? json_node_get_object(rootnode) : NULL;
+        const gboolean valid = root && json_object_has_member(root, "key")
+                && json_object_has_member(root, "operations")
+                && g_strcmp0(json_object_get_string_member(root, "key"), key) == 0;
+        if (valid) {
+            operations = json_object_ref(json_object_get_object_member(root, "operations"));
+        }
+    }
+    g_object_unref(parser);
+    return operations;
+}
+
+static void
+metadata_cache_save(Library *self) {
+    if (!self->metadata_dirty) {
+        return;
+    }
+
+    JsonObject *root = json_object_new();
+    json_object_set_string_member(root, "key", self->metadata_key);
+    json_object_set_object_member(root, "operations", json_object_ref(self->metadata));
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, root);
+    gsize len = 0;
+    gchar *data = json_stringify_node(node, &len);
+    json_node_free(node);
+
+    GError *err = NULL;
+    gchar *dir = g_path_get_dirname(self->metadata_path);
+    g_mkdir_with_parents(dir, 0755);
+    // Atomic replace, multiple processes may share the cache
+    if (g_file_set_contents(self->metadata_path, data, len, &err)) {
+        self->metadata_dirty = FALSE;
+    } else {
+        imgflo_warning("Could not save component metadata cache: %s", err->message);
+    }
+    g_clear_error(&err);
+    g_free(dir);
+    g_free(data);
+}
+
+// Removes file, or directory with the files in it
+static void
+remove_path(const gchar *path) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (dir) {
+        const gchar *filename = NULL;
+        while ((filename = g_dir_read_name(dir))) {
+            gchar *child = g_build_filename(path, filename, NULL);
+            g_remove(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        g_rmdir(path);
+    } else {
+        g_remove(path);
+    }
+}
+
 Library *
 library_new() {
     Library *self = g_new(Library, 1);
@@ -393,21 +616,85 @@ library_new() {
     g_assert(g_mkdir_with_parents(self->source_path, 0755) == 0);
     self->setsource_components = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                         g_free, NULL);
+    self->graph_components = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, (GDestroyNotify)library_graph_free);
+    self->component_messages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    self->catalog = NULL;
+
+    self->metadata_key = metadata_cache_key();
+    self->metadata_path = metadata_cache_path();
+    self->metadata = metadata_cache_load(self->metadata_path, self->metadata_key);
+    if (!self->metadata) {
+        self->metadata = json_object_new();
+    }
+    self->metadata_dirty = FALSE;
+    self->compile_queue = g_queue_new();
+    self->current_job = NULL;
+    self->last_revision = -1;
+    self->compile_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    self->revisions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify)library_revision_free);
+    self->operation_users = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gchar *cache_dir = g_path_get_dirname(self->metadata_path);
+    self->fusion_path = g_build_filename(cache_dir, "fused", NULL);
+    g_free(cache_dir);
+    self->fusion_builds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    self->fused_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    self->fused_operations = 0;
+    self->on_compile_progress = NULL;
+    self->on_compile_progress_data = NULL;
     g_free(cwd);
 
     return self;
 }
 
+static void
+compile_job_free(LibraryCompileJob *job);
+
 void
 library_free(Library *self) {
 
+    if (self->current_job) {
+        // Cannot cancel make, just let it finish and be ignored
+        self->current_job->library = NULL;
+    }
+    g_queue_free_full(self->compile_queue, (GDestroyNotify)compile_job_free);
+    g_hash_table_destroy(self->compile_cache);
+    g_hash_table_destroy(self->revisions);
+    g_hash_table_destroy(self->operation_users);
+    g_hash_table_destroy(self->fusion_builds);
+    g_hash_table_destroy(self->fused_names);
+    g_free(self->fusion_path);
+
     g_hash_table_destroy(self->setsource_components);
+    g_hash_table_destroy(self->graph_components);
+    if (self->catalog) {
+        g_ptr_array_unref(self->catalog);
+    }
+    g_hash_table_destroy(self->component_messages);
+    metadata_cache_save(self);
+    json_object_unref(self->metadata);
+    g_free(self->metadata_key);
+    g_free(self->metadata_path);
     g_free(self->build_path);
     g_free(self->source_path);
 
     g_free(self);
 }
 
+// Drop cached information about @comp, must be called whenever a component changes
+static void
+library_invalidate_component(Library *self, const gchar *comp) {
+    if (self->catalog) {
+        // Holds pointers to the cached messages
+        g_ptr_array_unref(self->catalog);
+        self->catalog = NULL;
+    }
+    if (comp) {
+        g_hash_table_remove(self->component_messages, comp);
+    }
+}
+
 void
 try_print_error(GError *err) {
     if (!err) {
@@ -440,17 +727,77 @@ generate_cname() {
     return cname;
 }
 
+// Makefile COMPONENT_PROFILE used for component:source builds
+static const gchar *
+component_profile(void) {
+    const gchar *profile = g_getenv("IMGFLO_COMPONENT_PROFILE");
+    return (profile && strlen(profile)) ? profile : "default";
+}
+
+// Identifies what a build of @component from @source would produce.
+// Anything that influences the compiled code must be part of it
+static gchar *
+compile_cache_key(Library *self, const gchar *component, const gchar *source) {
+    gint major = 0, minor = 0, micro = 0;
+    gegl_get_version(&major, &minor, &micro);
+    gchar *gegl_version = g_strdup_printf("gegl-%d.%d.%d", major, minor, micro);
+    const gchar *cc = g_getenv("CC");
+    const gchar *cflags = g_getenv("CFLAGS");
+    const gchar *parts[] = {
+        component, source, gegl_version, SETSOURCE_COMP_PREFIX,
+        (cc) ? cc : "", (cflags) ? cflags : "", component_profile()
+    };
+
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    for (int i=0; i<G_N_ELEMENTS(parts); i++) {
+        // Include terminator, so parts cannot run into each other
+        g_checksum_update(checksum, (const guchar *)parts[i], strlen(parts[i])+1);
+    }
+    gchar *key = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    g_free(gegl_version);
+    return key;
+}
+
+static LibraryCompileJob *
+compile_job_new(Library *library, const gchar *component, gint revision,
+                GFile *file, const gchar *cache_key) {
+    LibraryCompileJob *job = g_new(LibraryCompileJob, 1);
+    job->library = library;
+    job->component = g_strdup(component);
+    job->revision = revision;
+    job->file = g_object_ref(file);
+    job->cache_key = g_strdup(cache_key);
+    job->fused = FALSE;
+    return job;
+}
+
 static void
-compile_plugin(GFile *file, const gchar *build_dir, gint rev) {
+compile_job_free(LibraryCompileJob *job) {
+    g_free(job->cache_key);
+    g_free(job->component);
+    g_object_unref(job->file);
+    g_free(job);
+}
+
+static void
+emit_compile_progress(Library *self, LibraryCompileJob *job,
+                      LibraryCompileStatus status, const gchar *output) {
+    if (self->on_compile_progress) {
+        self->on_compile_progress(self, job->component, status, output,
+                                  self->on_compile_progress_data);
+    }
+}
+
+// Operation names in @file get @name_prefix and @name_suffix added
+static GSubprocess *
+compile_plugin(GFile *file, const gchar *build_dir, const gchar *name_prefix, const gchar *name_suffix,
+               GError **error) {
     gchar *component = g_file_get_basename(file);
     GFile* dir = g_file_get_parent(file);
     gchar* dir_name = g_file_get_path(dir);
     gchar *component_cname = generate_cname();
 
-    gchar *stdout = NULL;
-    gchar *stderr = NULL;
-    gint exitcode = 1;
-    GError *err = NULL;
     gchar *argv[] = {
         g_strdup("/usr/bin/env"),
         g_strdup("make"),
@@ -459,43 +806,314 @@ compile_plugin(GFile *file, const gchar *build_dir, gint rev) {
         g_strdup_printf("COMPONENT_CNAME=%s", component_cname),
         g_strdup_printf("COMPONENTDIR=%s", dir_name),
         g_strdup_printf("COMPONENTINSTALLDIR=%s", build_dir),
-        g_strdup_printf("COMPONENT_NAME_PREFIX=\"%s\"", SETSOURCE_COMP_PREFIX),
-        g_strdup_printf("COMPONENT_NAME_SUFFIX=\"-%d\"", rev),
+        g_strdup_printf("COMPONENT_NAME_PREFIX=\"%s\"", name_prefix),
+        g_strdup_printf("COMPONENT_NAME_SUFFIX=\"%s\"", name_suffix),
+        g_strdup_printf("COMPONENT_PROFILE=%s", component_profile()),
         NULL
     };
 
     gchar *command = g_strjoinv(" ", argv);
     imgflo_debug("Building component %s using command '%s'", component, command);
- 
-    const gboolean success = g_spawn_sync(NULL, argv, NULL,
-                              G_SPAWN_DEFAULT, NULL, NULL,
-                              &stdout, &stderr, &exitcode, &err);
 
-    try_print_error(err);
-    if (!success) {
-        imgflo_error("Failed to compile operation: %s", stderr);
-    }
-    g_free(stdout);
-    g_free(stderr);
+    GSubprocess *proc = g_subprocess_newv((const gchar * const *)argv,
+                            G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE, error);
+
     for (int i=0; i<G_N_ELEMENTS(argv)-1; i++) {
         g_free(argv[i]);
     }
+    g_free(command);
     g_free(component);
     g_free(component_cname);
     g_object_unref(dir);
     g_free(dir_name);
+    return proc;
+}
+
+// Each revision is built into its own directory, so that only it has to be loaded
+static gchar *
+revision_build_dir(Library *self, const gchar *opname) {
+    return g_build_filename(self->build_path, opname, NULL);
 }
 
 static void
-reload_plugins(const gchar *path) {
+load_plugins(const gchar *path) {
     gegl_load_module_directory(path);
 }
 
+// Fused operations are built into a directory of this process first, and only moved
+// into place when done, as other processes may load from the same cache directory
+static gchar *
+fusion_build_dir(Library *self, const gchar *op, gboolean temporary) {
+    if (temporary) {
+        gchar *name = g_strdup_printf("%s.tmp-%d", op, (gint)getpid());
+        gchar *path = g_build_filename(self->fusion_path, name, NULL);
+        g_free(name);
+        return path;
+    }
+    return g_build_filename(self->fusion_path, op, NULL);
+}
+
+// Load fused operation @op, if it has been built, by this or an earlier run
+static gboolean
+fusion_load(Library *self, const gchar *op) {
+    gchar *build_dir = fusion_build_dir(self, op, FALSE);
+    if (g_file_test(build_dir, G_FILE_TEST_IS_DIR)) {
+        load_plugins(build_dir);
+    }
+    g_free(build_dir);
+    if (!gegl_has_operation(op)) {
+        return FALSE;
+    }
+    self->fused_operations++;
+    return TRUE;
+}
+
+static void
+fusion_build_finished(Library *self, LibraryCompileJob *job, gboolean success, const gchar *output) {
+    gchar *temporary = fusion_build_dir(self, job->component, TRUE);
+    gchar *build_dir = fusion_build_dir(self, job->component, FALSE);
+    if (!success) {
+        imgflo_warning("Failed to compile fused operation %s: %s", job->component, output);
+    } else if (g_rename(temporary, build_dir) != 0) {
+        imgflo_debug("Fused operation %s was built by another process", job->component);
+    }
+    remove_path(temporary);
+    g_file_delete(job->file, NULL, NULL);
+    if (success && !fusion_load(self, job->component)) {
+        imgflo_warning("Built fused operation %s, but could not load it", job->component);
+    }
+    g_free(build_dir);
+    g_free(temporary);
+}
+
+gint
+find_op_revision(Library *self, const gchar *base, gchar **name_out);
+
+static void
+remove_revision_files(Library *self, const gchar *opname) {
+    GFile *source = get_source_file(self->source_path, opname);
+    g_file_delete(source, NULL, NULL);
+    g_object_unref(source);
+
+    gchar *build_dir = revision_build_dir(self, opname);
+    remove_path(build_dir);
+    g_free(build_dir);
+}
+
+// Retire revisions that have been replaced and are not used by any graph anymore.
+// GEGL cannot unregister an operation type, but its files are removed and it will not be reused
+static void
+retire_unused_revisions(Library *self) {
+    GHashTableIter iter;
+    gpointer key = NULL, value = NULL;
+    g_hash_table_iter_init(&iter, self->revisions);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const gchar *opname = (const gchar *)key;
+        LibraryRevision *rev = (LibraryRevision *)value;
+        const gboolean current = (find_op_revision(self, rev->component, NULL) == rev->revision);
+        if (current || g_hash_table_contains(self->operation_users, opname)) {
+            continue;
+        }
+
+        imgflo_debug("Retiring unused revision %s", opname);
+        remove_revision_files(self, opname);
+        GHashTableIter cache_iter;
+        gpointer cached_rev = NULL;
+        g_hash_table_iter_init(&cache_iter, self->compile_cache);
+        while (g_hash_table_iter_next(&cache_iter, NULL, &cached_rev)) {
+            if (GPOINTER_TO_INT(cached_rev) == rev->revision) {
+                g_hash_table_iter_remove(&cache_iter);
+            }
+        }
+        g_hash_table_iter_remove(&iter);
+    }
+}
+
+// Called for every graph node instantiating GEGL operation @op
+void
+library_use_operation(Library *self, const gchar *op) {
+    g_return_if_fail(self);
+    g_return_if_fail(op);
+    if (!g_hash_table_contains(self->revisions, op)) {
+        return; // only setsource revisions are tracked
+    }
+    const gint users = GPOINTER_TO_INT(g_hash_table_lookup(self->operation_users, op));
+    g_hash_table_replace(self->operation_users, g_strdup(op), GINT_TO_POINTER(users+1));
+}
+
+// Called when a graph node using @op is removed
+void
+library_release_operation(Library *self, const gchar *op) {
+    g_return_if_fail(self);
+    g_return_if_fail(op);
+    if (!g_hash_table_contains(self->operation_users, op)) {
+        return;
+    }
+    const gint users = GPOINTER_TO_INT(g_hash_table_lookup(self->operation_users, op)) - 1;
+    if (users > 0) {
+        g_hash_table_replace(self->operation_users, g_strdup(op), GINT_TO_POINTER(users));
+    } else {
+        g_hash_table_remove(self->operation_users, op);
+        retire_unused_revisions(self);
+    }
+}
+
+static void
+library_start_next_compile(Library *self);
+
+static void
+compile_plugin_finished(GObject *source, GAsyncResult *res, gpointer user_data) {
+    GSubprocess *proc = G_SUBPROCESS(source);
+    LibraryCompileJob *job = (LibraryCompileJob *)user_data;
+    Library *self = job->library;
+
+    gchar *output = NULL;
+    GError *err = NULL;
+    g_subprocess_communicate_utf8_finish(proc, res, &output, NULL, &err);
+    const gboolean success = !err && g_subprocess_get_successful(proc);
+
+    if (self && job->fused) {
+        self->current_job = NULL;
+        fusion_build_finished(self, job, success, (err) ? err->message : output);
+        library_start_next_compile(self);
+    } else if (self) {
+        self->current_job = NULL;
+        gchar *opname = g_strdup_printf(SETSOURCE_COMP_FORMAT, job->component, job->revision);
+        if (success) {
+            // Only now does the new revision replace the old one
+            gchar *build_dir = revision_build_dir(self, opname);
+            load_plugins(build_dir);
+            g_free(build_dir);
+            g_hash_table_replace(self->revisions, g_strdup(opname),
+                                 library_revision_new(job->component, job->revision));
+            g_hash_table_replace(self->setsource_components,
+                                 g_strdup(job->component), GINT_TO_POINTER(job->revision));
+            g_hash_table_replace(self->compile_cache,
+                                 g_strdup(job->cache_key), GINT_TO_POINTER(job->revision));
+            library_invalidate_component(self, job->component);
+            retire_unused_revisions(self);
+            emit_compile_progress(self, job, LibraryCompileSucceeded, NULL);
+        } else {
+            const gchar *reason = (err) ? err->message : output;
+            imgflo_warning("Failed to compile component %s: %s", job->component, reason);
+            remove_revision_files(self, opname);
+            emit_compile_progress(self, job, LibraryCompileFailed, reason);
+        }
+        g_free(opname);
+        library_start_next_compile(self);
+    }
+
+    g_clear_error(&err);
+    g_free(output);
+    g_object_unref(proc);
+    compile_job_free(job);
+}
+
+static void
+library_start_next_compile(Library *self) {
+    while (!self->current_job && !g_queue_is_empty(self->compile_queue)) {
+        LibraryCompileJob *job = (LibraryCompileJob *)g_queue_pop_head(self->compile_queue);
+
+        GError *err = NULL;
+        GSubprocess *proc = NULL;
+        if (job->fused) {
+            // Source already has the final operation name
+            gchar *build_dir = fusion_build_dir(self, job->component, TRUE);
+            proc = compile_plugin(job->file, build_dir, "", "", &err);
+            g_free(build_dir);
+        } else {
+            gchar *opname = g_strdup_printf(SETSOURCE_COMP_FORMAT, job->component, job->revision);
+            gchar *build_dir = revision_build_dir(self, opname);
+            gchar *suffix = g_strdup_printf("-%d", job->revision);
+            proc = compile_plugin(job->file, build_dir, SETSOURCE_COMP_PREFIX, suffix, &err);
+            g_free(suffix);
+            g_free(build_dir);
+            g_free(opname);
+        }
+        if (!proc) {
+            imgflo_warning("Failed to start compiler for %s: %s", job->component, err->message);
+            if (!job->fused) {
+                emit_compile_progress(self, job, LibraryCompileFailed, err->message);
+            }
+            g_clear_error(&err);
+            compile_job_free(job);
+            continue;
+        }
+        self->current_job = job;
+        if (!job->fused) {
+            emit_compile_progress(self, job, LibraryCompileStarted, NULL);
+        }
+        g_subprocess_communicate_utf8_async(proc, NULL, NULL, compile_plugin_finished, job);
+    }
+}
+
+// TRUE if any component:source builds are queued or running
+gboolean
+library_is_compiling(Library *self) {
+    g_return_val_if_fail(self, FALSE);
+    return self->current_job || !g_queue_is_empty(self->compile_queue);
+}
+
+// Blocks until all queued builds are done. For tools without a main loop
+void
+library_wait_for_compilation(Library *self) {
+    g_return_if_fail(self);
+    while (library_is_compiling(self)) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
 gboolean
 is_setsource_comp(const gchar *name) {
     return g_str_has_prefix(name, SETSOURCE_COMP_PREFIX);
 }
 
+gboolean
+is_fused_op(const gchar *name) {
+    return g_str_has_prefix(name, FUSED_OP_PREFIX);
+}
+
+// Returns new reference to { description, categories, inPorts, outPorts } of GEGL operation @op
+// Introspected on first use, and persisted unless @op is a dynamic setsource operation
+static JsonObject *
+operation_metadata(Library *self, const gchar *op) {
+    if (json_object_has_member(self->metadata, op)) {
+        return json_object_ref(json_object_get_object_member(self->metadata, op));
+    }
+
+    JsonObject *meta = json_object_new();
+    json_object_set_string_member(meta, "description", gegl_operation_get_key(op, "description"));
+    json_object_set_string_member(meta, "categories", gegl_operation_get_key(op, "categories"));
+    json_object_set_array_member(meta, "inPorts", library_inports_for_operation(op));
+    json_object_set_array_member(meta, "outPorts", library_outports_for_operation(op));
+
+    if (!is_setsource_comp(op)) {
+        json_object_set_object_member(self->metadata, op, json_object_ref(meta));
+        self->metadata_dirty = TRUE;
+    }
+    return meta;
+}
+
+JsonArray *
+library_get_inports(Library *self, const gchar *op) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(op, NULL);
+    JsonObject *meta = operation_metadata(self, op);
+    JsonArray *ports = json_array_ref(json_object_get_array_member(meta, "inPorts"));
+    json_object_unref(meta);
+    return ports;
+}
+
+JsonArray *
+library_get_outports(Library *self, const gchar *op) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(op, NULL);
+    JsonObject *meta = operation_metadata(self, op);
+    JsonArray *ports = json_array_ref(json_object_get_array_member(meta, "outPorts"));
+    json_object_unref(meta);
+    return ports;
+}
+
 gint
 find_op_revision(Library *self, const gchar *base, gchar **name_out) {
     g_return_val_if_fail(base, -1);
@@ -542,35 +1160,140 @@ library_get_operation_name(Library *self, const gchar *comp) {
     return geglname;
 }
 
-// Returns operation name
+// Queues a build of a new revision of @op. Returns the operation name it will have once built
 gchar *
 library_set_source(Library *self, const gchar *op, const gchar *source) {
-    const gint next_rev = find_op_revision(self, op, NULL)+1;
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(op, NULL);
+    g_return_val_if_fail(source, NULL);
+
+    // Clients often re-send unchanged code, on save or reconnect.
+    // Revisions stay loaded in GEGL, so an identical earlier build can just be reused
+    gchar *cache_key = compile_cache_key(self, op, source);
+    gpointer cached = NULL;
+    if (g_hash_table_lookup_extended(self->compile_cache, cache_key, NULL, &cached)) {
+        const gint rev = GPOINTER_TO_INT(cached);
+        gchar *opname = g_strdup_printf(SETSOURCE_COMP_FORMAT, op, rev);
+        if (gegl_has_operation(opname)) {
+            imgflo_debug("Reusing build of %s for component %s", opname, op);
+            if (find_op_revision(self, op, NULL) != rev) {
+                g_hash_table_replace(self->setsource_components, g_strdup(op), GINT_TO_POINTER(rev));
+                library_invalidate_component(self, op);
+                retire_unused_revisions(self);
+            }
+            LibraryCompileJob hit = { self, (gchar *)op, rev, NULL, cache_key };
+            emit_compile_progress(self, &hit, LibraryCompileSucceeded, NULL);
+            g_free(cache_key);
+            return opname;
+        }
+        g_free(opname);
+        g_hash_table_remove(self->compile_cache, cache_key);
+    }
+
+    const gint next_rev = ++self->last_revision;
     gchar *opname =  g_strdup_printf(SETSOURCE_COMP_FORMAT, op, next_rev);
 
     GFile *file = get_source_file(self->source_path, opname);
     GError *err = NULL;
-    GOutputStream *stream = (GOutputStream *)g_file_replace(file, NULL, FALSE, G_FILE_CREATE_PRIVATE, NULL, &err);
+    const gboolean success = g_file_replace_contents(file, source, strlen(source), NULL, FALSE,
+                                                     G_FILE_CREATE_PRIVATE, NULL, NULL, &err);
     try_print_error(err);
-    g_assert(stream);
+    g_clear_error(&err);
 
-    gsize bytes = strlen(source);
-    gsize bytes_written = 0;
-    const gboolean success = g_output_stream_write_all(stream, source, bytes, &bytes_written, NULL, &err);
+    if (success) {
+        // Built in the background, on_compile_progress tells when it is done
+        LibraryCompileJob *job = compile_job_new(self, op, next_rev, file, cache_key);
+        g_queue_push_tail(self->compile_queue, job);
+        emit_compile_progress(self, job, LibraryCompileQueued, NULL);
+        library_start_next_compile(self);
+    } else {
+        g_free(opname);
+        opname = NULL;
+    }
 
-    try_print_error(err);
-    const gboolean closed = g_output_stream_close(stream, NULL, &err);
-    try_print_error(err);
+    g_free(cache_key);
+    g_object_unref(file);
+    return opname;
+}
+
+// Name of the GEGL operation fusing the operations in @signature, generated from @template.
+// Everything that influences the build is part of it, so a build persisted by an earlier run
+// is only reused if it would be identical. Computed once per signature, as @template does not change
+gchar *
+library_fused_operation_name(Library *self, const gchar *signature, const gchar *template) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(signature, NULL);
+    g_return_val_if_fail(template, NULL);
+
+    const gchar *name = g_hash_table_lookup(self->fused_names, signature);
+    if (!name) {
+        gchar *key = compile_cache_key(self, signature, template);
+        gchar *op = g_strdup_printf("%s%.16s", FUSED_OP_PREFIX, key);
+        g_free(key);
+        g_hash_table_insert(self->fused_names, g_strdup(signature), op);
+        name = op;
+    }
+    return g_strdup(name);
+}
 
-    compile_plugin(file, self->build_path, next_rev);
-    reload_plugins(self->build_path);
+// Whether a build of fused operation @op is queued or running
+gboolean
+library_fused_operation_pending(Library *self, const gchar *op) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(op, FALSE);
 
-    // imgflo_debug("%s: %s, %s, %d\n", __PRETTY_FUNCTION__, op, opname, next_rev);
-    g_hash_table_replace(self->setsource_components, (gpointer)g_strdup(op), GINT_TO_POINTER(next_rev));
+    if (self->current_job && g_strcmp0(self->current_job->component, op) == 0) {
+        return TRUE;
+    }
+    for (GList *l = self->compile_queue->head; l; l = l->next) {
+        if (g_strcmp0(((LibraryCompileJob *)l->data)->component, op) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
 
+// TRUE if fused operation @op can be used. Else it is built from @source in the background,
+// unless that was tried already. Call again once library_is_compiling() is FALSE
+gboolean
+library_build_fused_operation(Library *self, const gchar *op, const gchar *source) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(op, FALSE);
+    g_return_val_if_fail(source, FALSE);
+
+    if (gegl_has_operation(op)) {
+        return TRUE;
+    }
+    if (g_hash_table_contains(self->fusion_builds, op)) {
+        return FALSE; // being built, or failed
+    }
+    g_hash_table_add(self->fusion_builds, g_strdup(op));
+    if (fusion_load(self, op)) {
+        return TRUE;
+    }
+
+    GError *err = NULL;
+    g_mkdir_with_parents(self->fusion_path, 0755);
+    GFile *file = get_source_file(self->fusion_path, op);
+    const gboolean written = g_file_replace_contents(file, source, strlen(source), NULL, FALSE,
+                                                     G_FILE_CREATE_NONE, NULL, NULL, &err);
+    try_print_error(err);
     g_clear_error(&err);
+    if (written) {
+        LibraryCompileJob *job = compile_job_new(self, op, -1, file, "");
+        job->fused = TRUE;
+        g_queue_push_tail(self->compile_queue, job);
+        library_start_next_compile(self);
+    }
     g_object_unref(file);
-    return (success && closed) ? opname : NULL;
+    return FALSE;
+}
+
+// Number of fused operations loaded
+gint
+library_fused_operations(Library *self) {
+    g_return_val_if_fail(self, 0);
+    return self->fused_operations;
 }
 
 void
@@ -622,6 +1345,197 @@ library_get_source(Library *self, const gchar *op) {
     return buffer;
 }
 
+static JsonNode *
+parse_graph(const gchar *path, const gchar *data, GError **error) {
+    JsonParser *parser = json_parser_new();
+    const gboolean success = (path) ?
+        json_parser_load_from_file(parser, path, error) :
+        json_parser_load_from_data(parser, data, -1, error);
+
+    JsonNode *root = NULL;
+    if (success) {
+        JsonNode *r = json_parser_get_root(parser);
+        if (JSON_NODE_HOLDS_OBJECT(r)) {
+            root = json_node_copy(r);
+        } else {
+            imgflo_warning("Graph is not a JSON object: %s", (path) ? path : "<source>");
+        }
+    }
+    g_object_unref(parser);
+    return root;
+}
+
+// Register a graph, as JSON, to be available as component @name
+gboolean
+library_set_graph_source(Library *self, const gchar *name, const gchar *source) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(name, FALSE);
+    g_return_val_if_fail(source, FALSE);
+
+    GError *err = NULL;
+    JsonNode *root = parse_graph(NULL, source, &err);
+    try_print_error(err);
+    g_clear_error(&err);
+    if (!root) {
+        return FALSE;
+    }
+
+    // Graphs already using the old version keep their reference to it
+    g_hash_table_replace(self->graph_components, g_strdup(name), library_graph_new(NULL, root));
+    library_invalidate_component(self, name);
+    return TRUE;
+}
+
+// Make all .json graphs in @path available as components, named by their basename
+// Files are only parsed when first used. Returns number of graphs found
+gint
+library_add_graph_directory(Library *self, const gchar *path) {
+    g_return_val_if_fail(self, 0);
+    g_return_val_if_fail(path, 0);
+
+    GError *err = NULL;
+    GDir *dir = g_dir_open(path, 0, &err);
+    try_print_error(err);
+    g_clear_error(&err);
+    if (!dir) {
+        return 0;
+    }
+
+    gint added = 0;
+    const gchar *filename = NULL;
+    while ((filename = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(filename, ".json")) {
+            continue;
+        }
+        gchar *name = g_strndup(filename, strlen(filename)-strlen(".json"));
+        gchar *filepath = g_build_filename(path, filename, NULL);
+        library_invalidate_component(self, name);
+        g_hash_table_replace(self->graph_components, name, library_graph_new(filepath, NULL));
+        g_free(filepath);
+        added++;
+    }
+    g_dir_close(dir);
+    return added;
+}
+
+// Returns the definition of graph component @comp, or NULL if it is not a graph
+// Owned by Library. Callers keeping it around must take a reference
+JsonObject *
+library_get_graph(Library *self, const gchar *comp) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(comp, NULL);
+
+    LibraryGraph *graph = g_hash_table_lookup(self->graph_components, comp);
+    if (!graph) {
+        return NULL;
+    }
+    if (!graph->root && graph->path) {
+        GError *err = NULL;
+        graph->root = parse_graph(graph->path, NULL, &err);
+        try_print_error(err);
+        g_clear_error(&err);
+    }
+    return (graph->root) ? json_node_get_object(graph->root) : NULL;
+}
+
+static JsonArray *
+graph_ports(Library *self, JsonObject *graph, gboolean inports, gint depth) {
+    JsonArray *ports = json_array_new();
+    const gchar *member = (inports) ? "inports" : "outports";
+    if (!json_object_has_member(graph, member)) {
+        return ports;
+    }
+    JsonObject *exported = json_object_get_object_member(graph, member);
+    JsonObject *processes = json_object_get_object_member(graph, "processes");
+
+    GList *names = json_object_get_members(exported);
+    for (GList *l = names; l != NULL; l = l->next) {
+        const gchar *name = (const gchar *)l->data;
+        JsonObject *conn = json_object_get_object_member(exported, name);
+        const gchar *process = json_object_get_string_member(conn, "process");
+        const gchar *port = json_object_get_string_member(conn, "port");
+        JsonObject *proc = (processes && process && json_object_has_member(processes, process)) ?
+                json_object_get_object_member(processes, process) : NULL;
+        const gchar *component = (proc) ? json_object_get_string_member(proc, "component") : NULL;
+
+        // Port information comes from the target port
+        JsonArray *target_ports = NULL;
+        if (!component || g_strcmp0(component, "Processor") == 0) {
+            // No information available
+        } else if (g_hash_table_contains(self->graph_components, component)) {
+            JsonObject *subgraph = library_get_graph(self, component);
+            const gint max_depth = 20; // protect against graphs including themselves
+            if (subgraph && depth < max_depth) {
+                target_ports = graph_ports(self, subgraph, inports, depth+1);
+            }
+        } else {
+            gchar *op = library_get_operation_name(self, component);
+            target_ports = (inports) ? library_get_inports(self, op) : library_get_outports(self, op);
+            g_free(op);
+        }
+
+        JsonObject *info = NULL;
+        for (int i=0; target_ports && i<json_array_get_length(target_ports); i++) {
+            JsonObject *p = json_array_get_object_element(target_ports, i);
+            if (g_strcmp0(json_object_get_string_member(p, "id"), port) == 0) {
+                info = p;
+                break;
+            }
+        }
+
+        JsonObject *out = json_object_new();
+        json_object_set_string_member(out, "id", name);
+        if (info) {
+            GList *keys = json_object_get_members(info);
+            for (GList *k = keys; k != NULL; k = k->next) {
+                const gchar *key = (const gchar *)k->data;
+                if (g_strcmp0(key, "id") != 0) {
+                    json_object_set_member(out, key, json_node_copy(json_object_get_member(info, key)));
+                }
+            }
+            g_list_free(keys);
+        } else {
+            json_object_set_string_member(out, "type", "any");
+        }
+        json_array_add_object_element(ports, out);
+
+        if (target_ports) {
+            json_array_unref(target_ports);
+        }
+    }
+    g_list_free(names);
+    return ports;
+}
+
+// Port information for the exported ports of @graph, looked up from the ports they are connected to
+JsonArray *
+library_graph_ports(Library *self, JsonObject *graph, gboolean inports) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(graph, NULL);
+    return graph_ports(self, graph, inports, 0);
+}
+
+static JsonObject *
+graph_component(Library *self, const gchar *name, JsonObject *graph)
+{
+    const gchar *description = "Subgraph";
+    if (json_object_has_member(graph, "properties")) {
+        JsonObject *properties = json_object_get_object_member(graph, "properties");
+        if (json_object_has_member(properties, "description")) {
+            description = json_object_get_string_member(properties, "description");
+        }
+    }
+
+    JsonObject *component = json_object_new();
+    json_object_set_string_member(component, "name", name);
+    json_object_set_string_member(component, "description", description);
+    json_object_set_string_member(component, "icon", "sitemap");
+    json_object_set_boolean_member(component, "subgraph", TRUE);
+    json_object_set_array_member(component, "inPorts", library_graph_ports(self, graph, TRUE));
+    json_object_set_array_member(component, "outPorts", library_graph_ports(self, graph, FALSE));
+    return component;
+}
+
 JsonObject *
 library_get_component(Library *self, const gchar *comp)
 {
@@ -632,6 +1546,12 @@ library_get_component(Library *self, const gchar *comp)
         return processor_component();
     }
 
+    // Graphs
+    JsonObject *graph = library_get_graph(self, comp);
+    if (graph) {
+        return graph_component(self, comp, graph);
+    }
+
     // setsource dynamic ops
     gchar *op = NULL;
     gint setsource_rev = find_op_revision(self, comp, &op);
@@ -642,20 +1562,23 @@ library_get_component(Library *self, const gchar *comp)
     }
 
     gchar *name = geglop2component(comp);
-    const gchar *description = gegl_operation_get_key(op, "description");
-    const gchar *categories = gegl_operation_get_key(op, "categories");
+    JsonObject *meta = operation_metadata(self, op);
+    const gchar *description = json_object_get_string_member(meta, "description");
+    const gchar *categories = json_object_get_string_member(meta, "categories");
 
     JsonObject *component = json_object_new();
     json_object_set_string_member(component, "name", name);
     json_object_set_string_member(component, "description", description);
     json_object_set_string_member(component, "icon", icon_for_op(op, categories));
 
-    JsonArray *inports = library_inports_for_operation(op);
+    JsonArray *inports = json_array_ref(json_object_get_array_member(meta, "inPorts"));
     json_object_set_array_member(component, "inPorts", inports);
 
-    JsonArray *outports = library_outports_for_operation(op);
+    JsonArray *outports = json_array_ref(json_object_get_array_member(meta, "outPorts"));
     json_object_set_array_member(component, "outPorts", outports);
 
+    json_object_unref(meta);
+    g_free(name);
     g_free(op);
     return component;
 }
@@ -679,7 +1602,9 @@ library_list_components(Library *self, gint *len) {
     const gint no_setsource_ops = g_hash_table_size(self->setsource_components);
 
 
-    const gint total_ops = no_special_ops+no_ops+no_setsource_ops;
+    const gint no_graphs = g_hash_table_size(self->graph_components);
+
+    const gint total_ops = no_special_ops+no_ops+no_setsource_ops+no_graphs;
 
     // Concatenate all
     gchar **ret = (gchar **)g_new0(gchar*, total_ops+1); // leave NULL at end
@@ -691,15 +1616,67 @@ library_list_components(Library *self, gint *len) {
         if (g_strcmp0(op, "gegl:seamless-clone-compose") == 0) {
             // FIXME: reported by GEGL but cannot be instantiated...
             op = NULL;
-        } else if (is_setsource_comp(op)) {
+        } else if (is_setsource_comp(op) || is_fused_op(op)) {
             op = NULL;
         }
 
         ret[no_special_ops+i] = g_strdup(op);
     }
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gint graph_no = 0;
+    g_hash_table_iter_init(&iter, self->graph_components);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        ret[no_special_ops+no_ops+no_setsource_ops+graph_no] = g_strdup((const gchar *)key);
+        graph_no++;
+    }
 
     if (len) {
         *len = total_ops;
     }
     return ret;
 }
+
+// Serialized component:component message for @comp
+// Built on first request, then cached until the component changes
+const gchar *
+library_get_component_message(Library *self, const gchar *comp) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(comp, NULL);
+
+    const gchar *message = g_hash_table_lookup(self->component_messages, comp);
+    if (!message) {
+        JsonObject *component = library_get_component(self, comp);
+        g_return_val_if_fail(component, NULL);
+        gchar *data = form_response("component", "component", component);
+        g_hash_table_insert(self->component_messages, g_strdup(comp), data);
+        message = data;
+    }
+    return message;
+}
+
+// Serialized component:component messages for all available components
+// Owned by Library, valid until a component is changed
+GPtrArray *
+library_get_catalog(Library *self) {
+    g_return_val_if_fail(self, NULL);
+
+    if (!self->catalog) {
+        const double start = imgflo_get_time();
+        gint no_components = 0;
+        gchar **names = library_list_components(self, &no_components);
+        self->catalog = g_ptr_array_sized_new(no_components);
+        for (int i=0; i<no_components; i++) {
+            const gchar *message = (names[i]) ? library_get_component_message(self, names[i]) : NULL;
+            if (message) {
+                g_ptr_array_add(self->catalog, (gpointer)message);
+            }
+            g_free(names[i]);
+        }
+        g_free(names);
+        imgflo_debug("Built component catalog with %d entries in %.1f ms\n",
+                     self->catalog->len, (imgflo_get_time()-start)*1000.0);
+        metadata_cache_save(self);
+    }
+    return self->catalog;
+}
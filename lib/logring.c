@@ -0,0 +1,99 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Bounded lock-free queue of log messages, with many producers and one consumer.
+// Producers never wait: when the ring is full, the message is counted as dropped.
+// Each slot has a sequence number telling whether it is free for the producer
+// claiming position N (sequence == N), or holds data for the consumer (sequence == N+1)
+
+#define LOG_RING_SIZE 1024 // must be power of two
+
+typedef struct _LogRingSlot {
+    gint sequence;
+    gboolean is_error;
+    gchar *message;
+} LogRingSlot;
+
+typedef struct _LogRing {
+    LogRingSlot slots[LOG_RING_SIZE];
+    gint head; // next position for producers
+    gint tail; // next position for consumer
+    gint dropped;
+} LogRing;
+
+// Sequence numbers wrap around, compare them as differences
+static inline gint
+log_ring_distance(gint a, gint b) {
+    return (gint)((guint)a - (guint)b);
+}
+
+LogRing *
+log_ring_new(void) {
+    LogRing *self = g_new0(LogRing, 1);
+    for (gint i = 0; i < LOG_RING_SIZE; i++) {
+        self->slots[i].sequence = i;
+    }
+    return self;
+}
+
+void
+log_ring_free(LogRing *self) {
+    for (gint i = 0; i < LOG_RING_SIZE; i++) {
+        g_free(self->slots[i].message);
+    }
+    g_free(self);
+}
+
+// Safe from any thread. Takes ownership of @message. Returns FALSE if ring was full
+gboolean
+log_ring_push(LogRing *self, gboolean is_error, gchar *message) {
+    gint pos = g_atomic_int_get(&self->head);
+    LogRingSlot *slot = NULL;
+    while (TRUE) {
+        slot = &self->slots[pos & (LOG_RING_SIZE-1)];
+        const gint diff = log_ring_distance(g_atomic_int_get(&slot->sequence), pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange(&self->head, pos, (gint)((guint)pos+1))) {
+                break;
+            }
+            pos = g_atomic_int_get(&self->head);
+        } else if (diff < 0) {
+            g_atomic_int_inc(&self->dropped);
+            g_free(message);
+            return FALSE;
+        } else {
+            pos = g_atomic_int_get(&self->head);
+        }
+    }
+    slot->is_error = is_error;
+    slot->message = message;
+    g_atomic_int_set(&slot->sequence, (gint)((guint)pos+1));
+    return TRUE;
+}
+
+// Only from the consumer thread. Returns FALSE if empty, else ownership of message in @message_out
+gboolean
+log_ring_pop(LogRing *self, gboolean *is_error_out, gchar **message_out) {
+    const gint pos = self->tail;
+    LogRingSlot *slot = &self->slots[pos & (LOG_RING_SIZE-1)];
+    if (log_ring_distance(g_atomic_int_get(&slot->sequence), (gint)((guint)pos+1)) != 0) {
+        return FALSE;
+    }
+    *is_error_out = slot->is_error;
+    *message_out = slot->message;
+    slot->message = NULL;
+    g_atomic_int_set(&slot->sequence, (gint)((guint)pos+LOG_RING_SIZE));
+    self->tail = (gint)((guint)pos+1);
+    return TRUE;
+}
+
+// Number of messages dropped since last call
+guint
+log_ring_take_dropped(LogRing *self) {
+    gint dropped = 0;
+    do {
+        dropped = g_atomic_int_get(&self->dropped);
+    } while (!g_atomic_int_compare_and_exchange(&self->dropped, dropped, 0));
+    return (guint)dropped;
+}
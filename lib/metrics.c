@@ -0,0 +1,220 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Counters and histograms for the /metrics endpoint, in Prometheus text format.
+// Updated from any thread with atomic adds only, so they are cheap on hot paths.
+// Readers may see a histogram mid-update, which is fine for monitoring
+
+typedef enum _MetricsEndpoint {
+    MetricsEndpointFrontpage = 0,
+    MetricsEndpointProcess,
+    MetricsEndpointTile,
+    MetricsEndpointBatch,
+    MetricsEndpointGraph,
+    MetricsEndpointMetrics,
+    MetricsEndpointOther,
+    MetricsEndpoints
+} MetricsEndpoint;
+
+static const gchar *metrics_endpoint_paths[] = { "/", "/process", "/tile", "/batch", "/graph", "/metrics", "other" };
+
+// Upper bounds, in seconds
+static const gdouble metrics_buckets[] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 };
+
+#define METRICS_STATUS_CLASSES 5 // 1xx-5xx
+
+typedef struct _MetricsHistogram {
+    gsize buckets[G_N_ELEMENTS(metrics_buckets)+1]; // not cumulative, last is +Inf
+    gsize count;
+    gsize sum_us;
+} MetricsHistogram;
+
+typedef struct _Metrics {
+    gsize requests[MetricsEndpoints][METRICS_STATUS_CLASSES];
+    MetricsHistogram latency[MetricsEndpoints];
+    gsize render_tasks;
+    gsize render_busy_us;
+    gint render_active;
+    MetricsHistogram encode;
+    gsize encoded_bytes[ImageFormatInvalid];
+    gsize cache_hits;
+    gsize cache_misses;
+    gsize cache_not_modified;
+} Metrics;
+
+// Counters are pointer-sized, so GLib pointer atomics work on them
+static inline void
+metrics_add(gsize *counter, gsize value) {
+    (void)g_atomic_pointer_add(counter, value);
+}
+
+static inline gsize
+metrics_get(gsize *counter) {
+    return (gsize)g_atomic_pointer_get(counter);
+}
+
+Metrics *
+metrics_new(void) {
+    return g_new0(Metrics, 1);
+}
+
+void
+metrics_free(Metrics *self) {
+    g_free(self);
+}
+
+MetricsEndpoint
+metrics_endpoint_from_path(const gchar *path) {
+    if (g_str_has_prefix(path, "/graph/")) {
+        // Templates are counted together
+        return MetricsEndpointGraph;
+    }
+    for (int i=0; i<MetricsEndpointOther; i++) {
+        if (g_strcmp0(path, metrics_endpoint_paths[i]) == 0) {
+            return (MetricsEndpoint)i;
+        }
+    }
+    return MetricsEndpointOther;
+}
+
+static void
+metrics_histogram_observe(MetricsHistogram *self, gint64 duration_us) {
+    const gdouble seconds = duration_us / 1e6;
+    guint i = 0;
+    while (i < G_N_ELEMENTS(metrics_buckets) && seconds > metrics_buckets[i]) {
+        i++;
+    }
+    metrics_add(&self->buckets[i], 1);
+    metrics_add(&self->count, 1);
+    metrics_add(&self->sum_us, (gsize)MAX(duration_us, 0));
+}
+
+void
+metrics_request_done(Metrics *self, MetricsEndpoint endpoint, guint status, gint64 duration_us) {
+    g_return_if_fail(endpoint < MetricsEndpoints);
+    const guint klass = CLAMP(status/100, 1, METRICS_STATUS_CLASSES) - 1;
+    metrics_add(&self->requests[endpoint][klass], 1);
+    metrics_histogram_observe(&self->latency[endpoint], duration_us);
+}
+
+void
+metrics_render_started(Metrics *self) {
+    g_atomic_int_inc(&self->render_active);
+}
+
+void
+metrics_render_done(Metrics *self, gint64 duration_us) {
+    g_atomic_int_add(&self->render_active, -1);
+    metrics_add(&self->render_tasks, 1);
+    metrics_add(&self->render_busy_us, (gsize)MAX(duration_us, 0));
+}
+
+void
+metrics_encoded(Metrics *self, ImageFormat format, gsize bytes, gint64 duration_us) {
+    g_return_if_fail(format < ImageFormatInvalid);
+    metrics_add(&self->encoded_bytes[format], bytes);
+    metrics_histogram_observe(&self->encode, duration_us);
+}
+
+typedef enum _MetricsCacheResult {
+    MetricsCacheHit,
+    MetricsCacheMiss,
+    MetricsCacheNotModified
+} MetricsCacheResult;
+
+void
+metrics_cache_lookup(Metrics *self, MetricsCacheResult result) {
+    gsize *counter = (result == MetricsCacheHit) ? &self->cache_hits :
+                     (result == MetricsCacheMiss) ? &self->cache_misses : &self->cache_not_modified;
+    metrics_add(counter, 1);
+}
+
+// Writes HELP and TYPE lines
+void
+metrics_write_header(GString *out, const gchar *name, const gchar *type, const gchar *help) {
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Append @value as a label value, with backslash, quote and newline escaped
+void
+metrics_append_label_value(GString *out, const gchar *value) {
+    for (const gchar *c = value; *c; c++) {
+        if (*c == '\\' || *c == '"') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, *c);
+        } else if (*c == '\n') {
+            g_string_append(out, "\\n");
+        } else {
+            g_string_append_c(out, *c);
+        }
+    }
+}
+
+// Single unlabelled value
+void
+metrics_write_value(GString *out, const gchar *name, const gchar *type, const gchar *help, gdouble value) {
+    metrics_write_header(out, name, type, help);
+    g_string_append_printf(out, "%s %.17g\n", name, value);
+}
+
+static void
+metrics_write_histogram(GString *out, const gchar *name, const gchar *labels, MetricsHistogram *h) {
+    const gchar *sep = (labels[0]) ? "," : "";
+    gsize cumulative = 0;
+    for (guint i = 0; i < G_N_ELEMENTS(metrics_buckets); i++) {
+        cumulative += metrics_get(&h->buckets[i]);
+        g_string_append_printf(out, "%s_bucket{%s%sle=\"%g\"} %" G_GSIZE_FORMAT "\n",
+                               name, labels, sep, metrics_buckets[i], cumulative);
+    }
+    cumulative += metrics_get(&h->buckets[G_N_ELEMENTS(metrics_buckets)]);
+    g_string_append_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GSIZE_FORMAT "\n", name, labels, sep, cumulative);
+    const gchar *lbrace = (labels[0]) ? "{" : "";
+    const gchar *rbrace = (labels[0]) ? "}" : "";
+    g_string_append_printf(out, "%s_sum%s%s%s %.6f\n", name, lbrace, labels, rbrace, metrics_get(&h->sum_us) / 1e6);
+    g_string_append_printf(out, "%s_count%s%s%s %" G_GSIZE_FORMAT "\n", name, lbrace, labels, rbrace,
+                           metrics_get(&h->count));
+}
+
+// Everything counted here. Gauges only the caller knows are added with metrics_write_value()
+void
+metrics_write(Metrics *self, GString *out) {
+    metrics_write_header(out, "imgflo_http_requests_total", "counter", "HTTP requests by endpoint and status class");
+    for (int e=0; e<MetricsEndpoints; e++) {
+        for (int c=0; c<METRICS_STATUS_CLASSES; c++) {
+            g_string_append_printf(out, "imgflo_http_requests_total{endpoint=\"%s\",status=\"%dxx\"} %" G_GSIZE_FORMAT "\n",
+                                   metrics_endpoint_paths[e], c+1, metrics_get(&self->requests[e][c]));
+        }
+    }
+    metrics_write_header(out, "imgflo_http_request_duration_seconds", "histogram",
+                         "Time from request received until response done");
+    for (int e=0; e<MetricsEndpoints; e++) {
+        gchar *labels = g_strdup_printf("endpoint=\"%s\"", metrics_endpoint_paths[e]);
+        metrics_write_histogram(out, "imgflo_http_request_duration_seconds", labels, &self->latency[e]);
+        g_free(labels);
+    }
+
+    metrics_write_value(out, "imgflo_render_tasks_total", "counter", "Render tasks completed",
+                        metrics_get(&self->render_tasks));
+    metrics_write_value(out, "imgflo_render_busy_seconds_total", "counter", "Time render workers spent on tasks",
+                        metrics_get(&self->render_busy_us) / 1e6);
+    metrics_write_value(out, "imgflo_render_active", "gauge", "Render tasks currently running",
+                        g_atomic_int_get(&self->render_active));
+
+    metrics_write_header(out, "imgflo_encode_duration_seconds", "histogram", "Time spent encoding an output image");
+    metrics_write_histogram(out, "imgflo_encode_duration_seconds", "", &self->encode);
+    metrics_write_header(out, "imgflo_encoded_bytes_total", "counter", "Encoded output by image format");
+    for (int f=0; f<ImageFormatInvalid; f++) {
+        g_string_append_printf(out, "imgflo_encoded_bytes_total{format=\"%s\"} %" G_GSIZE_FORMAT "\n",
+                               image_formats[f].name, metrics_get(&self->encoded_bytes[f]));
+    }
+
+    metrics_write_header(out, "imgflo_response_cache_lookups_total", "counter",
+                         "/process and /tile requests by response cache result. Hit ratio is hit+not_modified over all");
+    g_string_append_printf(out, "imgflo_response_cache_lookups_total{result=\"hit\"} %" G_GSIZE_FORMAT "\n",
+                           metrics_get(&self->cache_hits));
+    g_string_append_printf(out, "imgflo_response_cache_lookups_total{result=\"not_modified\"} %" G_GSIZE_FORMAT "\n",
+                           metrics_get(&self->cache_not_modified));
+    g_string_append_printf(out, "imgflo_response_cache_lookups_total{result=\"miss\"} %" G_GSIZE_FORMAT "\n",
+                           metrics_get(&self->cache_misses));
+}
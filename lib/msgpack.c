@@ -0,0 +1,365 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// MessagePack encoding of JSON values, for FBP protocol clients using binary WebSocket frames.
+// Covers the types JSON has: nil, bool, integers, floats, strings, arrays and maps with string keys
+
+#define MSGPACK_MAX_DEPTH 64
+
+static void
+msgpack_put_be(GByteArray *out, guint8 tag, guint64 value, gint bytes) {
+    guint8 buf[9];
+    buf[0] = tag;
+    for (gint i = 0; i < bytes; i++) {
+        buf[1+i] = (guint8)(value >> (8*(bytes-1-i)));
+    }
+    g_byte_array_append(out, buf, 1+bytes);
+}
+
+static void
+msgpack_put_int(GByteArray *out, gint64 value) {
+    if (value >= 0 && value <= 127) {
+        const guint8 fixint = (guint8)value;
+        g_byte_array_append(out, &fixint, 1);
+    } else if (value < 0 && value >= -32) {
+        const guint8 fixint = (guint8)(gint8)value;
+        g_byte_array_append(out, &fixint, 1);
+    } else if (value >= 0) {
+        const guint8 tag = (value <= G_MAXUINT8) ? 0xcc : (value <= G_MAXUINT16) ? 0xcd :
+                           (value <= G_MAXUINT32) ? 0xce : 0xcf;
+        msgpack_put_be(out, tag, (guint64)value, 1 << (tag - 0xcc));
+    } else {
+        const guint8 tag = (value >= G_MININT8) ? 0xd0 : (value >= G_MININT16) ? 0xd1 :
+                           (value >= G_MININT32) ? 0xd2 : 0xd3;
+        msgpack_put_be(out, tag, (guint64)value, 1 << (tag - 0xd0));
+    }
+}
+
+static void
+msgpack_put_double(GByteArray *out, gdouble value) {
+    guint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    msgpack_put_be(out, 0xcb, bits, 8);
+}
+
+static void
+msgpack_put_string(GByteArray *out, const gchar *str) {
+    const gsize len = (str) ? strlen(str) : 0;
+    if (len < 32) {
+        const guint8 fixstr = 0xa0 | (guint8)len;
+        g_byte_array_append(out, &fixstr, 1);
+    } else if (len <= G_MAXUINT8) {
+        msgpack_put_be(out, 0xd9, len, 1);
+    } else if (len <= G_MAXUINT16) {
+        msgpack_put_be(out, 0xda, len, 2);
+    } else {
+        msgpack_put_be(out, 0xdb, len, 4);
+    }
+    g_byte_array_append(out, (const guint8 *)str, len);
+}
+
+// Array and map headers. @fix is the tag of the short form, @tag16 of the 16 bit length one
+static void
+msgpack_put_container(GByteArray *out, guint8 fix, guint8 tag16, guint length) {
+    if (length < 16) {
+        const guint8 header = fix | (guint8)length;
+        g_byte_array_append(out, &header, 1);
+    } else if (length <= G_MAXUINT16) {
+        msgpack_put_be(out, tag16, length, 2);
+    } else {
+        msgpack_put_be(out, tag16+1, length, 4);
+    }
+}
+
+static void
+msgpack_put_node(GByteArray *out, JsonNode *node) {
+    if (!node || JSON_NODE_HOLDS_NULL(node)) {
+        const guint8 nil = 0xc0;
+        g_byte_array_append(out, &nil, 1);
+    } else if (JSON_NODE_HOLDS_OBJECT(node)) {
+        JsonObject *object = json_node_get_object(node);
+        GList *members = json_object_get_members(object);
+        msgpack_put_container(out, 0x80, 0xde, g_list_length(members));
+        for (GList *l = members; l; l = l->next) {
+            const gchar *name = (const gchar *)l->data;
+            msgpack_put_string(out, name);
+            msgpack_put_node(out, json_object_get_member(object, name));
+        }
+        g_list_free(members);
+    } else if (JSON_NODE_HOLDS_ARRAY(node)) {
+        JsonArray *array = json_node_get_array(node);
+        const guint length = json_array_get_length(array);
+        msgpack_put_container(out, 0x90, 0xdc, length);
+        for (guint i = 0; i < length; i++) {
+            msgpack_put_node(out, json_array_get_element(array, i));
+        }
+    } else {
+        const GType type = json_node_get_value_type(node);
+        if (type == G_TYPE_BOOLEAN) {
+            const guint8 b = (json_node_get_boolean(node)) ? 0xc3 : 0xc2;
+            g_byte_array_append(out, &b, 1);
+        } else if (type == G_TYPE_INT64) {
+            msgpack_put_int(out, json_node_get_int(node));
+        } else if (type == G_TYPE_DOUBLE) {
+            msgpack_put_double(out, json_node_get_double(node));
+        } else {
+            msgpack_put_string(out, json_node_get_string(node));
+        }
+    }
+}
+
+GBytes *
+msgpack_encode(JsonNode *node) {
+    GByteArray *out = g_byte_array_sized_new(256);
+    msgpack_put_node(out, node);
+    return g_byte_array_free_to_bytes(out);
+}
+
+// Takes ownership of @root
+GBytes *
+msgpack_encode_object(JsonObject *root) {
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, root);
+    GBytes *bytes = msgpack_encode(node);
+    json_node_free(node);
+    return bytes;
+}
+
+static void
+msgpack_put_bin(GByteArray *out, GBytes *data) {
+    gsize len = 0;
+    const guint8 *bytes = g_bytes_get_data(data, &len);
+    if (len <= G_MAXUINT8) {
+        msgpack_put_be(out, 0xc4, len, 1);
+    } else if (len <= G_MAXUINT16) {
+        msgpack_put_be(out, 0xc5, len, 2);
+    } else {
+        msgpack_put_be(out, 0xc6, len, 4);
+    }
+    g_byte_array_append(out, bytes, len);
+}
+
+// FBP protocol message with @payload, plus member @name holding @data as bin.
+// For binary content like images, which JSON messages can only carry as URLs or base64
+GBytes *
+msgpack_encode_message_with_bin(const gchar *protocol, const gchar *command,
+                                JsonObject *payload, const gchar *name, GBytes *data) {
+    g_return_val_if_fail(payload, NULL);
+    g_return_val_if_fail(data, NULL);
+
+    GByteArray *out = g_byte_array_sized_new(256 + g_bytes_get_size(data));
+    msgpack_put_container(out, 0x80, 0xde, 3);
+    msgpack_put_string(out, "protocol");
+    msgpack_put_string(out, protocol);
+    msgpack_put_string(out, "command");
+    msgpack_put_string(out, command);
+    msgpack_put_string(out, "payload");
+    GList *members = json_object_get_members(payload);
+    msgpack_put_container(out, 0x80, 0xde, g_list_length(members)+1);
+    for (GList *l = members; l; l = l->next) {
+        const gchar *member = (const gchar *)l->data;
+        msgpack_put_string(out, member);
+        msgpack_put_node(out, json_object_get_member(payload, member));
+    }
+    g_list_free(members);
+    msgpack_put_string(out, name);
+    msgpack_put_bin(out, data);
+    return g_byte_array_free_to_bytes(out);
+}
+
+typedef struct _MsgpackReader {
+    const guint8 *data;
+    gsize length;
+    gsize pos;
+} MsgpackReader;
+
+static gboolean
+msgpack_get_be(MsgpackReader *r, gint bytes, guint64 *out) {
+    if (r->length - r->pos < (gsize)bytes) {
+        return FALSE;
+    }
+    guint64 value = 0;
+    for (gint i = 0; i < bytes; i++) {
+        value = (value << 8) | r->data[r->pos++];
+    }
+    *out = value;
+    return TRUE;
+}
+
+static gint64
+msgpack_sign_extend(guint64 value, gint bytes) {
+    const gint shift = 64 - 8*bytes;
+    return ((gint64)(value << shift)) >> shift;
+}
+
+static JsonNode *msgpack_get_node(MsgpackReader *r, gint depth);
+
+static JsonNode *
+msgpack_get_string(MsgpackReader *r, guint64 length) {
+    if (r->length - r->pos < length) {
+        return NULL;
+    }
+    gchar *str = g_strndup((const gchar *)r->data + r->pos, length);
+    r->pos += length;
+    if (!g_utf8_validate(str, -1, NULL)) {
+        g_free(str);
+        return NULL;
+    }
+    JsonNode *node = json_node_new(JSON_NODE_VALUE);
+    json_node_set_string(node, str);
+    g_free(str);
+    return node;
+}
+
+static JsonNode *
+msgpack_get_array(MsgpackReader *r, guint64 length, gint depth) {
+    // Each element is at least one byte
+    if (r->length - r->pos < length) {
+        return NULL;
+    }
+    JsonArray *array = json_array_sized_new(length);
+    for (guint64 i = 0; i < length; i++) {
+        JsonNode *element = msgpack_get_node(r, depth+1);
+        if (!element) {
+            json_array_unref(array);
+            return NULL;
+        }
+        json_array_add_element(array, element);
+    }
+    JsonNode *node = json_node_new(JSON_NODE_ARRAY);
+    json_node_take_array(node, array);
+    return node;
+}
+
+static JsonNode *
+msgpack_get_map(MsgpackReader *r, guint64 length, gint depth) {
+    if (r->length - r->pos < 2*length) {
+        return NULL;
+    }
+    JsonObject *object = json_object_new();
+    for (guint64 i = 0; i < length; i++) {
+        JsonNode *key = msgpack_get_node(r, depth+1);
+        JsonNode *value = (key && JSON_NODE_HOLDS_VALUE(key) &&
+                           json_node_get_value_type(key) == G_TYPE_STRING) ? msgpack_get_node(r, depth+1) : NULL;
+        if (!value) {
+            if (key) {
+                json_node_free(key);
+            }
+            json_object_unref(object);
+            return NULL;
+        }
+        json_object_set_member(object, json_node_get_string(key), value);
+        json_node_free(key);
+    }
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, object);
+    return node;
+}
+
+static JsonNode *
+msgpack_get_node(MsgpackReader *r, gint depth) {
+    if (depth > MSGPACK_MAX_DEPTH || r->pos >= r->length) {
+        return NULL;
+    }
+    const guint8 tag = r->data[r->pos++];
+    guint64 v = 0;
+    JsonNode *node = NULL;
+
+    if (tag <= 0x7f || tag >= 0xe0) {
+        // Positive and negative fixint
+        node = json_node_new(JSON_NODE_VALUE);
+        json_node_set_int(node, (tag <= 0x7f) ? tag : (gint)tag - 256);
+        return node;
+    } else if ((tag & 0xe0) == 0xa0) {
+        return msgpack_get_string(r, tag & 0x1f);
+    } else if ((tag & 0xf0) == 0x90) {
+        return msgpack_get_array(r, tag & 0x0f, depth);
+    } else if ((tag & 0xf0) == 0x80) {
+        return msgpack_get_map(r, tag & 0x0f, depth);
+    }
+
+    switch (tag) {
+    case 0xc0:
+        return json_node_new(JSON_NODE_NULL);
+    case 0xc2:
+    case 0xc3:
+        node = json_node_new(JSON_NODE_VALUE);
+        json_node_set_boolean(node, tag == 0xc3);
+        return node;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+        const gint bytes = 1 << (tag - 0xcc);
+        if (!msgpack_get_be(r, bytes, &v) || v > G_MAXINT64) {
+            return NULL;
+        }
+        node = json_node_new(JSON_NODE_VALUE);
+        json_node_set_int(node, (gint64)v);
+        return node;
+    }
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+        const gint bytes = 1 << (tag - 0xd0);
+        if (!msgpack_get_be(r, bytes, &v)) {
+            return NULL;
+        }
+        node = json_node_new(JSON_NODE_VALUE);
+        json_node_set_int(node, msgpack_sign_extend(v, bytes));
+        return node;
+    }
+    case 0xca: {
+        if (!msgpack_get_be(r, 4, &v)) {
+            return NULL;
+        }
+        const guint32 bits = (guint32)v;
+        gfloat f;
+        memcpy(&f, &bits, sizeof(f));
+        node = json_node_new(JSON_NODE_VALUE);
+        json_node_set_double(node, f);
+        return node;
+    }
+    case 0xcb: {
+        if (!msgpack_get_be(r, 8, &v)) {
+            return NULL;
+        }
+        gdouble d;
+        memcpy(&d, &v, sizeof(d));
+        node = json_node_new(JSON_NODE_VALUE);
+        json_node_set_double(node, d);
+        return node;
+    }
+    case 0xd9: case 0xda: case 0xdb:
+        return (msgpack_get_be(r, 1 << (tag - 0xd9), &v)) ? msgpack_get_string(r, v) : NULL;
+    case 0xdc: case 0xdd:
+        return (msgpack_get_be(r, 2 << (tag - 0xdc), &v)) ? msgpack_get_array(r, v, depth) : NULL;
+    case 0xde: case 0xdf:
+        return (msgpack_get_be(r, 2 << (tag - 0xde), &v)) ? msgpack_get_map(r, v, depth) : NULL;
+    default:
+        // bin, ext and timestamps have no JSON equivalent
+        return NULL;
+    }
+}
+
+// Returns NULL if @data is not a single valid MessagePack value
+JsonNode *
+msgpack_decode(const guint8 *data, gsize length) {
+    g_return_val_if_fail(data || length == 0, NULL);
+
+    MsgpackReader reader = { data, length, 0 };
+    JsonNode *node = msgpack_get_node(&reader, 0);
+    if (node && reader.pos != length) {
+        json_node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+// Re-encodes serialized JSON @text. Returns NULL if @text is not valid JSON
+GBytes *
+msgpack_from_json_text(const gchar *text) {
+    JsonParser *parser = json_parser_new();
+    GBytes *bytes = NULL;
+    if (json_parser_load_from_data(parser, text, -1, NULL)) {
+        bytes = msgpack_encode(json_parser_get_root(parser));
+    }
+    g_object_unref(parser);
+    return bytes;
+}
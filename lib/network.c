@@ -6,6 +6,8 @@ struct _Network;
 void net_node_added(Graph *graph, const gchar *name, GeglNode *node, Processor *proc, gpointer user_data);
 
 
+#define NETWORK_MAX_SNAPSHOTS 4 // idle copies kept for reuse, per network
+
 typedef void (* NetworkProcessorInvalidatedCallback)
     (struct _Network *network, struct _Processor *processor, GeglRectangle rect, gpointer user_data);
 typedef void (* NetworkStateChanged)
@@ -22,6 +24,9 @@ typedef struct _Network {
     gpointer on_state_changed_data;
     NetworkEdgeChanged on_edge_changed; // data along the edge changed
     gpointer on_edge_changed_data;
+    gint refcount;
+    GQueue *snapshots; // of idle Network, see network_snapshot_acquire()
+    guint64 copied_generation; // of the original graph, when this is a snapshot
 } Network;
 
 Network *
@@ -38,6 +43,9 @@ network_new(Graph *graph)
     self->on_state_changed_data = NULL;
     self->on_edge_changed = NULL;
     self->on_edge_changed_data = NULL;
+    self->refcount = 1;
+    self->snapshots = g_queue_new();
+    self->copied_generation = 0;
 
     self->graph->on_node_added = net_node_added;
     self->graph->on_node_added_data = self;
@@ -45,15 +53,69 @@ network_new(Graph *graph)
     return self;
 }
 
+void
+network_unref(Network *self);
+
 void
 network_free(Network *self)
 {
     if (self->graph) {
         graph_free(self->graph);
     }
+    g_queue_free_full(self->snapshots, (GDestroyNotify)network_unref);
     g_free(self);
 }
 
+// For keeping Network alive while it is used from a render worker
+Network *
+network_ref(Network *self) {
+    g_return_val_if_fail(self, NULL);
+    g_atomic_int_inc(&self->refcount);
+    return self;
+}
+
+void
+network_unref(Network *self) {
+    g_return_if_fail(self);
+    if (g_atomic_int_dec_and_test(&self->refcount)) {
+        network_free(self);
+    }
+}
+
+// GEGL graphs are not thread-safe, so the graph of a network is only used from the main thread.
+// Render workers get a private copy of it instead, to be given back with network_snapshot_release()
+Network *
+network_snapshot_acquire(Network *self) {
+    g_return_val_if_fail(self, NULL);
+
+    Network *snapshot = NULL;
+    while ((snapshot = (Network *)g_queue_pop_head(self->snapshots))) {
+        if (snapshot->copied_generation == self->graph->generation) {
+            return snapshot;
+        }
+        network_unref(snapshot); // graph has changed since
+    }
+    snapshot = network_new(graph_copy(self->graph));
+    snapshot->copied_generation = self->graph->generation;
+    return snapshot;
+}
+
+// Snapshots which were not changed and are still current are kept, so the next render
+// can use the results GEGL cached for them. Others are freed
+void
+network_snapshot_release(Network *self, Network *snapshot) {
+    g_return_if_fail(self);
+    g_return_if_fail(snapshot);
+
+    const gboolean current = snapshot->graph->generation == snapshot->copied_generation &&
+        snapshot->copied_generation == self->graph->generation;
+    if (current && g_queue_get_length(self->snapshots) < NETWORK_MAX_SNAPSHOTS) {
+        g_queue_push_head(self->snapshots, snapshot);
+    } else {
+        network_unref(snapshot);
+    }
+}
+
 
 void
 emit_invalidated(Processor *processor, GeglRectangle rect, gpointer user_data) {
@@ -181,9 +243,37 @@ network_send_packet(Network *self, const gchar *port, GValue *data) {
     GParamSpec *paramspec = gegl_node_find_property(target, internal->port);
     g_return_val_if_fail(paramspec, FALSE);
 
+    self->graph->generation++;
     return set_property(target, internal->port, paramspec, data);
 }
 
+// Property exported inport @port sets, or NULL if there is no such port
+GParamSpec *
+network_inport_property(Network *self, const gchar *port) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(port, NULL);
+
+    GraphNodePort *internal = g_hash_table_lookup(self->graph->inports, port);
+    GeglNode *target = (internal) ? g_hash_table_lookup(self->graph->node_map, internal->node) : NULL;
+    return (target) ? gegl_node_find_property(target, internal->port) : NULL;
+}
+
+// Current value of exported inport @port. Returns FALSE if there is no such port,
+// else @value_out must be unset by caller
+gboolean
+network_get_packet(Network *self, const gchar *port, GValue *value_out) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(port, FALSE);
+
+    GraphNodePort *internal = g_hash_table_lookup(self->graph->inports, port);
+    GeglNode *target = (internal) ? g_hash_table_lookup(self->graph->node_map, internal->node) : NULL;
+    if (!target || !gegl_node_find_property(target, internal->port)) {
+        return FALSE;
+    }
+    gegl_node_get_property(target, internal->port, value_out);
+    return TRUE;
+}
+
 GeglRectangle
 network_get_bounding_box(Network *self, const gchar *node_name) {
     GeglNode *node = graph_get_gegl_node(self->graph, node_name);
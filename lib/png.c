@@ -10,6 +10,10 @@
 typedef struct {
   char *buffer;
   size_t size;
+  size_t capacity; // allocated size of buffer
+  png_structp png;
+  png_infop info;
+  int width;
 } PngEncoder;
 
 void
@@ -18,10 +22,14 @@ write_data(png_structp png_ptr, png_bytep data, png_size_t length)
     PngEncoder* p = (PngEncoder *)png_get_io_ptr(png_ptr);
     const size_t new_size = p->size + length;
 
-    if(p->buffer) {
-        p->buffer = g_realloc(p->buffer, new_size);
-    } else {
-        p->buffer = g_malloc(new_size);
+    // libpng writes in small pieces, grow geometrically to keep copying linear
+    if (new_size > p->capacity) {
+        size_t capacity = (p->capacity) ? p->capacity : 16*1024;
+        while (capacity < new_size) {
+            capacity *= 2;
+        }
+        p->buffer = g_realloc(p->buffer, capacity);
+        p->capacity = capacity;
     }
     g_assert(p->buffer);
 
@@ -39,17 +47,88 @@ png_encoder_new(void) {
     PngEncoder *self = g_new(PngEncoder, 1);
     self->buffer = NULL;
     self->size = 0;
+    self->capacity = 0;
+    self->png = NULL;
+    self->info = NULL;
+    self->width = 0;
     return self;
 }
 
 void
 png_encoder_free(PngEncoder *self) {
+    if (self->png) {
+        png_destroy_write_struct(&self->png, &self->info);
+    }
     if (self->buffer) {
         g_free(self->buffer);
     }
     g_free(self);
 }
 
+// Start encoding an RGBA u8 image. Rows are then given with png_encoder_write_rows().
+// Encoded data is appended to self->buffer as it is produced, and may be taken from there in-between
+gboolean
+png_encoder_begin(PngEncoder *self, int width, int height) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(!self->png, FALSE);
+    g_return_val_if_fail(width > 0, FALSE);
+    g_return_val_if_fail(height > 0, FALSE);
+
+    self->width = width;
+    self->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!self->png) {
+        imgflo_critical("[write_png_file] png_create_write_struct failed");
+        return FALSE;
+    }
+
+    self->info = png_create_info_struct(self->png);
+    if (!self->info) {
+        imgflo_critical("[write_png_file] png_create_info_struct failed");
+        return FALSE;
+    }
+
+    if (setjmp(png_jmpbuf(self->png))) {
+        imgflo_critical("[write_png_file] Error during writing header");
+        return FALSE;
+    }
+    png_set_write_fn(self->png, self, write_data, flush_data);
+    png_set_IHDR(self->png, self->info, width, height,
+                 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(self->png, self->info);
+    return TRUE;
+}
+
+gboolean
+png_encoder_write_rows(PngEncoder *self, const gchar *buffer, int rows) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(self->png, FALSE);
+    g_return_val_if_fail(buffer, FALSE);
+
+    if (setjmp(png_jmpbuf(self->png))) {
+        imgflo_critical("[write_png_file] Error during writing bytes");
+        return FALSE;
+    }
+    const size_t bytes_per_row = 1*4*self->width;
+    for (int y = 0; y < rows; y++) {
+        png_write_row(self->png, (png_const_bytep)(buffer + y*bytes_per_row));
+    }
+    return TRUE;
+}
+
+gboolean
+png_encoder_finish(PngEncoder *self) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(self->png, FALSE);
+
+    if (setjmp(png_jmpbuf(self->png))) {
+        imgflo_critical("[write_png_file] Error during end of write");
+        return FALSE;
+    }
+    png_write_end(self->png, NULL);
+    return TRUE;
+}
+
 void
 png_encoder_encode_rgba(PngEncoder *self, int width, int height, gchar *buffer) {
     g_return_if_fail(self);
@@ -57,54 +136,82 @@ png_encoder_encode_rgba(PngEncoder *self, int width, int height, gchar *buffer)
     g_return_if_fail(height > 0);
     g_return_if_fail(buffer);
 
-    png_byte color_type = PNG_COLOR_TYPE_RGBA;
-    png_byte bit_depth = 8;
-
-    png_bytep *row_pointers = (png_bytep *)g_malloc(sizeof(png_bytep) * height);
-    const size_t bytes_per_row = 1*4*width;
-
-    if (buffer) {
-        for(int y = 0; y < height; y++) {
-            const size_t offset = y*bytes_per_row;
-            row_pointers[y] = (png_byte*)(buffer + offset);
-        }
+    if (png_encoder_begin(self, width, height) &&
+        png_encoder_write_rows(self, buffer, height)) {
+        png_encoder_finish(self);
     }
+}
 
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        imgflo_critical("[write_png_file] png_create_write_struct failed");
-
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
-        imgflo_critical("[write_png_file] png_create_info_struct failed");
+typedef struct {
+    const guint8 *data;
+    size_t size;
+    size_t pos;
+} PngReader;
 
-    if (setjmp(png_jmpbuf(png_ptr)))
-        imgflo_critical("[write_png_file] Error during writing bytes");
-    png_set_rows(png_ptr, info_ptr, row_pointers);
+static void
+read_data(png_structp png_ptr, png_bytep out, png_size_t length)
+{
+    PngReader *r = (PngReader *)png_get_io_ptr(png_ptr);
+    if (r->size - r->pos < length) {
+        png_error(png_ptr, "Truncated PNG data");
+    }
+    memcpy(out, r->data + r->pos, length);
+    r->pos += length;
+}
 
-    FILE *fp = NULL;
-    if (fp) {
-        png_init_io(png_ptr, fp);
-    } else {
-        png_set_write_fn(png_ptr, self, write_data, flush_data);
+// Decode PNG @data in memory to RGBA u8. Images larger than @max_pixels are refused.
+// Returns pixels to be freed with g_free(), or NULL on error
+gchar *
+png_decode_rgba(const guint8 *data, size_t size, gint64 max_pixels, int *width_out, int *height_out) {
+    g_return_val_if_fail(data, NULL);
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = (png) ? png_create_info_struct(png) : NULL;
+    if (!info) {
+        imgflo_critical("png_create_read_struct failed");
+        png_destroy_read_struct(&png, NULL, NULL);
+        return NULL;
     }
-    if (setjmp(png_jmpbuf(png_ptr)))
-        imgflo_critical("[write_png_file] Error during init_io");
 
-    /* write header */
-    if (setjmp(png_jmpbuf(png_ptr)))
-        imgflo_critical("[write_png_file] Error during writing header");
-    png_set_IHDR(png_ptr, info_ptr, width, height,
-                 bit_depth, color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png_ptr, info_ptr);
+    PngReader reader = { data, size, 0 };
+    // Assigned after setjmp, so must not be kept in registers
+    gchar * volatile pixels = NULL;
+    png_bytep * volatile rows = NULL;
+    if (setjmp(png_jmpbuf(png))) {
+        imgflo_warning("PNG decoding failed");
+        g_free(pixels);
+        g_free(rows);
+        png_destroy_read_struct(&png, &info, NULL);
+        return NULL;
+    }
+    png_set_read_fn(png, &reader, read_data);
+    png_read_info(png, info);
+    const int width = png_get_image_width(png, info);
+    const int height = png_get_image_height(png, info);
+    if ((gint64)width*height > max_pixels) {
+        png_error(png, "Image too large");
+    }
 
-    if (setjmp(png_jmpbuf(png_ptr)))
-        imgflo_critical("[write_png_file] Error during writing bytes");
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    // Whatever the color type and depth, give 8 bit RGBA
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
 
-    /* end write */
-    if (setjmp(png_jmpbuf(png_ptr)))
-        imgflo_critical("[write_png_file] Error during end of write");
-    png_write_end(png_ptr, NULL);
+    const size_t bytes_per_row = 1*4*width;
+    pixels = g_malloc(bytes_per_row*height);
+    rows = g_new(png_bytep, height);
+    for (int y = 0; y < height; y++) {
+        rows[y] = (png_bytep)(pixels + y*bytes_per_row);
+    }
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+
+    g_free(rows);
+    png_destroy_read_struct(&png, &info, NULL);
+    *width_out = width;
+    *height_out = height;
+    return pixels;
 }
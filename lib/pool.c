@@ -0,0 +1,106 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Pool of large buffers in power-of-two size classes, so pixel buffers are reused
+// between requests instead of allocated and page-faulted every time. Thread-safe
+
+#define BUFFER_POOL_MIN_CLASS 16 // 64 kB
+#define BUFFER_POOL_MAX_CLASS 28 // 256 MB, larger are not pooled
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_CLASS-BUFFER_POOL_MIN_CLASS+1)
+
+typedef struct _BufferPool {
+    GMutex lock;
+    GSList *free[BUFFER_POOL_CLASSES]; // of gchar *, per size class
+    gsize cached; // bytes in free lists
+    gsize max_cached;
+} BufferPool;
+
+// Returns index of smallest class which fits @size, or -1 if too big to pool
+static gint
+buffer_pool_class(gsize size) {
+    for (gint c = BUFFER_POOL_MIN_CLASS; c <= BUFFER_POOL_MAX_CLASS; c++) {
+        if (size <= ((gsize)1 << c)) {
+            return c - BUFFER_POOL_MIN_CLASS;
+        }
+    }
+    return -1;
+}
+
+static gsize
+buffer_pool_class_size(gint klass) {
+    return (gsize)1 << (klass + BUFFER_POOL_MIN_CLASS);
+}
+
+// Keeps at most @max_cached bytes of unused buffers
+BufferPool *
+buffer_pool_new(gsize max_cached) {
+    BufferPool *self = g_new0(BufferPool, 1);
+    g_mutex_init(&self->lock);
+    self->max_cached = max_cached;
+    return self;
+}
+
+void
+buffer_pool_free(BufferPool *self) {
+    for (gint c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        g_slist_free_full(self->free[c], g_free);
+    }
+    g_mutex_clear(&self->lock);
+    g_free(self);
+}
+
+// Returns a buffer of at least @size bytes. Content is undefined.
+// Must be given back with buffer_pool_release() using the same @size
+gchar *
+buffer_pool_acquire(BufferPool *self, gsize size) {
+    g_return_val_if_fail(self, NULL);
+
+    const gint klass = buffer_pool_class(size);
+    if (klass < 0 || buffer_pool_class_size(klass) > self->max_cached) {
+        // Will never be kept, so do not round up
+        return g_malloc(size);
+    }
+    gchar *buffer = NULL;
+    g_mutex_lock(&self->lock);
+    if (self->free[klass]) {
+        buffer = (gchar *)self->free[klass]->data;
+        self->free[klass] = g_slist_delete_link(self->free[klass], self->free[klass]);
+        self->cached -= buffer_pool_class_size(klass);
+    }
+    g_mutex_unlock(&self->lock);
+    return (buffer) ? buffer : g_malloc(buffer_pool_class_size(klass));
+}
+
+void
+buffer_pool_release(BufferPool *self, gchar *buffer, gsize size) {
+    g_return_if_fail(self);
+    if (!buffer) {
+        return;
+    }
+
+    const gint klass = buffer_pool_class(size);
+    gboolean kept = FALSE;
+    if (klass >= 0) {
+        const gsize class_size = buffer_pool_class_size(klass);
+        g_mutex_lock(&self->lock);
+        if (self->cached + class_size <= self->max_cached) {
+            self->free[klass] = g_slist_prepend(self->free[klass], buffer);
+            self->cached += class_size;
+            kept = TRUE;
+        }
+        g_mutex_unlock(&self->lock);
+    }
+    if (!kept) {
+        g_free(buffer);
+    }
+}
+
+// Bytes held in free lists
+gsize
+buffer_pool_cached(BufferPool *self) {
+    g_mutex_lock(&self->lock);
+    const gsize cached = self->cached;
+    g_mutex_unlock(&self->lock);
+    return cached;
+}
@@ -24,12 +24,15 @@ typedef struct _Processor {
     ProcessorStateChanged on_state_changed;
     gpointer on_state_changed_data;
     gint max_size;
+    gint64 busy_us; // time spent in background processing, in total
 } Processor;
 
 static gboolean
 task_monitor(Processor *self);
 
-// TODO: also accept roi (x,y,w,h) and scale
+#define PROCESSOR_MAX_QUEUED 8 // regions waiting to be processed, more are merged
+#define PROCESSOR_MAX_SIZE 2000 // default largest output side. Mainly to avoid DoS, or bugs causing out-of-memory
+
 Processor *
 processor_new(void) {
     Processor *self = g_new(Processor, 1);
@@ -41,12 +44,25 @@ processor_new(void) {
     self->currently_processed_rect = NULL;
     self->on_invalidated = NULL;
     self->on_invalidated_data = NULL;
-    self->max_size = 2000; // Mainly to avoid DoS, or bugs causing out-of-memory
+    self->max_size = PROCESSOR_MAX_SIZE;
+    self->busy_us = 0;
     return self;
 }
 
+void
+processor_set_target(Processor *self, GeglNode *node);
+
 void
 processor_free(Processor *self) {
+    if (self->monitor_id) {
+        g_source_remove(self->monitor_id);
+    }
+    processor_set_target(self, NULL);
+    if (self->processor) {
+        g_object_unref(self->processor);
+    }
+    g_free(self->currently_processed_rect);
+    g_queue_free_full(self->processing_queue, g_free);
     g_free(self);
 }
 
@@ -57,6 +73,13 @@ processor_is_processing(Processor *self) {
     return processing;
 }
 
+// Regions waiting for background processing, not counting the one in progress
+guint
+processor_queue_length(Processor *self) {
+    g_return_val_if_fail(self, 0);
+    return g_queue_get_length(self->processing_queue);
+}
+
 static GeglRectangle
 sanitized_roi(Processor *self, GeglRectangle in) {
     GeglRectangle out = in;
@@ -102,7 +125,18 @@ trigger_processing(Processor *self, GeglRectangle roi)
     // Add the invalidated region to the dirty
     GeglRectangle *rect = g_new(GeglRectangle, 1);
     *rect = sanitized_roi(self, roi);
-    if (rect->width >= 0 && rect->height >= 0) {
+    if (rect->width < 0 || rect->height < 0) {
+        g_free(rect);
+        return;
+    }
+    // Bursts of changes would otherwise queue up without bound. Merging into the
+    // newest pending region processes a superset, which is never wrong
+    GeglRectangle *newest = (GeglRectangle *)g_queue_peek_head(self->processing_queue);
+    if (newest && g_queue_get_length(self->processing_queue) >= PROCESSOR_MAX_QUEUED) {
+        gegl_rectangle_bounding_box(newest, newest, rect);
+        *newest = sanitized_roi(self, *newest);
+        g_free(rect);
+    } else {
         g_queue_push_head(self->processing_queue, rect);
     }
 }
@@ -146,7 +180,9 @@ task_monitor(Processor *self)
         }
     }
 
+    const gint64 start = g_get_monotonic_time();
     gboolean processing_done = !gegl_processor_work(self->processor, NULL);
+    self->busy_us += g_get_monotonic_time() - start;
 
     if (processing_done) {
         // Go to next region
@@ -183,6 +219,7 @@ processor_set_target(Processor *self, GeglNode *node)
         return;
     }
     if (self->node) {
+        g_signal_handlers_disconnect_by_data(self->node, self);
         g_object_unref(self->node);
     }
     if (node) {
@@ -209,44 +246,301 @@ processor_set_target(Processor *self, GeglNode *node)
     }
 }
 
-gchar *
-blit_node_preview(GeglNode *node, const Babl *format, GeglRectangle *out) {
+#define PROCESSOR_UNSET G_MININT
+// Limits for requested regions, so that scaled coordinates cannot overflow
+#define PROCESSOR_MAX_COORDINATE (1<<24)
+#define PROCESSOR_MAX_SCALE 64.0
+
+// Part of a node to render, and at which size. Fields are PROCESSOR_UNSET when not given
+typedef struct _ProcessorRegion {
+    gint x; // in node coordinates
+    gint y;
+    gint width;
+    gint height;
+    gdouble scale;
+    gint max_width; // of output, scale is reduced to fit
+    gint max_height;
+} ProcessorRegion;
+
+void
+processor_region_init(ProcessorRegion *self) {
+    self->x = PROCESSOR_UNSET;
+    self->y = PROCESSOR_UNSET;
+    self->width = PROCESSOR_UNSET;
+    self->height = PROCESSOR_UNSET;
+    self->scale = PROCESSOR_UNSET;
+    self->max_width = PROCESSOR_UNSET;
+    self->max_height = PROCESSOR_UNSET;
+}
+
+// Set @self from requested x, y, width, height, scale, maxwidth and maxheight in @values,
+// PROCESSOR_UNSET for those not given. Returns index of the first value out of range, or -1
+gint
+processor_region_set_values(ProcessorRegion *self, const gdouble *values) {
+    const gdouble min[] = { -PROCESSOR_MAX_COORDINATE, -PROCESSOR_MAX_COORDINATE, 0, 0, 0, 1, 1 };
+    const gdouble max[] = { PROCESSOR_MAX_COORDINATE, PROCESSOR_MAX_COORDINATE,
+                            PROCESSOR_MAX_COORDINATE, PROCESSOR_MAX_COORDINATE,
+                            PROCESSOR_MAX_SCALE, PROCESSOR_MAX_COORDINATE, PROCESSOR_MAX_COORDINATE };
+    for (int i=0; i<G_N_ELEMENTS(min); i++) {
+        // Written so that NaN is out of range too
+        if (values[i] != PROCESSOR_UNSET && !(values[i] >= min[i] && values[i] <= max[i])) {
+            return i;
+        }
+    }
+    if (values[4] == 0.0) {
+        return 4; // scale
+    }
+    processor_region_init(self);
+    self->x = (gint)values[0];
+    self->y = (gint)values[1];
+    self->width = (gint)values[2];
+    self->height = (gint)values[3];
+    self->scale = values[4];
+    self->max_width = (gint)values[5];
+    self->max_height = (gint)values[6];
+    return -1;
+}
+
+gboolean
+processor_region_is_set(const ProcessorRegion *self) {
+    return self->x != PROCESSOR_UNSET || self->y != PROCESSOR_UNSET ||
+        self->width != PROCESSOR_UNSET || self->height != PROCESSOR_UNSET ||
+        self->scale != PROCESSOR_UNSET ||
+        self->max_width != PROCESSOR_UNSET || self->max_height != PROCESSOR_UNSET;
+}
+
+// Upper bound of output pixels for @self, without looking at the graph.
+// Sides not given are assumed to be @max_size. For admission control
+gint64
+processor_region_estimate_pixels(const ProcessorRegion *self, gint max_size) {
+    const gdouble scale = (self->scale != PROCESSOR_UNSET && self->scale > 0.0) ? self->scale : 1.0;
+    gdouble width = (self->width != PROCESSOR_UNSET) ? self->width*scale : max_size;
+    gdouble height = (self->height != PROCESSOR_UNSET) ? self->height*scale : max_size;
+    if (self->max_width > 0) {
+        width = MIN(width, self->max_width);
+    }
+    if (self->max_height > 0) {
+        height = MIN(height, self->max_height);
+    }
+    width = CLAMP(width, 1, max_size);
+    height = CLAMP(height, 1, max_size);
+    return (gint64)width*(gint64)height;
+}
+
+static gint
+floor_int(gdouble v) {
+    const gint i = (gint)v;
+    return (i > v) ? i-1 : i;
+}
+
+static gint
+ceil_int(gdouble v) {
+    const gint i = (gint)v;
+    return (i < v) ? i+1 : i;
+}
+
+// Resolves @self against bounding box @bbox.
+// Returns FALSE if nothing would be rendered, else the rectangle to blit (in scaled coordinates) and the scale
+static gboolean
+processor_region_resolve(const ProcessorRegion *self, GeglRectangle bbox, gint max_size,
+                         GeglRectangle *rect_out, gdouble *scale_out) {
+    GeglRectangle region;
+    region.x = (self->x != PROCESSOR_UNSET) ? self->x : bbox.x;
+    region.y = (self->y != PROCESSOR_UNSET) ? self->y : bbox.y;
+    region.width = (self->width != PROCESSOR_UNSET) ? self->width : bbox.x+bbox.width-region.x;
+    region.height = (self->height != PROCESSOR_UNSET) ? self->height : bbox.y+bbox.height-region.y;
+    if (!gegl_rectangle_intersect(&region, &region, &bbox)) {
+        return FALSE;
+    }
+
+    gdouble scale = (self->scale != PROCESSOR_UNSET && self->scale > 0.0) ? self->scale : 1.0;
+    if (self->max_width > 0 && region.width*scale > self->max_width) {
+        scale = (gdouble)self->max_width/region.width;
+    }
+    if (self->max_height > 0 && region.height*scale > self->max_height) {
+        scale = (gdouble)self->max_height/region.height;
+    }
+    // Larger outputs are scaled down to fit, rather than cut off
+    if (region.width*scale > max_size) {
+        scale = (gdouble)max_size/region.width;
+    }
+    if (region.height*scale > max_size) {
+        scale = (gdouble)max_size/region.height;
+    }
+
+    // Only pixels that will be delivered are computed
+    rect_out->x = floor_int(region.x*scale);
+    rect_out->y = floor_int(region.y*scale);
+    rect_out->width = ceil_int(region.width*scale);
+    rect_out->height = ceil_int(region.height*scale);
+    // Rounding may still give one pixel too many
+    rect_out->width = CLAMP(rect_out->width, 1, max_size);
+    rect_out->height = CLAMP(rect_out->height, 1, max_size);
+    *scale_out = scale;
+    return TRUE;
+}
+
+// Where a node is rendered, and at which scale.
+// Lets large outputs be rendered in horizontal strips with processor_render_rows()
+typedef struct _ProcessorRender {
+    GeglNode *node;
+    GeglRectangle roi; // in scaled coordinates
+    gdouble scale;
+} ProcessorRender;
+
+// Returns FALSE if @region of @node is empty
+gboolean
+node_plan_region(GeglNode *node, const ProcessorRegion *region, gint max_size, ProcessorRender *out) {
+    g_return_val_if_fail(node, FALSE);
+    g_return_val_if_fail(region, FALSE);
+    g_return_val_if_fail(out, FALSE);
+
+    const GeglRectangle bbox = gegl_node_get_bounding_box(node);
+    out->node = node;
+    out->scale = 1.0;
+    return processor_region_resolve(region, bbox, max_size, &out->roi, &out->scale);
+}
+
+// Like node_plan_region(), but without region set the whole output is planned, as in processor_blit()
+gboolean
+processor_plan(Processor *self, const ProcessorRegion *region, ProcessorRender *out) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(self->node, FALSE);
+    g_return_val_if_fail(out, FALSE);
+
+    if (region && processor_region_is_set(region)) {
+        return node_plan_region(self->node, region, self->max_size, out);
+    }
+    out->node = self->node;
+    out->roi = sanitized_roi(self, gegl_node_get_bounding_box(self->node));
+    out->scale = 1.0;
+    return out->roi.width > 0 && out->roi.height > 0;
+}
+
+// Render @rows rows of @plan, starting at @first_row, into @buffer
+void
+processor_render_rows(const ProcessorRender *plan, const Babl *format,
+                      gint first_row, gint rows, gchar *buffer) {
+    g_return_if_fail(plan);
+    g_return_if_fail(buffer);
+    g_return_if_fail(first_row >= 0 && first_row+rows <= plan->roi.height);
+
+    const GeglRectangle strip = { plan->roi.x, plan->roi.y+first_row, plan->roi.width, rows };
+    gegl_node_blit(plan->node, plan->scale, &strip, format, buffer,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_BLIT_DEFAULT);
+}
+
+// Fit bounding box of @node into @width x @height, for thumbnails. Returns FALSE if bbox is unreasonably large
+gboolean
+node_plan_preview(GeglNode *node, gint width, gint height, ProcessorRender *out) {
+    g_return_val_if_fail(node, FALSE);
+    g_return_val_if_fail(out, FALSE);
+
     GeglRectangle bbox = gegl_node_get_bounding_box(node);
     const gint hard_max_size = 10000;
     if (bbox.width < 0 || bbox.width > hard_max_size ||
         bbox.height < 0 || bbox.height > hard_max_size) {
-        return NULL;
+        return FALSE;
     }
-    const gint max_size = 2000; // just scale down
+    const gint max_size = PROCESSOR_MAX_SIZE; // just scale down
     bbox.width = (bbox.width < 0 || bbox.width >= max_size) ? max_size : bbox.width;
     bbox.height = (bbox.height < 0 || bbox.height >= max_size) ? max_size : bbox.height;
 
-    const gdouble scalex = (gdouble)out->width/bbox.width;
-    const gdouble scaley = (gdouble)out->height/bbox.height;
-    const gdouble scale = (scalex < scaley) ? scalex : scaley;
+    const gdouble scalex = (gdouble)width/bbox.width;
+    const gdouble scaley = (gdouble)height/bbox.height;
     // FIXME: set height/width to fit actual content area of buffer
-    gchar *buffer = g_malloc(out->width*out->height*babl_format_get_bytes_per_pixel(format));
+    out->node = node;
+    out->scale = (scalex < scaley) ? scalex : scaley;
+    out->roi.x = 0;
+    out->roi.y = 0;
+    out->roi.width = width;
+    out->roi.height = height;
+    return TRUE;
+}
+
+#define PROCESSOR_TILE_SIZE 256
+#define PROCESSOR_TILE_MAX_LEVEL 30
+
+// Tile @x,@y of pyramid level @z, where level 0 is full resolution and each level halves it.
+// Tiles are PROCESSOR_TILE_SIZE square in scaled coordinates, with tile 0,0 at the origin.
+// Those on the edge are cut to the bounding box. Returns FALSE if tile is outside of it
+gboolean
+node_plan_tile(GeglNode *node, gint z, gint x, gint y, ProcessorRender *out) {
+    g_return_val_if_fail(node, FALSE);
+    g_return_val_if_fail(z >= 0 && z <= PROCESSOR_TILE_MAX_LEVEL, FALSE);
+    g_return_val_if_fail(out, FALSE);
+
+    const GeglRectangle bbox = gegl_node_get_bounding_box(node);
+    const gdouble scale = 1.0 / (1 << z);
+    GeglRectangle scaled;
+    scaled.x = floor_int(bbox.x*scale);
+    scaled.y = floor_int(bbox.y*scale);
+    scaled.width = ceil_int(((gdouble)bbox.x+bbox.width)*scale) - scaled.x;
+    scaled.height = ceil_int(((gdouble)bbox.y+bbox.height)*scale) - scaled.y;
+
+    const GeglRectangle tile = { x*PROCESSOR_TILE_SIZE, y*PROCESSOR_TILE_SIZE,
+                                 PROCESSOR_TILE_SIZE, PROCESSOR_TILE_SIZE };
+    out->node = node;
+    out->scale = scale;
+    return bbox.width > 0 && bbox.height > 0 && gegl_rectangle_intersect(&out->roi, &tile, &scaled);
+}
+
+// Render all of @plan into a newly allocated buffer. Returns NULL if it is empty
+gchar *
+processor_render(const ProcessorRender *plan, const Babl *format) {
+    g_return_val_if_fail(plan, NULL);
+    if (plan->roi.width <= 0 || plan->roi.height <= 0) {
+        return NULL;
+    }
+    gchar *buffer = g_malloc((gsize)plan->roi.width*plan->roi.height*babl_format_get_bytes_per_pixel(format));
     // XXX: maybe use GEGL_BLIT_DIRTY?
-    gegl_node_blit(node, scale, out, format, buffer,
-                   GEGL_AUTO_ROWSTRIDE, GEGL_BLIT_DEFAULT);
+    processor_render_rows(plan, format, 0, plan->roi.height, buffer);
     return buffer;
 }
 
+gchar *
+blit_node_preview(GeglNode *node, const Babl *format, GeglRectangle *out) {
+    ProcessorRender plan;
+    if (!node_plan_preview(node, out->width, out->height, &plan)) {
+        return NULL;
+    }
+    return processor_render(&plan, format);
+}
+
 gchar *
 processor_blit(Processor *self, const Babl *format, GeglRectangle *roi_out) {
     g_return_val_if_fail(self, NULL);
     g_return_val_if_fail(roi_out, NULL);
     g_return_val_if_fail(self->node, NULL);
 
-    GeglRectangle roi = gegl_node_get_bounding_box(self->node);
-    roi = sanitized_roi(self, roi);
-    // FIXME: take region-of-interest as parameter
-    // FIXME: take size as parameter, set scale to give approx that
-    const double scale = 1.0;
-    gchar *buffer = g_malloc(roi.width*roi.height*babl_format_get_bytes_per_pixel(format));
-    // XXX: maybe use GEGL_BLIT_DIRTY?
-    gegl_node_blit(self->node, scale, &roi, format, buffer,
-                   GEGL_AUTO_ROWSTRIDE, GEGL_BLIT_DEFAULT);
-    *roi_out = roi;
-    return buffer;
+    // See processor_blit_region() for rendering part of it, or at another scale
+    ProcessorRender plan;
+    processor_plan(self, NULL, &plan);
+    *roi_out = plan.roi;
+    return processor_render(&plan, format);
+}
+
+// Render @region of @node. Returns NULL if region is empty. Size of buffer is returned in @roi_out
+gchar *
+blit_node_region(GeglNode *node, const Babl *format,
+                 const ProcessorRegion *region, gint max_size, GeglRectangle *roi_out) {
+    g_return_val_if_fail(node, NULL);
+    g_return_val_if_fail(region, NULL);
+    g_return_val_if_fail(roi_out, NULL);
+
+    ProcessorRender plan;
+    if (!node_plan_region(node, region, max_size, &plan)) {
+        return NULL;
+    }
+
+    *roi_out = plan.roi;
+    return processor_render(&plan, format);
+}
+
+gchar *
+processor_blit_region(Processor *self, const Babl *format,
+                      const ProcessorRegion *region, GeglRectangle *roi_out) {
+    g_return_val_if_fail(self, NULL);
+    g_return_val_if_fail(self->node, NULL);
+    return blit_node_region(self->node, format, region, self->max_size, roi_out);
 }
@@ -0,0 +1,154 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+// Graph templates, rendered statelessly with per-request values for their exported inports.
+// The JSON definition is read once. Networks built from it are pooled, and each is used by
+// one request at a time, so requests never see each other's values. Only used from main thread
+
+#define GRAPH_TEMPLATE_OUTPORT "output" // rendered, unless the template has only one outport
+
+typedef struct _GraphTemplate {
+    gchar *name;
+    gchar *id; // of graphs built from template
+    gchar *source; // JSON
+    gsize length;
+    Library *component_lib; // unowned
+    GQueue *idle; // of Network not in use
+    guint instances; // idle or in use
+    guint max_instances;
+} GraphTemplate;
+
+void
+graph_template_free(GraphTemplate *self) {
+    g_free(self->name);
+    g_free(self->id);
+    g_free(self->source);
+    g_queue_free_full(self->idle, (GDestroyNotify)network_unref);
+    g_free(self);
+}
+
+static Network *
+graph_template_instantiate(GraphTemplate *self, GError **error) {
+    Graph *graph = graph_new(self->id, self->component_lib);
+    if (!graph_load_json_data(graph, self->source, self->length, error)) {
+        graph_free(graph);
+        return NULL;
+    }
+    return network_new(graph);
+}
+
+// Exported port rendered for requests, or NULL if template has none
+const GraphNodePort *
+graph_template_output(Network *network) {
+    GHashTable *outports = network->graph->outports;
+    const GraphNodePort *output = g_hash_table_lookup(outports, GRAPH_TEMPLATE_OUTPORT);
+    if (!output && g_hash_table_size(outports) == 1) {
+        GList *ports = g_hash_table_get_values(outports);
+        output = (const GraphNodePort *)ports->data;
+        g_list_free(ports);
+    }
+    return output;
+}
+
+// Loads template from JSON file at @path. Returns NULL with @error set if it is not a valid graph
+// with an output. At most @max_instances networks are created, for as many concurrent requests
+GraphTemplate *
+graph_template_new(const gchar *name, const gchar *path, Library *lib, guint max_instances, GError **error) {
+    g_return_val_if_fail(name, NULL);
+    g_return_val_if_fail(path, NULL);
+    g_return_val_if_fail(lib, NULL);
+
+    GraphTemplate *self = g_new0(GraphTemplate, 1);
+    self->name = g_strdup(name);
+    self->id = g_strconcat("template/", name, NULL);
+    self->component_lib = lib;
+    self->idle = g_queue_new();
+    self->max_instances = MAX(max_instances, 1);
+    if (!g_file_get_contents(path, &self->source, &self->length, error)) {
+        graph_template_free(self);
+        return NULL;
+    }
+
+    // First instance checks that template is usable, and is ready for the first request
+    Network *network = graph_template_instantiate(self, error);
+    if (network && !graph_template_output(network)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Graph template '%s' has no outport", name);
+        network_unref(network);
+        network = NULL;
+    }
+    if (!network) {
+        graph_template_free(self);
+        return NULL;
+    }
+    self->instances = 1;
+    g_queue_push_head(self->idle, network);
+    return self;
+}
+
+// Network for one request, to be given back with graph_template_release().
+// Returns NULL if all instances are in use
+Network *
+graph_template_acquire(GraphTemplate *self) {
+    g_return_val_if_fail(self, NULL);
+
+    Network *network = (Network *)g_queue_pop_head(self->idle);
+    if (network || self->instances >= self->max_instances) {
+        return network;
+    }
+    GError *error = NULL;
+    network = graph_template_instantiate(self, &error);
+    if (!network) {
+        imgflo_warning("Could not instantiate graph template '%s': %s", self->name, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    self->instances++;
+    return network;
+}
+
+// Inports must have been put back to the template values
+void
+graph_template_release(GraphTemplate *self, Network *network) {
+    g_return_if_fail(self);
+    g_return_if_fail(network);
+    g_queue_push_head(self->idle, network);
+}
+
+// Adds graph templates from the .json files in @path to @templates, named by filename.
+// Returns number added
+gint
+graph_template_add_directory(GHashTable *templates, const gchar *path, Library *lib, guint max_instances) {
+    g_return_val_if_fail(templates, 0);
+    g_return_val_if_fail(path, 0);
+
+    GError *err = NULL;
+    GDir *dir = g_dir_open(path, 0, &err);
+    if (!dir) {
+        imgflo_warning("Could not open graph templates: %s", err->message);
+        g_error_free(err);
+        return 0;
+    }
+
+    gint added = 0;
+    const gchar *filename = NULL;
+    while ((filename = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(filename, ".json")) {
+            continue;
+        }
+        gchar *name = g_strndup(filename, strlen(filename)-strlen(".json"));
+        gchar *filepath = g_build_filename(path, filename, NULL);
+        GraphTemplate *template = graph_template_new(name, filepath, lib, max_instances, &err);
+        if (template) {
+            g_hash_table_replace(templates, g_strdup(name), template);
+            added++;
+        } else {
+            imgflo_warning("Skipping graph template %s: %s", filepath, err->message);
+            g_clear_error(&err);
+        }
+        g_free(name);
+        g_free(filepath);
+    }
+    g_dir_close(dir);
+    return added;
+}
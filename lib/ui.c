@@ -15,50 +15,139 @@ typedef struct {
 	SoupServer *server;
     Registry *registry;
     GHashTable *network_map; // graph_id(string) -> Network. Network contains Graph instance
+    GHashTable *templates; // name -> GraphTemplate, for stateless rendering with /graph/<name>
     Library *component_lib;
     gchar *hostname;
-    SoupWebsocketConnection *connection; // TODO: allow multiple clients
+    GList *clients; // of UiClient
+    JsonParser *parser; // reused for incoming messages
+    guint preview_interval; // ms between previews of same node to a client, unless it asked for network:debug
+    gboolean fusion; // fuse point-filter chains in rendered snapshots, see lib/fusion.c
     gchar *main_network;
+    ResponseCache *response_cache; // of /process results, keyed by ETag
+    GHashTable *previews_sent; // "graph\nnode\nsettings" -> guint64 *, generation last pushed
+    BufferPool *buffer_pool; // for rendering
+    GThreadPool *render_pool; // of RenderTask
+    Admission *admission; // of work for render_pool
+    gchar *instance_id; // distinguishes ETags from different runs, as graph generations restart
+    gint results_pending; // atomic, passed from render workers to main loop but not handled yet
+    gboolean closing; // no new render work is taken
+    Metrics *metrics;
+    GPtrArray *packed_catalog; // of GBytes, MessagePack form of the component catalog
+    GPtrArray *packed_catalog_source; // catalog it was made from, referenced so it is not reused
+    LogRing *log_ring; // of messages waiting to be sent to clients
+    gint log_flush_scheduled; // atomic
+    guint log_flush_source; // last one scheduled, may have run already
+    gint64 log_window_start; // for rate limiting
+    guint log_window_lines;
 } UiConnection;
 
-gchar *
-form_response(const gchar *protocol, const gchar *command, JsonObject *payload)
+static const guint UI_PREVIEW_INTERVAL_DEFAULT = 100;
+static const guint UI_LOG_FLUSH_INTERVAL = 50; // ms, log lines are sent in batches
+static const guint UI_LOG_MAX_LINES_PER_SECOND = 50;
+static const gsize UI_RESPONSE_CACHE_SIZE = 64*1024*1024;
+static const gsize UI_STREAM_CACHE_MAX = 8*1024*1024; // streamed outputs larger than this are not cached
+static const gsize UI_BUFFER_POOL_SIZE = 128*1024*1024;
+// Outputs at least this large are rendered in strips and sent with chunked encoding
+static const gint64 UI_STREAM_MIN_PIXELS = 512*512;
+static const gint UI_STREAM_STRIP_ROWS = 64;
+// Admission control defaults. See lib/admission.c
+static const guint UI_ADMISSION_MAX_TASKS = 64;
+static const guint UI_ADMISSION_MAX_GRAPH_TASKS = 16;
+static const gint64 UI_ADMISSION_MAX_PIXELS = 64*1024*1024;
+static const guint UI_RETRY_AFTER = 1; // seconds, for rejected work
+
+// Queue @response for @client in the encoding it uses.
+// Each encoding is only serialized once, on first use, and shared between clients
+static void
+send_encoded(UiClient *client, JsonObject *response, const gchar *key,
+            GBytes **json, GBytes **packed)
 {
-    JsonObject *response = json_object_new();
-
-    json_object_set_string_member(response, "protocol", protocol);
-    json_object_set_string_member(response, "command", command);
-    json_object_set_object_member(response, "payload", payload);
+    if (ui_client_is_binary(client)) {
+        if (!*packed) {
+            *packed = msgpack_encode_object(json_object_ref(response));
+        }
+    } else if (!*json) {
+        gsize len = 0;
+        gchar *text = json_stringify(json_object_ref(response), &len);
+        *json = g_bytes_new_take(text, len+1);
+    }
+    ui_client_send(client, *json, *packed, key);
+}
 
-    gsize len = 0;
-    gchar *data = json_stringify(response, &len);
-    return data;
+static void
+encoded_free(GBytes *json, GBytes *packed)
+{
+    if (json) {
+        g_bytes_unref(json);
+    }
+    if (packed) {
+        g_bytes_unref(packed);
+    }
 }
 
+// Reply to the client on @ws only
 static void
 send_response(SoupWebsocketConnection *ws,
             const gchar *protocol, const gchar *command, JsonObject *payload)
 {
     g_return_if_fail(ws);
 
-    gchar *text = form_response(protocol, command, payload);
-    imgflo_debug ("SEND: %s\n", text);
-    soup_websocket_connection_send_text(ws, text);
-    g_free(text);
+    imgflo_debug("SEND: %s %s\n", protocol, command);
+    UiClient *client = ui_client_from_ws(ws);
+    if (!client) {
+        json_object_unref(payload);
+        return;
+    }
+    JsonObject *response = form_response_object(protocol, command, payload);
+    GBytes *json = NULL;
+    GBytes *packed = NULL;
+    send_encoded(client, response, NULL, &json, &packed);
+    encoded_free(json, packed);
+    json_object_unref(response);
+}
+
+// Pre-serialized JSON @text is queued for every client, re-encoded once for MessagePack clients.
+// With @key set, message is a notification which can be coalesced or dropped for slow clients
+static void
+broadcast_text(UiConnection *self, const gchar *text, const gchar *key)
+{
+    if (!self->clients) {
+        return;
+    }
+    GBytes *json = g_bytes_new(text, strlen(text)+1);
+    GBytes *packed = NULL;
+    for (GList *l = self->clients; l; l = l->next) {
+        UiClient *client = (UiClient *)l->data;
+        if (ui_client_is_binary(client) && !packed) {
+            packed = msgpack_from_json_text(text);
+        }
+        ui_client_send(client, json, packed, key);
+    }
+    encoded_free(json, packed);
 }
 
-// Must not call g_log family functions to avoid recursion
+// Must not call g_log family functions, as it is used for forwarding logs
 static void
-send_response_nodebug(SoupWebsocketConnection *ws,
+broadcast_response(UiConnection *self, const gchar *key,
             const gchar *protocol, const gchar *command, JsonObject *payload)
 {
-    if (ws) {
-        gchar *text = form_response(protocol, command, payload);
-        soup_websocket_connection_send_text(ws, text);
-        g_free(text);
+    if (!self->clients) {
+        json_object_unref(payload);
+        return;
+    }
+    JsonObject *response = form_response_object(protocol, command, payload);
+    GBytes *json = NULL;
+    GBytes *packed = NULL;
+    for (GList *l = self->clients; l; l = l->next) {
+        send_encoded((UiClient *)l->data, response, key, &json, &packed);
     }
+    encoded_free(json, packed);
+    json_object_unref(response);
 }
 
+static void
+ui_push_previews(UiConnection *self, Network *network);
+
 void
 ui_net_state_changed(Network *network, gboolean running,
                      gboolean processing, gpointer user_data) {
@@ -74,8 +163,10 @@ ui_net_state_changed(Network *network, gboolean running,
     json_object_set_boolean_member(info, "running", processing);
 
     const gchar * cmd = (running) ? "started" : "stopped";
-    if (self->connection) {
-        send_response(self->connection, "network", cmd, info);
+    broadcast_response(self, NULL, "network", cmd, info);
+
+    if (running && !processing) {
+        ui_push_previews(self, network);
     }
 }
 
@@ -98,6 +189,10 @@ send_preview_invalidated(Network *network, Processor *processor, GeglRectangle r
     g_return_if_fail(ui->registry->info);
     g_return_if_fail(network->graph);
 
+    if (!ui->clients) {
+        return;
+    }
+
     const gchar *node = graph_find_processor_name(network->graph, processor);
     gchar *url = ui_get_process_url(ui, network, node);
 
@@ -113,16 +208,22 @@ send_preview_invalidated(Network *network, Processor *processor, GeglRectangle r
     json_object_set_string_member(packet, "event", "data"); // TODO: send connect+disconnect also?
     json_object_set_string_member(packet, "payload", url);
 
+    // Clients only need the latest preview of each node
+    gchar *output_key = g_strconcat("network:output ", url, NULL);
+    gchar *packet_key = g_strconcat("runtime:packet ", url, NULL);
+    broadcast_response(ui, output_key, "network", "output", payload);
+    broadcast_response(ui, packet_key, "runtime", "packet", packet);
+    g_free(output_key);
+    g_free(packet_key);
     g_free(url);
-    if (ui->connection) {
-        send_response(ui->connection, "network", "output", payload);
-        send_response(ui->connection, "runtime", "packet", packet);
-    }
 }
 
 void
 send_edge_data_changed(Network *network, const GraphEdge *edge, gpointer user_data) {
     UiConnection *ui = (UiConnection *)user_data;
+    if (!ui->clients) {
+        return;
+    }
 
      // FIXME: remove once noflo-ui no longer needs it
     gchar *src_port = g_utf8_strup(edge->src_port, -1);
@@ -145,9 +246,10 @@ send_edge_data_changed(Network *network, const GraphEdge *edge, gpointer user_da
 
     g_free(url);
 
-    if (ui->connection) {
-        send_response(ui->connection, "network", "data", payload);
-    }
+    gchar *key = g_strconcat("network:data ", network->graph->id, " ", edge_id, NULL);
+    broadcast_response(ui, key, "network", "data", payload);
+    g_free(key);
+    g_free(edge_id);
 }
 
 void
@@ -208,6 +310,45 @@ ui_connection_add_network(UiConnection *self, const gchar *name, Network *networ
     network->on_edge_changed_data = self;
 }
 
+// Forget which previews were pushed for @graph_id, like when it is cleared and generations start over
+static void
+ui_forget_previews(UiConnection *self, const gchar *graph_id) {
+    g_return_if_fail(graph_id);
+
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gchar *prefix = g_strconcat(graph_id, "\n", NULL);
+    g_hash_table_iter_init(&iter, self->previews_sent);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (g_str_has_prefix((const gchar *)key, prefix)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    g_free(prefix);
+}
+
+// Forget previews pushed with settings no connected client has any more
+static void
+ui_prune_previews(UiConnection *self) {
+    GHashTable *settings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (GList *l = self->clients; l; l = l->next) {
+        const UiClientPreviews *previews = ui_client_get_previews((UiClient *)l->data);
+        if (previews) {
+            g_hash_table_add(settings, ui_client_previews_key(previews));
+        }
+    }
+    GHashTableIter iter;
+    gpointer key = NULL;
+    g_hash_table_iter_init(&iter, self->previews_sent);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const gchar *settings_key = strrchr((const gchar *)key, '\n') + 1;
+        if (!g_hash_table_contains(settings, settings_key)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    g_hash_table_destroy(settings);
+}
+
 static void
 handle_graph_message(UiConnection *self, const gchar *command, JsonObject *payload,
                 SoupWebsocketConnection *ws)
@@ -215,11 +356,12 @@ handle_graph_message(UiConnection *self, const gchar *command, JsonObject *paylo
     g_return_if_fail(payload);
 
     Graph *graph = NULL;
+    Network *net = NULL;
     if (g_strcmp0(command, "clear") != 0) {
         // All other commands must have graph
         // TODO: change FBP protocol to use 'graph' instead of 'id'?
         const gchar *graph_id = json_object_get_string_member(payload, "graph");
-        Network *net = (graph_id) ? g_hash_table_lookup(self->network_map, graph_id) : NULL;
+        net = (graph_id) ? g_hash_table_lookup(self->network_map, graph_id) : NULL;
         graph = (net) ? net->graph : NULL;
         g_return_if_fail(graph);
     }
@@ -230,6 +372,7 @@ handle_graph_message(UiConnection *self, const gchar *command, JsonObject *paylo
 
         Network *network = network_new(graph);
         ui_connection_add_network(self, graph_id, network);
+        ui_forget_previews(self, graph_id);
     } else if (g_strcmp0(command, "addnode") == 0) {
         graph_add_node(graph,
             json_object_get_string_member(payload, "id"),
@@ -278,6 +421,16 @@ handle_graph_message(UiConnection *self, const gchar *command, JsonObject *paylo
         );
     } else if (g_strcmp0(command, "changeedge") == 0) {
         // Just metadata, ignored
+    } else if (g_strcmp0(command, "addinport") == 0 || g_strcmp0(command, "addoutport") == 0) {
+        const GraphPortDirection dir = (g_strcmp0(command, "addinport") == 0) ? GraphInPort : GraphOutPort;
+        graph_add_port(graph, dir,
+            json_object_get_string_member(payload, "public"),
+            json_object_get_string_member(payload, "node"),
+            json_object_get_string_member(payload, "port")
+        );
+    } else if (g_strcmp0(command, "removeinport") == 0 || g_strcmp0(command, "removeoutport") == 0) {
+        const GraphPortDirection dir = (g_strcmp0(command, "removeinport") == 0) ? GraphInPort : GraphOutPort;
+        graph_remove_port(graph, dir, json_object_get_string_member(payload, "public"));
     } else {
         imgflo_warning("Unhandled message on protocol 'graph', command='%s'", command);
     }
@@ -307,12 +460,71 @@ handle_network_message(UiConnection *self, const gchar *command, JsonObject *pay
         send_response(ws, "network", "status", info);
 
     } else if (g_strcmp0(command, "debug") == 0) {
-        // Ignored, not implemented
+        // Debugging clients get every preview, others at most one per interval
+        const gboolean enable = json_object_has_member(payload, "enable") &&
+            json_object_get_boolean_member(payload, "enable");
+        UiClient *client = ui_client_from_ws(ws);
+        if (client) {
+            ui_client_set_debounce(client, (enable) ? 0 : self->preview_interval);
+        }
+    } else if (g_strcmp0(command, "previews") == 0) {
+        // Preview images pushed as binary frames, for all graphs. Others keep getting URLs only
+        UiClient *client = ui_client_from_ws(ws);
+        const gboolean enable = json_object_has_member(payload, "enable") &&
+            json_object_get_boolean_member(payload, "enable");
+        UiClientPreviews previews = { ImageFormatPng, -1, PROCESSOR_UNSET, PROCESSOR_UNSET };
+        const gchar *format = json_object_has_member(payload, "format") ?
+            json_object_get_string_member(payload, "format") : NULL;
+        if (format) {
+            previews.format = image_format_from_name(format);
+        }
+        if (json_object_has_member(payload, "quality")) {
+            previews.quality = json_object_get_int_member(payload, "quality");
+        }
+        if (json_object_has_member(payload, "maxwidth")) {
+            previews.max_width = json_object_get_int_member(payload, "maxwidth");
+        }
+        if (json_object_has_member(payload, "maxheight")) {
+            previews.max_height = json_object_get_int_member(payload, "maxheight");
+        }
+        if (enable && previews.format == ImageFormatInvalid) {
+            JsonObject *error = json_object_new();
+            json_object_set_string_member(error, "message", "Unknown preview format");
+            send_response(ws, "network", "error", error);
+        } else if (client) {
+            ui_client_set_previews(client, (enable) ? &previews : NULL);
+            ui_prune_previews(self);
+            if (enable && network->running && !network_is_processing(network)) {
+                // Current previews for the new client. Others with same settings get them again
+                ui_forget_previews(self, graph_id);
+                ui_push_previews(self, network);
+            }
+        }
     } else {
         imgflo_warning("Unhandled message on protocol 'network', command='%s'", command);
     }
 }
 
+// MessagePack form of @catalog. Encoded once per catalog, and shared by all MessagePack clients
+static GPtrArray *
+ui_packed_catalog(UiConnection *self, GPtrArray *catalog) {
+    if (self->packed_catalog_source != catalog) {
+        if (self->packed_catalog) {
+            g_ptr_array_unref(self->packed_catalog);
+            g_ptr_array_unref(self->packed_catalog_source);
+        }
+        self->packed_catalog = g_ptr_array_new_full(catalog->len, (GDestroyNotify)g_bytes_unref);
+        for (int i=0; i<catalog->len; i++) {
+            GBytes *packed = msgpack_from_json_text((const gchar *)g_ptr_array_index(catalog, i));
+            if (packed) {
+                g_ptr_array_add(self->packed_catalog, packed);
+            }
+        }
+        self->packed_catalog_source = g_ptr_array_ref(catalog);
+    }
+    return self->packed_catalog;
+}
+
 static void
 ui_connection_handle_message(UiConnection *self,
                 const gchar *protocol, const gchar *command, JsonObject *payload,
@@ -323,29 +535,44 @@ ui_connection_handle_message(UiConnection *self,
     } else if (g_strcmp0(protocol, "network") == 0) {
         handle_network_message(self, command, payload, ws);
     } else if (g_strcmp0(protocol, "component") == 0 && g_strcmp0(command, "list") == 0) {
-        gint no_components = 0;
-        gchar **operation_names = library_list_components(self->component_lib, &no_components);
-        for (int i=0; i<no_components; i++) {
-            const gchar *op = operation_names[i];
-            if (op) {
-                JsonObject *component = library_get_component(self->component_lib, op);
-                send_response(ws, "component", "component", component);
+        UiClient *client = ui_client_from_ws(ws);
+        GPtrArray *catalog = library_get_catalog(self->component_lib);
+        if (client && ui_client_is_binary(client)) {
+            GPtrArray *packed = ui_packed_catalog(self, catalog);
+            for (int i=0; i<packed->len; i++) {
+                ui_client_send(client, NULL, (GBytes *)g_ptr_array_index(packed, i), NULL);
+            }
+        } else {
+            for (int i=0; i<catalog->len; i++) {
+                ui_client_send_text(client, (const gchar *)g_ptr_array_index(catalog, i));
             }
         }
-        g_strfreev(operation_names);
     } else if (g_strcmp0(protocol, "component") == 0 && g_strcmp0(command, "source") == 0) {
         const gchar *name = json_object_get_string_member(payload, "name");
-        gchar *actual_name = library_set_source(self->component_lib,
-            name,
-            json_object_get_string_member(payload, "code")
-        );
-        if (actual_name) {
-            JsonObject *component = library_get_component(self->component_lib, name);
-            send_response(ws, "component", "component", component);
+        const gchar *language = json_object_get_string_member(payload, "language");
+        const gchar *code = json_object_get_string_member(payload, "code");
+        if (g_strcmp0(language, "json") == 0) {
+            // Graph, to be used as subgraph
+            if (library_set_graph_source(self->component_lib, name, code)) {
+                const gchar *component = library_get_component_message(self->component_lib, name);
+                ui_client_send_text(ui_client_from_ws(ws), component);
+            } else {
+                JsonObject *error = json_object_new();
+                json_object_set_string_member(error, "name", name);
+                json_object_set_string_member(error, "message", "Could not parse graph source");
+                send_response(ws, "component", "error", error);
+            }
         } else {
-            // TODO: error response
+            // Response is sent by ui_compile_progress once the build is done
+            gchar *actual_name = library_set_source(self->component_lib, name, code);
+            if (!actual_name) {
+                JsonObject *error = json_object_new();
+                json_object_set_string_member(error, "name", name);
+                json_object_set_string_member(error, "message", "Could not store component source");
+                send_response(ws, "component", "error", error);
+            }
+            g_free(actual_name);
         }
-        g_free(actual_name);
     } else if (g_strcmp0(protocol, "component") == 0 && g_strcmp0(command, "getsource") == 0) {
         const gchar *name = json_object_get_string_member(payload, "name");
 
@@ -361,10 +588,19 @@ ui_connection_handle_message(UiConnection *self,
             g_assert(n);
             JsonObject *g = graph_save_json(n->graph);
             gsize len = 0;
-            gchar *code = json_stringify(g, &len);
+            gchar *code = json_stringify_pretty(g, &len);
             g_assert(len);
             json_object_set_string_member(source_info, "language", "json");
             json_object_set_string_member(source_info, "code", code);
+            g_free(code);
+        } else if (library_get_graph(self->component_lib, name)) {
+            JsonObject *g = json_object_ref(library_get_graph(self->component_lib, name));
+            gchar *code = json_stringify_pretty(g, NULL);
+            json_object_set_string_member(source_info, "name", name);
+            json_object_set_string_member(source_info, "library", "imgflo");
+            json_object_set_string_member(source_info, "language", "json");
+            json_object_set_string_member(source_info, "code", code);
+            g_free(code);
         } else {
             json_object_set_string_member(source_info, "name", name);
             gchar *code = library_get_source(self->component_lib, name);
@@ -409,10 +645,19 @@ ui_connection_handle_message(UiConnection *self,
         g_free(graph_id);
         g_return_if_fail(network);
 
-        if (g_strcmp0(event, "data") == 0) {
+        if (g_strcmp0(event, "data") == 0 && admission_graph_busy(self->admission, network->graph->id)) {
+            // Sender should retry, like on 503 from /process
+            JsonObject *error = json_object_new();
+            json_object_set_string_member(error, "message", "busy");
+            json_object_set_string_member(error, "graph", network->graph->id);
+            json_object_set_string_member(error, "port", port);
+            json_object_set_int_member(error, "retryAfter", UI_RETRY_AFTER*1000);
+            send_response(ws, "runtime", "error", error);
+        } else if (g_strcmp0(event, "data") == 0) {
             GValue data = G_VALUE_INIT;
             json_node_get_value(json_object_get_member(payload, "payload"), &data);
             network_send_packet(network, port, &data);
+            g_value_unset(&data);
         } else {
             // TODO: support connect/disconnect?
             imgflo_warning("Unknown runtime:packet event: %s", event);
@@ -448,7 +693,9 @@ on_web_socket_open(SoupWebsocketConnection *ws, gpointer user_data)
     UiConnection *self = (UiConnection *)user_data;
     g_assert(self);
     ensure_hostname_set(self, uri);
-    self->connection = g_object_ref(ws);
+    UiClient *client = ui_client_new(ws);
+    ui_client_set_debounce(client, self->preview_interval);
+    self->clients = g_list_prepend(self->clients, client);
 
 	g_free(url);
 }
@@ -459,40 +706,55 @@ on_web_socket_message(SoupWebsocketConnection *ws,
                       GBytes *message,
                       void *user_data)
 {
+    UiConnection *ui = (UiConnection *)user_data;
 	const gchar *data;
 	gsize len;
 
 	data = g_bytes_get_data (message, &len);
-	imgflo_debug("RECV: %.*s\n", (int)len, data);
 
-    JsonParser *parser = json_parser_new();
-    gboolean success = json_parser_load_from_data(parser, data, len, NULL);
-    if (success) {
-        JsonNode *r = json_parser_get_root(parser);
-        g_assert(JSON_NODE_HOLDS_OBJECT(r));
-        JsonObject *root = json_node_get_object(r);
+    JsonNode *decoded = NULL;
+    JsonNode *r = NULL;
+    if (type == SOUP_WEBSOCKET_DATA_BINARY) {
+        imgflo_debug("RECV: %" G_GSIZE_FORMAT " bytes MessagePack\n", len);
+        decoded = msgpack_decode((const guint8 *)data, len);
+        r = decoded;
+        UiClient *client = ui_client_from_ws(ws);
+        if (r && client) {
+            ui_client_set_binary(client);
+        }
+    } else {
+        imgflo_debug("RECV: %.*s\n", (int)len, data);
+        if (json_parser_load_from_data(ui->parser, data, len, NULL)) {
+            r = json_parser_get_root(ui->parser);
+        }
+    }
+
+    if (r && JSON_NODE_HOLDS_OBJECT(r)) {
+        // Parser is reused by next message, keep our own reference
+        JsonObject *root = json_object_ref(json_node_get_object(r));
 
         const gchar *protocol = json_object_get_string_member(root, "protocol");
         const gchar *command = json_object_get_string_member(root, "command");
 
         JsonNode *pnode = json_object_get_member(root, "payload");
-        JsonObject *payload = JSON_NODE_HOLDS_OBJECT(pnode) ? json_object_get_object_member(root, "payload") : NULL;
+        JsonObject *payload = (pnode && JSON_NODE_HOLDS_OBJECT(pnode)) ? json_object_get_object_member(root, "payload") : NULL;
 
-        UiConnection *ui = (UiConnection *)user_data;
         ui_connection_handle_message(ui, protocol, command, payload, ws);
-
+        json_object_unref(root);
     } else {
-        imgflo_warning("Unable to parse WebSocket message as JSON");
+        imgflo_warning("Unable to parse WebSocket message as %s object",
+                       (type == SOUP_WEBSOCKET_DATA_BINARY) ? "MessagePack" : "JSON");
     }
 
-    g_object_unref(parser);
+    if (decoded) {
+        json_node_free(decoded);
+    }
 }
 
 static void
 on_web_socket_error(SoupWebsocketConnection *ws, GError *error, gpointer user_data)
 {
-    UiConnection *ui = (UiConnection *)user_data;
-    ui->connection = NULL;
+    // Followed by 'closed', which removes the client
     imgflo_critical("WebSocket: error: %s\n", error->message);
 }
 
@@ -500,7 +762,12 @@ static void
 on_web_socket_close(SoupWebsocketConnection *ws, gpointer user_data)
 {
     UiConnection *ui = (UiConnection *)user_data;
-    ui->connection = NULL;
+    UiClient *client = ui_client_from_ws(ws);
+    if (client) {
+        ui->clients = g_list_remove(ui->clients, client);
+        ui_client_close(client);
+        ui_prune_previews(ui);
+    }
 
 	gushort code = soup_websocket_connection_get_close_code(ws);
 	if (code != 0) {
@@ -524,220 +791,1820 @@ void websocket_callback(SoupServer *server,
     on_web_socket_open(connection, user_data);
 }
 
-static void
-process_image_callback (SoupServer *server, SoupMessage *msg,
-		 const char *path, GHashTable *query,
-		 SoupClientContext *context, gpointer user_data) {
-
-    UiConnection *self = (UiConnection *)user_data;
-
-    // Lookup network
-    Network *network = NULL;
-    {
-        const gchar *graph_id = g_hash_table_lookup(query, "graph");
-        network = (graph_id) ? g_hash_table_lookup(self->network_map, graph_id) : NULL;
+// Leaves @out untouched if @key is not in @query. Returns FALSE if value is not a number
+static gboolean
+query_get_number(GHashTable *query, const gchar *key, gdouble *out) {
+    const gchar *str = (query) ? g_hash_table_lookup(query, key) : NULL;
+    if (!str) {
+        return TRUE;
     }
-    if (!network) {
-        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "'graph' not specified or wrong");
-        return;
+    gchar *end = NULL;
+    const gdouble value = g_ascii_strtod(str, &end);
+    if (end == str || *end != '\0') {
+        return FALSE;
     }
+    *out = value;
+    return TRUE;
+}
 
-    // Lookup node
-    GeglNode * node = NULL;
-    Processor *processor = NULL;
-    {
-        const gchar *node_id = g_hash_table_lookup(query, "node");
-        processor = (node_id) ? network_processor(network, node_id) : NULL;
-        if (processor) {
-            node = processor->node;
-        } else {
-            node = graph_get_gegl_node(network->graph, node_id);
+// Parse x,y,width,height,scale,maxwidth,maxheight into @region
+static gboolean
+query_get_region(GHashTable *query, ProcessorRegion *region, const gchar **invalid_out) {
+    const gchar *keys[] = { "x", "y", "width", "height", "scale", "maxwidth", "maxheight" };
+    gdouble values[G_N_ELEMENTS(keys)];
+    for (int i=0; i<G_N_ELEMENTS(keys); i++) {
+        values[i] = PROCESSOR_UNSET;
+        if (!query_get_number(query, keys[i], &values[i])) {
+            *invalid_out = keys[i];
+            return FALSE;
         }
-
     }
-    if (!processor && !node) {
-        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "'node' not specified or wrong");
-        return;
+    const gint out_of_range = processor_region_set_values(region, values);
+    if (out_of_range >= 0) {
+        *invalid_out = keys[out_of_range];
+        return FALSE;
     }
+    return TRUE;
+}
 
-    // Render output
-    // FIXME: allow region-of-interest and scale as query params
-
-    const Babl *format = babl_format("R'G'B'A u8");
-    GeglRectangle roi = { 0, 0, 300, 300 };
-    gchar *rgba = (processor) ?
-                processor_blit(processor, format, &roi) :
-                blit_node_preview(node, format, &roi);
-    if (!rgba) {
-        soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
-        return;
+// Identifies the output of @path for the given query and uploaded image, at current graph generation
+static gchar *
+process_etag(UiConnection *self, const gchar *path, Network *network, GHashTable *query,
+             ImageFormat format, gint quality, GBytes *upload) {
+    GString *str = g_string_new(NULL);
+    g_string_append_printf(str, "%s\n%s\n%s\n%" G_GUINT64_FORMAT "\n%s\n%d\n",
+                           self->instance_id, path, network->graph->id, network->graph->generation,
+                           image_format_mimetype(format), quality);
+    GList *keys = g_list_sort(g_hash_table_get_keys(query), (GCompareFunc)g_strcmp0);
+    for (GList *l = keys; l; l = l->next) {
+        const gchar *key = (const gchar *)l->data;
+        g_string_append_printf(str, "%s=%s\n", key, (const gchar *)g_hash_table_lookup(query, key));
     }
-    if (!(roi.width > 0 && roi.height > 0)) {
-        soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
-        g_free(rgba);
-        return;
+    g_list_free(keys);
+    if (upload) {
+        gchar *upload_checksum = g_compute_checksum_for_bytes(G_CHECKSUM_SHA1, upload);
+        g_string_append_printf(str, "upload=%s\n", upload_checksum);
+        g_free(upload_checksum);
     }
 
-    // Compress to PNG
-    {
-        PngEncoder *encoder = png_encoder_new();
-        png_encoder_encode_rgba(encoder, roi.width, roi.height, rgba);
-        char *png = encoder->buffer;
-        const size_t len = encoder->size;
-        soup_message_set_status(msg, SOUP_STATUS_OK);
-        soup_message_set_response(msg, "image/png", SOUP_MEMORY_COPY, png, len);
-        png_encoder_free(encoder);
+    gchar *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, str->str, str->len);
+    gchar *etag = g_strdup_printf("\"%.24s\"", checksum);
+    g_free(checksum);
+    g_string_free(str, TRUE);
+    return etag;
+}
+
+static gboolean
+etag_matches(const gchar *if_none_match, const gchar *etag) {
+    if (!if_none_match) {
+        return FALSE;
     }
+    gchar *value = g_strstrip(g_strdup(if_none_match));
+    const gboolean matches = g_strcmp0(value, "*") == 0 || strstr(value, etag) != NULL;
+    g_free(value);
+    return matches;
 }
 
 static void
-serve_frontpage(SoupServer *server, SoupMessage *msg,
-		 const char *path, GHashTable *query,
-		 SoupClientContext *context, gpointer user_data) {
+set_cached_response(SoupMessage *msg, const gchar *etag, const gchar *content_type, GBytes *body) {
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+    soup_message_headers_set_content_type(msg->response_headers, content_type, NULL);
+    soup_message_headers_replace(msg->response_headers, "ETag", etag);
+    soup_message_headers_replace(msg->response_headers, "Cache-Control", "no-cache");
+    soup_message_headers_replace(msg->response_headers, "Vary", "Accept");
+    soup_message_body_append_bytes(msg->response_body, body);
+}
 
-    static const gchar *html = \
-        "\n<a id=\"flowhub_url\">Open in Flowhub</a>"
-        "\n<script>"
-        "\n   var addr = window.location.origin.replace(\"http://\", \"ws://\");"
-        "\n   addr = addr.replace(\"https://\", \"ws://\");"
-        "\n   var ide = \"http://app.flowhub.io\";"
-        "\n   var url = ide+\"/#runtime/endpoint?protocol=websocket&address=\"+encodeURIComponent(addr);"
-        "\n   var a = document.getElementById(\"flowhub_url\");"
-        "\n   a.href = url;"
-        "\n</script>"
-        ;
-    //gchar *html = g_strdup_printf(html_template, flowhub_url, "Open in Flowhub");
+// Work for the render threads
+typedef void (* RenderTaskFunc) (gpointer data);
 
-    const gsize len = strlen(html);
-    soup_message_set_status(msg, SOUP_STATUS_OK);
-    soup_message_set_response(msg, "text/html", SOUP_MEMORY_COPY, html, len);
-    //g_free(html);
+typedef struct _RenderTask {
+    RenderTaskFunc run;
+    gpointer data;
+    gchar *graph_id; // admitted for
+    gint64 pixels;
+} RenderTask;
+
+static void
+render_task_run(gpointer data, gpointer user_data) {
+    UiConnection *self = (UiConnection *)user_data;
+    RenderTask *task = (RenderTask *)data;
+    const gint64 start = g_get_monotonic_time();
+    metrics_render_started(self->metrics);
+    task->run(task->data);
+    metrics_render_done(self->metrics, g_get_monotonic_time() - start);
+    admission_release(self->admission, task->graph_id, task->pixels);
+    g_free(task->graph_id);
+    g_free(task);
 }
 
+// Result of a render task, handled on the main thread
+typedef struct _RenderResult {
+    UiConnection *ui;
+    GSourceFunc func;
+    gpointer data;
+} RenderResult;
+
 static gboolean
-msg_is_upgrade(SoupMessage *msg) {
-    const char *name, *value;
-    SoupMessageHeadersIter iter;
-    soup_message_headers_iter_init(&iter, msg->request_headers);
-    while (soup_message_headers_iter_next(&iter, &name, &value)) {
-        if (g_strcmp0(name, "Connection") == 0 && g_strcmp0(value, "Upgrade") == 0) {
-            return TRUE;
-        }
-    }
+render_result_dispatch(gpointer user_data) {
+    RenderResult *result = (RenderResult *)user_data;
+    result->func(result->data);
+    g_atomic_int_add(&result->ui->results_pending, -1);
+    g_free(result);
     return FALSE;
 }
 
+// Call @func with @data on the main thread. Counted, so ui_connection_free() can wait for them
 static void
-server_callback (SoupServer *server, SoupMessage *msg,
-		 const char *path, GHashTable *query,
-		 SoupClientContext *context, gpointer data)
-{
-    UiConnection *self = (UiConnection *)data;
+ui_render_result(UiConnection *self, GSourceFunc func, gpointer data) {
+    RenderResult *result = g_new(RenderResult, 1);
+    result->ui = self;
+    result->func = func;
+    result->data = data;
+    g_atomic_int_inc(&self->results_pending);
+    g_main_context_invoke(NULL, render_result_dispatch, result);
+}
 
-    imgflo_debug("%s %s HTTP/1.%d\n", msg->method, path,
-         soup_message_get_http_version(msg));
-    ensure_hostname_set(self, soup_message_get_uri(msg));
+// Task must have been admitted with admission_acquire() for @graph_id and @pixels,
+// which is given back once it has run
+static void
+ui_render_async(UiConnection *self, const gchar *graph_id, gint64 pixels, RenderTaskFunc run, gpointer data) {
+    RenderTask *task = g_new(RenderTask, 1);
+    task->run = run;
+    task->data = data;
+    task->graph_id = g_strdup(graph_id);
+    task->pixels = pixels;
+    g_thread_pool_push(self->render_pool, task, NULL);
+}
 
-    if (msg->method == SOUP_METHOD_GET && g_strcmp0(path, "/process") == 0) {
-        process_image_callback(server, msg, path, query, context, self);
-    } else if (msg_is_upgrade(msg)) {
-        // fall-through, let libsoup WebSocket handle this
-    } else if (msg->method == SOUP_METHOD_GET && g_strcmp0(path, "/") == 0) {
-        serve_frontpage(server, msg, path, query, context, self);
-    } else {
-        imgflo_warning("Unknown HTTP request: %s, %s", msg->method, path);
-        SoupMessageHeadersIter iter;
-        const char *name, *value;
-        soup_message_headers_iter_init(&iter, msg->request_headers);
-        while (soup_message_headers_iter_next(&iter, &name, &value))
-            imgflo_debug("%s: %s\n", name, value);
-        if (msg->request_body->length)
-            imgflo_debug("%s\n", msg->request_body->data);
-        soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+// Snapshot of @network for rendering. Snapshots are never edited, so point-filter chains in them can be fused.
+// Chains still being built are fused when a later render gets the same, pooled, snapshot
+static Network *
+ui_snapshot_acquire(UiConnection *self, Network *network) {
+    Network *snapshot = network_snapshot_acquire(network);
+    if (self->fusion) {
+        graph_fuse_point_filters(snapshot->graph, FALSE);
     }
+    return snapshot;
 }
 
-void
-ui_log_handler(const gchar *log_domain, GLogLevelFlags log_level,
-                const gchar *message, gpointer user_data) {
-    UiConnection *ui = (UiConnection *)user_data;
-    g_assert(ui);
+// Reply to HTTP request which was not admitted, telling client when to try again
+static void
+set_admission_rejected(SoupMessage *msg, AdmissionResult result) {
+    gchar *retry_after = g_strdup_printf("%u", UI_RETRY_AFTER);
+    soup_message_set_status_full(msg, SOUP_STATUS_SERVICE_UNAVAILABLE, admission_result_reason(result));
+    soup_message_headers_replace(msg->response_headers, "Retry-After", retry_after);
+    g_free(retry_after);
+}
 
-    // note, this does not catch errors like
-    // g_return_if_fail, as that goes right to g_critical
-    // same with unexpected failures inside GEGL and libsoup
-    if (ui->connection) {
-        const gboolean is_error = (log_level&G_LOG_LEVEL_CRITICAL) || (log_level&G_LOG_LEVEL_WARNING);
-        const gboolean is_debug = (log_level&G_LOG_LEVEL_DEBUG) == G_LOG_LEVEL_DEBUG;
-        const gchar *cmd = (is_error) ? "error" : "output";
-        JsonObject *msg = json_object_new();
-        json_object_set_string_member(msg, "message", message);
-        if (!is_debug) { // TODO: make configureable?
-            send_response_nodebug(ui->connection, "network", cmd, msg);
-        }
+// Most output pixels render_plan() can give for the request, to admit it by cost.
+// Does not look at the graph, so it is cheap enough to do for every request
+static gint64
+render_estimate_pixels(Network *network, const gchar *node_id, const ProcessorRegion *region) {
+    Processor *processor = network_processor(network, node_id);
+    if (!processor && !processor_region_is_set(region)) {
+        return 300*300; // preview
     }
+    return processor_region_estimate_pixels(region, (processor) ? processor->max_size : PROCESSOR_MAX_SIZE);
 }
 
-void
-setup_log_handlers(UiConnection *ui) {
-    imgflo_log_set_handler("imgflo", G_LOG_FLAG_RECURSION, ui_log_handler, ui);
-}
+// What to render for a request. Returns FALSE if node is gone or output empty.
+// Used by render workers, so @network must be a snapshot
+static gboolean
+render_plan(Network *network, const gchar *node_id, const ProcessorRegion *region, ProcessorRender *plan) {
+    // Node may have been removed since request was accepted
+    Processor *processor = network_processor(network, node_id);
+    GeglNode *node = (processor) ? processor->node : graph_get_gegl_node(network->graph, node_id);
+    if (!processor && !node) {
+        return FALSE;
+    }
 
-gboolean
-ui_connection_try_register(UiConnection *self) {
-    if (self->registry->info->user_id) {
-        gboolean success = registry_register(self->registry);
-        if (success) {
-            registry_start_pinging(self->registry);
-        }
-        return success;
+    // Without region parameters, whole node or a 300x300 preview
+    if (processor) {
+        return processor_plan(processor, region, plan);
+    } else if (processor_region_is_set(region)) {
+        return node_plan_region(node, region, PROCESSOR_MAX_SIZE, plan);
+    } else {
+        return node_plan_preview(node, 300, 300, plan);
     }
-    return FALSE;
 }
 
-UiConnection *
-ui_connection_new(const gchar *hostname, int internal_port, int external_port) {
-    UiConnection *self = g_new(UiConnection, 1);
+// Render whole @plan into a pooled buffer, to be given back with buffer_pool_release().
+// Returns NULL if output is empty
+static gchar *
+render_pixels(UiConnection *self, const ProcessorRender *plan, const Babl *format, gsize *size_out) {
+    *size_out = 0;
+    if (plan->roi.width <= 0 || plan->roi.height <= 0) {
+        return NULL;
+    }
+    // Pixel buffers come from a pool, as they are large and needed for every request
+    *size_out = (gsize)plan->roi.width*plan->roi.height*babl_format_get_bytes_per_pixel(format);
+    gchar *rgba = buffer_pool_acquire(self->buffer_pool, *size_out);
+    processor_render_rows(plan, format, 0, plan->roi.height, rgba);
+    return rgba;
+}
 
-    self->connection = NULL;
-    self->main_network = NULL;
-    self->network_map = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                              g_free, (GDestroyNotify)network_free);
-    self->hostname = g_strdup(hostname);
-    self->registry = registry_new(runtime_info_new_from_env(hostname, external_port));
-    self->component_lib = library_new();
+// Returns NULL if encoding failed
+static GBytes *
+render_encode(UiConnection *self, ImageFormat format, gint quality, gint width, gint height, gchar *rgba,
+              const gchar **content_type_out) {
+    GBytes *body = NULL;
+    const gint64 start = g_get_monotonic_time();
+    ImageEncoder *encoder = image_encoder_new(format, quality);
+    if (image_encoder_encode_rgba(encoder, width, height, rgba)) {
+        metrics_encoded(self->metrics, format, encoder->size, g_get_monotonic_time() - start);
+        body = g_bytes_new_take(encoder->buffer, encoder->size);
+        *content_type_out = image_encoder_mimetype(encoder);
+        encoder->buffer = NULL;
+    }
+    image_encoder_free(encoder);
+    return body;
+}
 
-    setup_log_handlers(self);
+// Preview image of a node pushed to clients over WebSocket, rendered once for all clients with
+// the same settings. Frame is "IMGP", big-endian length of a JSON header, the header, then the image.
+// MessagePack clients get a network:preview message instead, with the header as payload and the image as bin
+typedef struct _PreviewTask {
+    UiConnection *ui;
+    Network *network; // reference held by task
+    Network *snapshot; // rendered by worker
+    gchar *node_id;
+    guint64 generation; // graph was at when processing finished
+    UiClientPreviews settings;
+    gchar *settings_key;
+    // Results
+    JsonObject *header;
+    GBytes *frame;
+    GBytes *packed; // made on main thread, once a MessagePack client wants it
+    gchar *etag; // of the same output from /process, or NULL
+    const gchar *content_type;
+    GBytes *image;
+} PreviewTask;
 
-    self->server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "imgflo-runtime", NULL);
-    if (!self->server) {
-        g_free(self);
-        return NULL;
+static void
+preview_task_free(PreviewTask *task) {
+    network_snapshot_release(task->network, task->snapshot);
+    network_unref(task->network);
+    g_free(task->node_id);
+    g_free(task->settings_key);
+    if (task->header) {
+        json_object_unref(task->header);
     }
+    if (task->frame) {
+        g_bytes_unref(task->frame);
+    }
+    if (task->packed) {
+        g_bytes_unref(task->packed);
+    }
+    g_free(task->etag);
+    if (task->image) {
+        g_bytes_unref(task->image);
+    }
+    g_free(task);
+}
 
-    soup_server_add_handler(self->server, NULL,
-        server_callback, self, NULL);
+// What /process renders for a node without parameters is the same as default preview settings
+static gboolean
+preview_settings_are_default(const UiClientPreviews *settings) {
+    return settings->format == ImageFormatPng && settings->quality < 0 &&
+        settings->max_width == PROCESSOR_UNSET && settings->max_height == PROCESSOR_UNSET;
+}
 
-    soup_server_add_websocket_handler(self->server, NULL, NULL, NULL,
-        websocket_callback, self, NULL);
+static JsonObject *
+preview_header_new(PreviewTask *task, gint width, gint height) {
+    JsonObject *header = json_object_new();
+    json_object_set_string_member(header, "graph", task->snapshot->graph->id);
+    json_object_set_string_member(header, "node", task->node_id);
+    json_object_set_int_member(header, "generation", task->generation);
+    json_object_set_string_member(header, "type", task->content_type);
+    json_object_set_int_member(header, "width", width);
+    json_object_set_int_member(header, "height", height);
+    return header;
+}
 
-    soup_server_listen_all(self->server, internal_port, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL);
+static GBytes *
+preview_frame_new(PreviewTask *task) {
+    gsize header_size = 0;
+    gchar *text = json_stringify(json_object_ref(task->header), &header_size);
+
+    gsize image_size = 0;
+    gconstpointer image = g_bytes_get_data(task->image, &image_size);
+    const guint32 length = GUINT32_TO_BE((guint32)header_size);
+    GByteArray *frame = g_byte_array_sized_new(8 + header_size + image_size);
+    g_byte_array_append(frame, (const guint8 *)"IMGP", 4);
+    g_byte_array_append(frame, (const guint8 *)&length, 4);
+    g_byte_array_append(frame, (const guint8 *)text, header_size);
+    g_byte_array_append(frame, (const guint8 *)image, image_size);
+    g_free(text);
+    return g_byte_array_free_to_bytes(frame);
+}
 
-    return self;
+// Preview as network:preview message. A raw frame could not be told apart from MessagePack replies
+static GBytes *
+preview_task_packed(PreviewTask *task) {
+    if (!task->packed) {
+        task->packed = msgpack_encode_message_with_bin("network", "preview", task->header, "image", task->image);
+    }
+    return task->packed;
 }
 
-gchar *
-ui_connection_get_liveurl(UiConnection *self, gchar *ide) {
-    return runtime_info_liveurl(self->registry->info, ide);
+// Runs on main thread when worker is done
+static gboolean
+preview_task_finish(gpointer user_data) {
+    PreviewTask *task = (PreviewTask *)user_data;
+    UiConnection *self = task->ui;
+    if (task->frame) {
+        gchar *key = g_strconcat("preview ", task->network->graph->id, " ", task->node_id, NULL);
+        for (GList *l = self->clients; l; l = l->next) {
+            UiClient *client = (UiClient *)l->data;
+            const UiClientPreviews *previews = ui_client_get_previews(client);
+            gchar *settings_key = (previews) ? ui_client_previews_key(previews) : NULL;
+            if (g_strcmp0(settings_key, task->settings_key) == 0) {
+                ui_client_send_frame(client, (ui_client_is_binary(client)) ? preview_task_packed(task) : task->frame, key);
+            }
+            g_free(settings_key);
+        }
+        g_free(key);
+    }
+    if (task->etag) {
+        // Clients following the preview URL instead get it without another render
+        response_cache_insert(self->response_cache, task->etag, task->content_type, task->image);
+    }
+    preview_task_free(task);
+    return FALSE;
 }
 
-void
-ui_connection_free(UiConnection *self) {
+// Runs on render worker thread
+static void
+preview_task_run(gpointer data) {
+    PreviewTask *task = (PreviewTask *)data;
+    const Babl *format = babl_format("R'G'B'A u8");
+    ProcessorRegion region;
+    processor_region_init(&region);
+    region.max_width = task->settings.max_width;
+    region.max_height = task->settings.max_height;
+
+    ProcessorRender plan;
+    const gboolean planned = render_plan(task->snapshot, task->node_id, &region, &plan);
+    gsize rgba_size = 0;
+    gchar *rgba = (planned) ? render_pixels(task->ui, &plan, format, &rgba_size) : NULL;
+    if (rgba && preview_settings_are_default(&task->settings)) {
+        GHashTable *query = g_hash_table_new(g_str_hash, g_str_equal);
+        g_hash_table_insert(query, "graph", task->snapshot->graph->id);
+        g_hash_table_insert(query, "node", task->node_id);
+        task->etag = process_etag(task->ui, "/process", task->snapshot, query, ImageFormatPng, -1, NULL);
+        g_hash_table_destroy(query);
+    }
 
-    g_hash_table_destroy(self->network_map);
-    g_free(self->hostname);
+    if (rgba) {
+        task->image = render_encode(task->ui, task->settings.format, task->settings.quality,
+                                    plan.roi.width, plan.roi.height, rgba, &task->content_type);
+        buffer_pool_release(task->ui->buffer_pool, rgba, rgba_size);
+    }
+    if (task->image) {
+        task->header = preview_header_new(task, plan.roi.width, plan.roi.height);
+        task->frame = preview_frame_new(task);
+    } else {
+        g_free(task->etag);
+        task->etag = NULL;
+    }
+    ui_render_result(task->ui, preview_task_finish, task);
+}
+
+// Push previews of the processor nodes in @network to clients which asked for them.
+// Called when processing has finished. Each node is rendered once per generation and settings
+static void
+ui_push_previews(UiConnection *self, Network *network) {
+    if (self->closing) {
+        return;
+    }
+    GHashTable *settings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL); // -> UiClientPreviews
+    for (GList *l = self->clients; l; l = l->next) {
+        const UiClientPreviews *previews = ui_client_get_previews((UiClient *)l->data);
+        if (previews) {
+            g_hash_table_replace(settings, ui_client_previews_key(previews), (gpointer)previews);
+        }
+    }
+
+    const guint64 generation = network->graph->generation;
+    GHashTableIter nodes;
+    gpointer node_id = NULL;
+    g_hash_table_iter_init(&nodes, network->graph->processor_map);
+    while (g_hash_table_size(settings) && g_hash_table_iter_next(&nodes, &node_id, NULL)) {
+        GHashTableIter iter;
+        gpointer key = NULL;
+        gpointer value = NULL;
+        g_hash_table_iter_init(&iter, settings);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            gchar *sent_key = g_strdup_printf("%s\n%s\n%s", network->graph->id, (const gchar *)node_id,
+                                              (const gchar *)key);
+            guint64 *sent = (guint64 *)g_hash_table_lookup(self->previews_sent, sent_key);
+            if (sent && *sent == generation) {
+                g_free(sent_key);
+                continue;
+            }
+
+            const UiClientPreviews *previews = (const UiClientPreviews *)value;
+            ProcessorRegion region;
+            processor_region_init(&region);
+            region.max_width = previews->max_width;
+            region.max_height = previews->max_height;
+            const gint64 pixels = render_estimate_pixels(network, (const gchar *)node_id, &region);
+            if (admission_acquire(self->admission, network->graph->id, pixels) != AdmissionAccepted) {
+                // Clients still get the preview URL
+                g_free(sent_key);
+                continue;
+            }
+            if (!sent) {
+                sent = g_new(guint64, 1);
+                g_hash_table_insert(self->previews_sent, g_strdup(sent_key), sent);
+            }
+            *sent = generation;
+            g_free(sent_key);
+
+            PreviewTask *task = g_new0(PreviewTask, 1);
+            task->ui = self;
+            task->network = network_ref(network);
+            task->snapshot = ui_snapshot_acquire(self, network);
+            task->node_id = g_strdup((const gchar *)node_id);
+            task->generation = generation;
+            task->settings = *previews;
+            task->settings_key = g_strdup((const gchar *)key);
+            ui_render_async(self, network->graph->id, pixels, preview_task_run, task);
+        }
+    }
+    g_hash_table_destroy(settings);
+}
+
+// A /process request being handled by a render worker
+typedef struct _RenderJob {
+    UiConnection *ui;
+    SoupServer *server;
+    SoupMessage *msg; // paused while job is running
+    Network *network; // reference held by job
+    Network *snapshot; // rendered by worker, once admitted
+    gchar *node_id;
+    ProcessorRegion region;
+    ImageFormat format;
+    gint quality;
+    gchar *etag;
+    GBytes *upload; // image given with POST, or NULL
+    gchar *inport; // exported port @upload is bound to
+    gboolean tile; // render tile instead of region
+    gint tile_z;
+    gint tile_x;
+    gint tile_y;
+    // Results
+    guint status;
+    GBytes *body;
+    const gchar *content_type;
+    // When streaming, on main thread
+    gboolean streaming; // headers sent
+    GByteArray *stream_copy; // everything sent so far, for the response cache. NULL if too large
+    gint cancelled; // atomic, set when the client has gone away
+    gulong finished_handler;
+} RenderJob;
+
+static void
+render_job_free(RenderJob *job) {
+    if (job->finished_handler) {
+        g_signal_handler_disconnect(job->msg, job->finished_handler);
+    }
+    g_object_unref(job->msg);
+    if (job->snapshot) {
+        network_snapshot_release(job->network, job->snapshot);
+    }
+    network_unref(job->network);
+    g_free(job->node_id);
+    g_free(job->etag);
+    if (job->upload) {
+        g_bytes_unref(job->upload);
+    }
+    g_free(job->inport);
+    if (job->body) {
+        g_bytes_unref(job->body);
+    }
+    if (job->stream_copy) {
+        g_byte_array_unref(job->stream_copy);
+    }
+    g_free(job);
+}
+
+// Runs on main thread when worker is done
+static gboolean
+render_job_finish(gpointer user_data) {
+    RenderJob *job = (RenderJob *)user_data;
+    if (g_atomic_int_get(&job->cancelled)) {
+        // Message is done with, only a complete output is worth keeping
+        if (job->body) {
+            response_cache_insert(job->ui->response_cache, job->etag, job->content_type, job->body);
+        }
+    } else if (job->streaming) {
+        if (job->status == SOUP_STATUS_OK && job->stream_copy) {
+            GBytes *body = g_byte_array_free_to_bytes(job->stream_copy);
+            job->stream_copy = NULL;
+            response_cache_insert(job->ui->response_cache, job->etag, job->content_type, body);
+            g_bytes_unref(body);
+        } else if (job->status != SOUP_STATUS_OK) {
+            // Status already sent, client gets a truncated image
+            imgflo_warning("Encoding failed while streaming %s", job->node_id);
+        }
+        soup_message_body_complete(job->msg->response_body);
+        soup_server_unpause_message(job->server, job->msg);
+    } else if (job->body) {
+        response_cache_insert(job->ui->response_cache, job->etag, job->content_type, job->body);
+        set_cached_response(job->msg, job->etag, job->content_type, job->body);
+        soup_server_unpause_message(job->server, job->msg);
+    } else {
+        soup_message_set_status(job->msg, job->status);
+        soup_server_unpause_message(job->server, job->msg);
+    }
+    render_job_free(job);
+    return FALSE;
+}
+
+// Encoded output of a streaming RenderJob
+typedef struct _RenderChunk {
+    RenderJob *job;
+    GBytes *bytes;
+} RenderChunk;
+
+// Runs on main thread. Chunks arrive in the order they were produced
+static gboolean
+render_job_send_chunk(gpointer user_data) {
+    RenderChunk *chunk = (RenderChunk *)user_data;
+    RenderJob *job = chunk->job;
+    if (g_atomic_int_get(&job->cancelled)) {
+        g_bytes_unref(chunk->bytes);
+        g_free(chunk);
+        return FALSE;
+    }
+    if (!job->streaming) {
+        soup_message_set_status(job->msg, SOUP_STATUS_OK);
+        soup_message_headers_set_content_type(job->msg->response_headers, job->content_type, NULL);
+        soup_message_headers_replace(job->msg->response_headers, "ETag", job->etag);
+        soup_message_headers_replace(job->msg->response_headers, "Cache-Control", "no-cache");
+        soup_message_headers_replace(job->msg->response_headers, "Vary", "Accept");
+        soup_message_headers_set_encoding(job->msg->response_headers, SOUP_ENCODING_CHUNKED);
+        job->stream_copy = g_byte_array_new();
+        job->streaming = TRUE;
+    }
+    if (job->stream_copy && job->stream_copy->len + g_bytes_get_size(chunk->bytes) > UI_STREAM_CACHE_MAX) {
+        // Would evict most of the cache, so not worth holding on to
+        g_byte_array_unref(job->stream_copy);
+        job->stream_copy = NULL;
+    }
+    if (job->stream_copy) {
+        g_byte_array_append(job->stream_copy,
+                            g_bytes_get_data(chunk->bytes, NULL), g_bytes_get_size(chunk->bytes));
+    }
+    soup_message_body_append_bytes(job->msg->response_body, chunk->bytes);
+    soup_server_unpause_message(job->server, job->msg);
+    g_bytes_unref(chunk->bytes);
+    g_free(chunk);
+    return FALSE;
+}
+
+// Takes ownership of @bytes
+static void
+render_job_push_chunk(RenderJob *job, GBytes *bytes) {
+    if (g_bytes_get_size(bytes) == 0) {
+        g_bytes_unref(bytes);
+        return;
+    }
+    RenderChunk *chunk = g_new(RenderChunk, 1);
+    chunk->job = job;
+    chunk->bytes = bytes;
+    ui_render_result(job->ui, render_job_send_chunk, chunk);
+}
+
+// Whether output is large enough to be worth streaming
+static gboolean
+render_job_should_stream(RenderJob *job, const ProcessorRender *plan) {
+    return image_format_supports_streaming(job->format) &&
+        (gint64)plan->roi.width*plan->roi.height >= UI_STREAM_MIN_PIXELS;
+}
+
+// Render @plan in strips, handing encoded data to main thread as it is produced.
+// Memory use is bounded by a strip instead of the whole image
+static void
+render_job_stream(RenderJob *job, const ProcessorRender *plan, const Babl *format) {
+    const gint width = plan->roi.width;
+    const gint height = plan->roi.height;
+    const gint strip_rows = MIN(UI_STREAM_STRIP_ROWS, height);
+    const gsize strip_size = (gsize)width*strip_rows*babl_format_get_bytes_per_pixel(format);
+    gchar *strip = buffer_pool_acquire(job->ui->buffer_pool, strip_size);
+    ImageEncoder *encoder = image_encoder_new(job->format, job->quality);
+    job->content_type = image_encoder_mimetype(encoder);
+
+    gint64 encode_us = 0; // rendering is interleaved, only count time in the encoder
+    gsize encoded = 0;
+    gboolean success = image_encoder_begin(encoder, width, height);
+    for (gint y = 0; success && y < height && !g_atomic_int_get(&job->cancelled); y += strip_rows) {
+        const gint rows = MIN(strip_rows, height-y);
+        processor_render_rows(plan, format, y, rows, strip);
+        const gint64 start = g_get_monotonic_time();
+        success = image_encoder_write_rows(encoder, strip, rows);
+        encode_us += g_get_monotonic_time() - start;
+        if (success) {
+            GBytes *chunk = image_encoder_take_output(encoder);
+            encoded += g_bytes_get_size(chunk);
+            render_job_push_chunk(job, chunk);
+        }
+    }
+    const gint64 start = g_get_monotonic_time();
+    success = success && !g_atomic_int_get(&job->cancelled) && image_encoder_finish(encoder);
+    encode_us += g_get_monotonic_time() - start;
+    if (success) {
+        GBytes *chunk = image_encoder_take_output(encoder);
+        encoded += g_bytes_get_size(chunk);
+        render_job_push_chunk(job, chunk);
+        metrics_encoded(job->ui->metrics, job->format, encoded, encode_us);
+    }
+    job->status = (success) ? SOUP_STATUS_OK : SOUP_STATUS_INTERNAL_SERVER_ERROR;
+
+    image_encoder_free(encoder);
+    buffer_pool_release(job->ui->buffer_pool, strip, strip_size);
+}
+
+// Bind decoded upload to its inport. Snapshot is discarded afterwards, so nobody else sees it
+static gboolean
+render_job_bind_input(RenderJob *job, GeglBuffer *input) {
+    // Port may have been removed since request was accepted
+    if (!network_inport_property(job->snapshot, job->inport)) {
+        return FALSE;
+    }
+    GValue value = G_VALUE_INIT;
+    g_value_init(&value, GEGL_TYPE_BUFFER);
+    g_value_set_object(&value, input);
+    const gboolean bound = network_send_packet(job->snapshot, job->inport, &value);
+    g_value_unset(&value);
+    return bound;
+}
+
+static gboolean
+render_job_plan(RenderJob *job, ProcessorRender *plan) {
+    if (!job->tile) {
+        return render_plan(job->snapshot, job->node_id, &job->region, plan);
+    }
+    // Node may have been removed since request was accepted
+    Processor *processor = network_processor(job->snapshot, job->node_id);
+    GeglNode *node = (processor) ? processor->node : graph_get_gegl_node(job->snapshot->graph, job->node_id);
+    return node && node_plan_tile(node, job->tile_z, job->tile_x, job->tile_y, plan);
+}
+
+// Runs on render worker thread
+static void
+render_job_run(gpointer data) {
+    RenderJob *job = (RenderJob *)data;
+    const Babl *format = babl_format("R'G'B'A u8");
+    if (g_atomic_int_get(&job->cancelled)) {
+        ui_render_result(job->ui, render_job_finish, job);
+        return;
+    }
+
+    GeglBuffer *input = NULL;
+    if (job->upload) {
+        input = image_decode(g_bytes_get_data(job->upload, NULL), g_bytes_get_size(job->upload));
+        if (!input) {
+            job->status = SOUP_STATUS_BAD_REQUEST;
+            ui_render_result(job->ui, render_job_finish, job);
+            return;
+        }
+    }
+
+    const gboolean bound = input && render_job_bind_input(job, input);
+    ProcessorRender plan;
+    const gboolean planned = (!input || bound) && render_job_plan(job, &plan);
+    const gboolean streamed = planned && render_job_should_stream(job, &plan);
+    gsize rgba_size = 0;
+    gchar *rgba = NULL;
+    if (streamed) {
+        render_job_stream(job, &plan, format);
+    } else if (planned) {
+        rgba = render_pixels(job->ui, &plan, format, &rgba_size);
+    }
+    if (input) {
+        g_object_unref(input);
+    }
+
+    if (streamed) {
+        ui_render_result(job->ui, render_job_finish, job);
+        return;
+    }
+    // Tiles outside of the output do not exist, while /process regions are just wrong
+    job->status = (job->tile) ? SOUP_STATUS_NOT_FOUND : SOUP_STATUS_BAD_REQUEST;
+    if (rgba) {
+        job->body = render_encode(job->ui, job->format, job->quality, plan.roi.width, plan.roi.height,
+                                  rgba, &job->content_type);
+        if (!job->body) {
+            job->status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        buffer_pool_release(job->ui->buffer_pool, rgba, rgba_size);
+    }
+
+    ui_render_result(job->ui, render_job_finish, job);
+}
+
+// Network and node named in @query. Sets 400 and returns NULL if either is wrong
+static Network *
+query_get_network(UiConnection *self, SoupMessage *msg, GHashTable *query) {
+    const gchar *graph_id = (query) ? g_hash_table_lookup(query, "graph") : NULL;
+    Network *network = (graph_id) ? g_hash_table_lookup(self->network_map, graph_id) : NULL;
+    if (!network) {
+        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "'graph' not specified or wrong");
+        return NULL;
+    }
+
+    const gchar *node_id = g_hash_table_lookup(query, "node");
+    if (!node_id || (!network_processor(network, node_id) && !graph_get_gegl_node(network->graph, node_id))) {
+        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "'node' not specified or wrong");
+        return NULL;
+    }
+    return network;
+}
+
+// Output format from 'format', else the Accept header, and 'quality'. Sets 400 and returns FALSE if invalid
+static gboolean
+query_get_format(SoupMessage *msg, GHashTable *query, ImageFormat *format_out, gint *quality_out) {
+    ImageFormat image_format = ImageFormatPng;
+    const gchar *name = (query) ? g_hash_table_lookup(query, "format") : NULL;
+    if (name) {
+        image_format = image_format_from_name(name);
+    } else {
+        const gchar *accept = soup_message_headers_get_list(msg->request_headers, "Accept");
+        image_format = image_format_from_accept(accept);
+    }
+    gdouble quality = -1;
+    if (image_format == ImageFormatInvalid || !query_get_number(query, "quality", &quality)) {
+        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "'format' or 'quality' is invalid");
+        return FALSE;
+    }
+    *format_out = image_format;
+    *quality_out = (gint)quality;
+    return TRUE;
+}
+
+// New job for @msg, rendering node named in @query
+static RenderJob *
+render_job_new(UiConnection *self, SoupServer *server, SoupMessage *msg, Network *network, GHashTable *query) {
+    RenderJob *job = g_new0(RenderJob, 1);
+    job->ui = self;
+    job->server = server;
+    job->msg = g_object_ref(msg);
+    job->network = network_ref(network);
+    job->node_id = g_strdup(g_hash_table_lookup(query, "node"));
+    processor_region_init(&job->region);
+    return job;
+}
+
+// Message can only finish while job holds it if the client went away. Worker stops at the next strip
+static void
+render_job_msg_finished(SoupMessage *msg, RenderJob *job) {
+    g_atomic_int_set(&job->cancelled, TRUE);
+}
+
+// Answer from response cache if output is unchanged since last request, else admit @job
+// and render and encode it on a worker, so the main loop stays responsive. Takes ownership of @job
+static void
+render_job_submit(RenderJob *job, GHashTable *query, gint64 pixels) {
+    UiConnection *self = job->ui;
+    SoupMessage *msg = job->msg;
+    job->etag = process_etag(self, soup_message_get_uri(msg)->path, job->network, query,
+                             job->format, job->quality, job->upload);
+
+    ResponseCacheEntry *cached = NULL;
+    gboolean answered = TRUE;
+    if (etag_matches(soup_message_headers_get_list(msg->request_headers, "If-None-Match"), job->etag)) {
+        metrics_cache_lookup(self->metrics, MetricsCacheNotModified);
+        soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+        soup_message_headers_replace(msg->response_headers, "ETag", job->etag);
+    } else if ((cached = response_cache_lookup(self->response_cache, job->etag))) {
+        metrics_cache_lookup(self->metrics, MetricsCacheHit);
+        set_cached_response(msg, job->etag, cached->content_type, cached->body);
+    } else {
+        metrics_cache_lookup(self->metrics, MetricsCacheMiss);
+        answered = FALSE;
+    }
+    // Shed load before anything is queued, so accepted requests are not delayed by it
+    const AdmissionResult admitted = (answered) ? AdmissionAccepted :
+        admission_acquire(self->admission, job->network->graph->id, pixels);
+    if (admitted != AdmissionAccepted) {
+        set_admission_rejected(msg, admitted);
+        answered = TRUE;
+    }
+    if (answered) {
+        render_job_free(job);
+        return;
+    }
+
+    soup_server_pause_message(job->server, msg);
+    job->finished_handler = g_signal_connect(msg, "finished", G_CALLBACK(render_job_msg_finished), job);
+    job->snapshot = ui_snapshot_acquire(self, job->network);
+    ui_render_async(self, job->network->graph->id, pixels, render_job_run, job);
+}
+
+static void
+process_image_callback (SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer user_data) {
+
+    UiConnection *self = (UiConnection *)user_data;
+
+    Network *network = query_get_network(self, msg, query);
+    if (!network) {
+        return;
+    }
+
+    ProcessorRegion region;
+    const gchar *invalid = NULL;
+    if (!query_get_region(query, &region, &invalid)) {
+        gchar *reason = g_strdup_printf("'%s' is not a number, or out of range", invalid);
+        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, reason);
+        g_free(reason);
+        return;
+    }
+
+    ImageFormat image_format = ImageFormatPng;
+    gint quality = -1;
+    if (!query_get_format(msg, query, &image_format, &quality)) {
+        return;
+    }
+
+    // With POST, the image in the body is bound to an exported GeglBuffer inport
+    const gchar *inport = NULL;
+    GBytes *upload = NULL;
+    if (msg->method == SOUP_METHOD_POST) {
+        inport = (g_hash_table_lookup(query, "inport")) ? g_hash_table_lookup(query, "inport") : "input";
+        GParamSpec *property = network_inport_property(network, inport);
+        if (!property || !g_type_is_a(G_PARAM_SPEC_VALUE_TYPE(property), GEGL_TYPE_BUFFER)) {
+            soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "'inport' not specified or wrong");
+            return;
+        }
+        SoupBuffer *body = soup_message_body_flatten(msg->request_body);
+        upload = soup_buffer_get_as_bytes(body);
+        soup_buffer_free(body);
+        if (image_format_sniff(g_bytes_get_data(upload, NULL), g_bytes_get_size(upload)) == ImageFormatInvalid) {
+            soup_message_set_status_full(msg, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE, "Body is not PNG, JPEG or WebP");
+            g_bytes_unref(upload);
+            return;
+        }
+    }
+
+    RenderJob *job = render_job_new(self, server, msg, network, query);
+    job->region = region;
+    job->format = image_format;
+    job->quality = quality;
+    job->upload = upload;
+    job->inport = g_strdup(inport);
+    render_job_submit(job, query, render_estimate_pixels(network, job->node_id, &region));
+}
+
+// Fixed-size tiles of a node's output at pyramid level 'z', so huge outputs can be browsed
+// by rendering only the tiles a viewer looks at. Cached like /process, per graph generation
+static void
+tile_callback(SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer user_data) {
+
+    UiConnection *self = (UiConnection *)user_data;
+
+    Network *network = query_get_network(self, msg, query);
+    if (!network) {
+        return;
+    }
+
+    const gchar *keys[] = { "z", "x", "y" };
+    const gdouble limits[] = { PROCESSOR_TILE_MAX_LEVEL, G_MAXINT/PROCESSOR_TILE_SIZE, G_MAXINT/PROCESSOR_TILE_SIZE };
+    gint values[G_N_ELEMENTS(keys)];
+    for (int i=0; i<G_N_ELEMENTS(keys); i++) {
+        gdouble value = G_MAXDOUBLE;
+        const gdouble minimum = (i == 0) ? 0 : -limits[i];
+        if (!query_get_number(query, keys[i], &value) ||
+            value < minimum || value > limits[i] || value != (gint)value) {
+            gchar *reason = g_strdup_printf("'%s' not specified or out of range", keys[i]);
+            soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, reason);
+            g_free(reason);
+            return;
+        }
+        values[i] = (gint)value;
+    }
+
+    ImageFormat image_format = ImageFormatPng;
+    gint quality = -1;
+    if (!query_get_format(msg, query, &image_format, &quality)) {
+        return;
+    }
+
+    RenderJob *job = render_job_new(self, server, msg, network, query);
+    job->tile = TRUE;
+    job->tile_z = values[0];
+    job->tile_x = values[1];
+    job->tile_y = values[2];
+    job->format = image_format;
+    job->quality = quality;
+    render_job_submit(job, query, PROCESSOR_TILE_SIZE*PROCESSOR_TILE_SIZE);
+}
+
+// A POST /batch request. Groups of jobs for the same graph run in turn as one render task,
+// and results are streamed back as newline-delimited JSON as they are done
+typedef struct _BatchRequest {
+    SoupServer *server;
+    SoupMessage *msg; // paused while groups are running
+    GPtrArray *networks; // references held while running
+    GPtrArray *snapshots; // rendered by the tasks, same order as @networks
+    gint remaining; // tasks not done, atomic
+    gint cancelled; // atomic, set when the client has gone away
+    gulong finished_handler;
+} BatchRequest;
+
+typedef struct _BatchTask {
+    UiConnection *ui;
+    BatchRequest *request;
+    GPtrArray *groups; // of BatchGroup, all for the same graph, owned
+    GPtrArray *snapshots; // one for each group, as IIP overrides are applied to it
+    gint64 pixels; // estimated, for all groups
+} BatchTask;
+
+typedef struct _BatchLine {
+    BatchRequest *request;
+    gchar *line;
+} BatchLine;
+
+static void
+batch_task_free(BatchTask *task) {
+    g_ptr_array_free(task->groups, TRUE);
+    g_ptr_array_free(task->snapshots, TRUE);
+    g_free(task);
+}
+
+// Runs on main thread. Lines arrive in the order they were produced
+static gboolean
+batch_send_line(gpointer user_data) {
+    BatchLine *line = (BatchLine *)user_data;
+    SoupMessage *msg = line->request->msg;
+    if (g_atomic_int_get(&line->request->cancelled)) {
+        g_free(line->line);
+    } else {
+        soup_message_body_append_take(msg->response_body, (guchar *)line->line, strlen(line->line));
+        soup_server_unpause_message(line->request->server, msg);
+    }
+    g_free(line);
+    return FALSE;
+}
+
+// Runs on main thread after the last line
+static gboolean
+batch_request_finish(gpointer user_data) {
+    BatchRequest *request = (BatchRequest *)user_data;
+    if (!g_atomic_int_get(&request->cancelled)) {
+        soup_message_body_complete(request->msg->response_body);
+        soup_server_unpause_message(request->server, request->msg);
+    }
+    for (guint i = 0; i < request->networks->len; i++) {
+        network_snapshot_release(g_ptr_array_index(request->networks, i),
+                                 g_ptr_array_index(request->snapshots, i));
+    }
+    g_ptr_array_free(request->snapshots, TRUE);
+    g_ptr_array_free(request->networks, TRUE);
+    g_signal_handler_disconnect(request->msg, request->finished_handler);
+    g_object_unref(request->msg);
+    g_free(request);
+    return FALSE;
+}
+
+// Message can only finish while request holds it if the client went away. Tasks stop at the next job
+static void
+batch_request_msg_finished(SoupMessage *msg, BatchRequest *request) {
+    g_atomic_int_set(&request->cancelled, TRUE);
+}
+
+static void
+batch_task_push_line(BatchTask *task, const BatchGroup *group, const BatchJob *job, guint status,
+                     const gchar *content_type, GBytes *body, const gchar *error) {
+    BatchLine *line = g_new(BatchLine, 1);
+    line->request = task->request;
+    line->line = batch_result_line(job, group->graph_id, status, content_type, body, error);
+    ui_render_result(task->ui, batch_send_line, line);
+}
+
+// Runs on render worker thread
+static void
+batch_task_run(gpointer data) {
+    BatchTask *task = (BatchTask *)data;
+    const Babl *format = babl_format("R'G'B'A u8");
+
+    for (guint g = 0; g < task->groups->len; g++) {
+        BatchGroup *group = (BatchGroup *)g_ptr_array_index(task->groups, g);
+        Network *network = (Network *)g_ptr_array_index(task->snapshots, g);
+
+        // IIP overrides are applied once for the whole group
+        batch_group_apply(group, network->graph);
+
+        for (guint i = 0; i < group->jobs->len && !g_atomic_int_get(&task->request->cancelled); i++) {
+            const BatchJob *job = (const BatchJob *)g_ptr_array_index(group->jobs, i);
+            ProcessorRender plan;
+            const gboolean planned = render_plan(network, job->node_id, &job->region, &plan);
+            gsize rgba_size = 0;
+            gchar *rgba = (planned) ? render_pixels(task->ui, &plan, format, &rgba_size) : NULL;
+
+            if (!rgba) {
+                batch_task_push_line(task, group, job, SOUP_STATUS_BAD_REQUEST, NULL, NULL,
+                                     "'node' is wrong or output empty");
+                continue;
+            }
+            const gchar *content_type = NULL;
+            GBytes *body = render_encode(task->ui, job->format, job->quality, plan.roi.width, plan.roi.height,
+                                         rgba, &content_type);
+            buffer_pool_release(task->ui->buffer_pool, rgba, rgba_size);
+            if (body) {
+                batch_task_push_line(task, group, job, SOUP_STATUS_OK, content_type, body, NULL);
+                g_bytes_unref(body);
+            } else {
+                batch_task_push_line(task, group, job, SOUP_STATUS_INTERNAL_SERVER_ERROR, NULL, NULL, NULL);
+            }
+        }
+    }
+
+    if (g_atomic_int_dec_and_test(&task->request->remaining)) {
+        ui_render_result(task->ui, batch_request_finish, task->request);
+    }
+    batch_task_free(task);
+}
+
+static void
+batch_callback(SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer user_data) {
+
+    UiConnection *self = (UiConnection *)user_data;
+
+    guint n_jobs = 0;
+    gchar *error = NULL;
+    SoupBuffer *body = soup_message_body_flatten(msg->request_body);
+    GPtrArray *groups = batch_parse(body->data, body->length, &n_jobs, &error);
+    soup_buffer_free(body);
+    if (!groups) {
+        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, error);
+        g_free(error);
+        return;
+    }
+
+    // Like /process, reject the request if it refers to things which do not exist
+    for (guint i = 0; i < groups->len; i++) {
+        BatchGroup *group = (BatchGroup *)g_ptr_array_index(groups, i);
+        Network *network = g_hash_table_lookup(self->network_map, group->graph_id);
+        for (guint j = 0; network && j < group->jobs->len; j++) {
+            const BatchJob *job = (const BatchJob *)g_ptr_array_index(group->jobs, j);
+            if (!network_processor(network, job->node_id) &&
+                !graph_get_gegl_node(network->graph, job->node_id)) {
+                error = g_strdup_printf("Job %u: 'node' is wrong", job->index);
+                break;
+            }
+        }
+        if (!network) {
+            const BatchJob *job = (const BatchJob *)g_ptr_array_index(group->jobs, 0);
+            error = g_strdup_printf("Job %u: 'graph' is wrong", job->index);
+        }
+        if (error) {
+            soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, error);
+            g_free(error);
+            g_ptr_array_free(groups, TRUE);
+            return;
+        }
+    }
+
+    // One task per graph, so a batch takes an admission slot per graph however many groups it has
+    GPtrArray *tasks = g_ptr_array_new_with_free_func((GDestroyNotify)batch_task_free);
+    GHashTable *by_graph = g_hash_table_new(g_str_hash, g_str_equal); // -> BatchTask in tasks
+    gint64 pixels = 0;
+    for (guint i = 0; i < groups->len; i++) {
+        BatchGroup *group = (BatchGroup *)g_ptr_array_index(groups, i);
+        BatchTask *task = g_hash_table_lookup(by_graph, group->graph_id);
+        if (!task) {
+            task = g_new0(BatchTask, 1);
+            task->ui = self;
+            task->groups = g_ptr_array_new_with_free_func((GDestroyNotify)batch_group_free);
+            task->snapshots = g_ptr_array_new();
+            g_hash_table_insert(by_graph, group->graph_id, task);
+            g_ptr_array_add(tasks, task);
+        }
+        Network *network = g_hash_table_lookup(self->network_map, group->graph_id);
+        for (guint j = 0; j < group->jobs->len; j++) {
+            const BatchJob *job = (const BatchJob *)g_ptr_array_index(group->jobs, j);
+            const gint64 job_pixels = render_estimate_pixels(network, job->node_id, &job->region);
+            task->pixels += job_pixels;
+            pixels += job_pixels;
+        }
+        g_ptr_array_add(task->groups, group);
+    }
+    g_hash_table_destroy(by_graph);
+    g_ptr_array_set_free_func(groups, NULL);
+    g_ptr_array_free(groups, TRUE);
+
+    // Retrying a batch which is too large for the limits would never succeed
+    if (!admission_could_fit(self->admission, tasks->len, pixels)) {
+        soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, "Batch needs more graphs or pixels than are rendered at once");
+        g_ptr_array_free(tasks, TRUE);
+        return;
+    }
+
+    // Admitted as a whole, so either all jobs are rendered or none
+    AdmissionResult admitted = AdmissionAccepted;
+    guint n_admitted = 0;
+    while (n_admitted < tasks->len) {
+        BatchTask *task = (BatchTask *)g_ptr_array_index(tasks, n_admitted);
+        const BatchGroup *group = (const BatchGroup *)g_ptr_array_index(task->groups, 0);
+        admitted = admission_acquire(self->admission, group->graph_id, task->pixels);
+        if (admitted != AdmissionAccepted) {
+            break;
+        }
+        n_admitted++;
+    }
+    if (admitted != AdmissionAccepted) {
+        for (guint i = 0; i < n_admitted; i++) {
+            BatchTask *task = (BatchTask *)g_ptr_array_index(tasks, i);
+            const BatchGroup *group = (const BatchGroup *)g_ptr_array_index(task->groups, 0);
+            admission_release(self->admission, group->graph_id, task->pixels);
+        }
+        set_admission_rejected(msg, admitted);
+        g_ptr_array_free(tasks, TRUE);
+        return;
+    }
+
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+    soup_message_headers_set_content_type(msg->response_headers, "application/x-ndjson", NULL);
+    soup_message_headers_replace(msg->response_headers, "Cache-Control", "no-cache");
+    soup_message_headers_set_encoding(msg->response_headers, SOUP_ENCODING_CHUNKED);
+    if (tasks->len == 0) {
+        soup_message_body_complete(msg->response_body);
+        g_ptr_array_free(tasks, TRUE);
+        return;
+    }
+
+    BatchRequest *request = g_new(BatchRequest, 1);
+    request->server = server;
+    request->msg = g_object_ref(msg);
+    request->networks = g_ptr_array_new_with_free_func((GDestroyNotify)network_unref);
+    request->snapshots = g_ptr_array_new();
+    request->remaining = tasks->len;
+    request->cancelled = FALSE;
+    soup_server_pause_message(server, msg);
+    request->finished_handler = g_signal_connect(msg, "finished", G_CALLBACK(batch_request_msg_finished), request);
+
+    // Graphs are independent, so they can run in parallel
+    g_ptr_array_set_free_func(tasks, NULL);
+    for (guint i = 0; i < tasks->len; i++) {
+        BatchTask *task = (BatchTask *)g_ptr_array_index(tasks, i);
+        task->request = request;
+        const gchar *graph_id = ((const BatchGroup *)g_ptr_array_index(task->groups, 0))->graph_id;
+        for (guint g = 0; g < task->groups->len; g++) {
+            Network *network = network_ref(g_hash_table_lookup(self->network_map, graph_id));
+            Network *snapshot = ui_snapshot_acquire(self, network);
+            g_ptr_array_add(request->networks, network);
+            g_ptr_array_add(request->snapshots, snapshot);
+            g_ptr_array_add(task->snapshots, snapshot);
+        }
+        ui_render_async(self, graph_id, task->pixels, batch_task_run, task);
+    }
+    g_ptr_array_free(tasks, TRUE);
+}
+
+// A /graph/<name> request. Runs on a network of its own from the template's pool
+typedef struct _TemplateJob {
+    UiConnection *ui;
+    SoupServer *server;
+    SoupMessage *msg; // paused while job is running
+    GraphTemplate *template;
+    Network *network; // from template pool
+    GHashTable *values; // exported inport -> value as string
+    ImageFormat format;
+    gint quality;
+    gint cancelled; // atomic, set when the client has gone away
+    gulong finished_handler;
+    // Results
+    guint status;
+    GBytes *body;
+    const gchar *content_type;
+} TemplateJob;
+
+// Message can only finish while job holds it if the client went away
+static void
+template_job_msg_finished(SoupMessage *msg, TemplateJob *job) {
+    g_atomic_int_set(&job->cancelled, TRUE);
+}
+
+// Runs on main thread when worker is done
+static gboolean
+template_job_finish(gpointer user_data) {
+    TemplateJob *job = (TemplateJob *)user_data;
+    const gboolean cancelled = g_atomic_int_get(&job->cancelled);
+    if (job->body && !cancelled) {
+        soup_message_set_status(job->msg, SOUP_STATUS_OK);
+        soup_message_headers_set_content_type(job->msg->response_headers, job->content_type, NULL);
+        soup_message_body_append_bytes(job->msg->response_body, job->body);
+    } else if (!cancelled) {
+        soup_message_set_status(job->msg, job->status);
+    }
+    if (job->body) {
+        g_bytes_unref(job->body);
+    }
+    if (!cancelled) {
+        soup_server_unpause_message(job->server, job->msg);
+    }
+    // Network goes back to the pool either way
+    graph_template_release(job->template, job->network);
+    g_hash_table_destroy(job->values);
+    g_signal_handler_disconnect(job->msg, job->finished_handler);
+    g_object_unref(job->msg);
+    g_free(job);
+    return FALSE;
+}
+
+// Runs on render worker thread
+static void
+template_job_run(gpointer data) {
+    TemplateJob *job = (TemplateJob *)data;
+    const Babl *format = babl_format("R'G'B'A u8");
+    Network *network = job->network;
+
+    // Template values are put back afterwards, for the next request using this network
+    GSList *saved_ports = NULL;
+    GSList *saved = NULL; // of GValue, same order as @saved_ports
+    gboolean applied = TRUE;
+    GHashTableIter iter;
+    gpointer port = NULL;
+    gpointer str = NULL;
+    g_hash_table_iter_init(&iter, job->values);
+    while (g_hash_table_iter_next(&iter, &port, &str)) {
+        GValue *old = g_new0(GValue, 1);
+        if (!network_get_packet(network, (const gchar *)port, old)) {
+            g_free(old);
+            applied = FALSE;
+            continue;
+        }
+        saved_ports = g_slist_prepend(saved_ports, port);
+        saved = g_slist_prepend(saved, old);
+
+        GValue value = G_VALUE_INIT;
+        g_value_init(&value, G_TYPE_STRING);
+        g_value_set_string(&value, (const gchar *)str);
+        applied = network_send_packet(network, (const gchar *)port, &value) && applied;
+        g_value_unset(&value);
+    }
+
+    const GraphNodePort *output = graph_template_output(network);
+    Processor *processor = (output) ? network_processor(network, output->node) : NULL;
+    GeglNode *node = (processor) ? processor->node : (output) ? graph_get_gegl_node(network->graph, output->node) : NULL;
+    ProcessorRegion region;
+    processor_region_init(&region);
+    ProcessorRender plan;
+    const gboolean planned = applied && node && !g_atomic_int_get(&job->cancelled) &&
+        node_plan_region(node, &region, PROCESSOR_MAX_SIZE, &plan);
+    gsize rgba_size = 0;
+    gchar *rgba = (planned) ? render_pixels(job->ui, &plan, format, &rgba_size) : NULL;
+
+    GSList *s = saved;
+    for (GSList *p = saved_ports; p; p = p->next, s = s->next) {
+        GValue *old = (GValue *)s->data;
+        network_send_packet(network, (const gchar *)p->data, old);
+        g_value_unset(old);
+        g_free(old);
+    }
+    g_slist_free(saved);
+    g_slist_free(saved_ports);
+
+    // Value could not be set, or output is empty
+    job->status = SOUP_STATUS_BAD_REQUEST;
+    if (rgba) {
+        job->body = render_encode(job->ui, job->format, job->quality, plan.roi.width, plan.roi.height,
+                                  rgba, &job->content_type);
+        if (!job->body) {
+            job->status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        buffer_pool_release(job->ui->buffer_pool, rgba, rgba_size);
+    }
+    ui_render_result(job->ui, template_job_finish, job);
+}
+
+// Stateless rendering of a graph template. Query parameters are values for its exported inports,
+// except 'format' and 'quality' which are used for the output
+static void
+template_callback(SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer user_data) {
+
+    UiConnection *self = (UiConnection *)user_data;
+
+    GraphTemplate *template = g_hash_table_lookup(self->templates, path+strlen("/graph/"));
+    if (!template) {
+        soup_message_set_status_full(msg, SOUP_STATUS_NOT_FOUND, "No such graph template");
+        return;
+    }
+    ImageFormat image_format = ImageFormatPng;
+    gint quality = -1;
+    if (!query_get_format(msg, query, &image_format, &quality)) {
+        return;
+    }
+
+    // Shed load before anything is queued. Whole output is rendered, at most PROCESSOR_MAX_SIZE square
+    ProcessorRegion region;
+    processor_region_init(&region);
+    const gint64 pixels = processor_region_estimate_pixels(&region, PROCESSOR_MAX_SIZE);
+    AdmissionResult admitted = admission_acquire(self->admission, template->id, pixels);
+    Network *network = (admitted == AdmissionAccepted) ? graph_template_acquire(template) : NULL;
+    if (admitted == AdmissionAccepted && !network) {
+        // All instances busy
+        admission_release(self->admission, template->id, pixels);
+        admitted = AdmissionGraphBusy;
+    }
+    if (admitted != AdmissionAccepted) {
+        set_admission_rejected(msg, admitted);
+        return;
+    }
+
+    GHashTable *values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gpointer value = NULL;
+    if (query) {
+        g_hash_table_iter_init(&iter, query);
+    }
+    while (query && g_hash_table_iter_next(&iter, &key, &value)) {
+        if (g_strcmp0(key, "format") == 0 || g_strcmp0(key, "quality") == 0) {
+            continue;
+        }
+        if (!network_inport_property(network, (const gchar *)key)) {
+            gchar *reason = g_strdup_printf("Graph template has no inport '%s'", (const gchar *)key);
+            soup_message_set_status_full(msg, SOUP_STATUS_BAD_REQUEST, reason);
+            g_free(reason);
+            g_hash_table_destroy(values);
+            graph_template_release(template, network);
+            admission_release(self->admission, template->id, pixels);
+            return;
+        }
+        g_hash_table_insert(values, g_strdup(key), g_strdup(value));
+    }
+
+    TemplateJob *job = g_new0(TemplateJob, 1);
+    job->ui = self;
+    job->server = server;
+    job->msg = g_object_ref(msg);
+    job->template = template;
+    job->network = network;
+    job->values = values;
+    job->format = image_format;
+    job->quality = quality;
+    soup_server_pause_message(server, msg);
+    job->finished_handler = g_signal_connect(msg, "finished", G_CALLBACK(template_job_msg_finished), job);
+    ui_render_async(self, template->id, pixels, template_job_run, job);
+}
+
+// One sample of @name for each Processor node in every network. Busy time if @busy, else queue length
+static void
+write_processor_metrics(UiConnection *self, GString *out, const gchar *name, gboolean busy) {
+    GHashTableIter networks;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&networks, self->network_map);
+    while (g_hash_table_iter_next(&networks, NULL, &value)) {
+        Graph *graph = ((Network *)value)->graph;
+        if (!graph) {
+            continue;
+        }
+        GHashTableIter processors;
+        gpointer node = NULL;
+        gpointer proc = NULL;
+        g_hash_table_iter_init(&processors, graph->processor_map);
+        while (g_hash_table_iter_next(&processors, &node, &proc)) {
+            g_string_append_printf(out, "%s{graph=\"", name);
+            metrics_append_label_value(out, graph->id);
+            g_string_append(out, "\",node=\"");
+            metrics_append_label_value(out, (const gchar *)node);
+            if (busy) {
+                g_string_append_printf(out, "\"} %.6f\n", ((Processor *)proc)->busy_us / 1e6);
+            } else {
+                g_string_append_printf(out, "\"} %u\n", processor_queue_length((Processor *)proc));
+            }
+        }
+    }
+}
+
+static void
+serve_metrics(SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer user_data) {
+
+    UiConnection *self = (UiConnection *)user_data;
+    GString *out = g_string_sized_new(16*1024);
+    metrics_write(self->metrics, out);
+
+    metrics_write_value(out, "imgflo_render_queue_length", "gauge", "Render tasks waiting for a worker",
+                        g_thread_pool_unprocessed(self->render_pool));
+    metrics_write_value(out, "imgflo_render_workers", "gauge", "Render worker threads",
+                        g_thread_pool_get_num_threads(self->render_pool));
+    admission_write_metrics(self->admission, out);
+
+    guint running = 0;
+    GHashTableIter iter;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, self->network_map);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        running += (((Network *)value)->running) ? 1 : 0;
+    }
+    metrics_write_value(out, "imgflo_networks", "gauge", "Networks loaded", g_hash_table_size(self->network_map));
+    metrics_write_value(out, "imgflo_networks_running", "gauge", "Networks started", running);
+    metrics_write_value(out, "imgflo_websocket_clients", "gauge", "Connected WebSocket clients",
+                        g_list_length(self->clients));
+    metrics_write_header(out, "imgflo_processor_queue_length", "gauge",
+                         "Regions waiting for background processing, per Processor node");
+    write_processor_metrics(self, out, "imgflo_processor_queue_length", FALSE);
+    metrics_write_header(out, "imgflo_processor_busy_seconds_total", "counter",
+                         "Time spent in background processing, per Processor node");
+    write_processor_metrics(self, out, "imgflo_processor_busy_seconds_total", TRUE);
+
+    metrics_write_value(out, "imgflo_response_cache_bytes", "gauge", "Size of cached /process responses",
+                        self->response_cache->size);
+    metrics_write_value(out, "imgflo_response_cache_entries", "gauge", "Number of cached /process responses",
+                        g_hash_table_size(self->response_cache->entries));
+    metrics_write_value(out, "imgflo_buffer_pool_bytes", "gauge", "Unused render buffers kept for reuse",
+                        buffer_pool_cached(self->buffer_pool));
+    metrics_write_value(out, "imgflo_fused_operations", "gauge", "Fused point-filter operations loaded",
+                        library_fused_operations(self->component_lib));
+    guint64 tile_cache_size = 0;
+    g_object_get(gegl_config(), "tile-cache-size", &tile_cache_size, NULL);
+    metrics_write_value(out, "imgflo_gegl_tile_cache_size_bytes", "gauge", "Configured GEGL tile cache size",
+                        tile_cache_size);
+
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+    soup_message_headers_replace(msg->response_headers, "Cache-Control", "no-cache");
+    soup_message_set_response(msg, "text/plain; version=0.0.4", SOUP_MEMORY_TAKE, out->str, out->len);
+    g_string_free(out, FALSE);
+}
+
+static void
+serve_frontpage(SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer user_data) {
+
+    static const gchar *html = \
+        "\n<a id=\"flowhub_url\">Open in Flowhub</a>"
+        "\n<script>"
+        "\n   var addr = window.location.origin.replace(\"http://\", \"ws://\");"
+        "\n   addr = addr.replace(\"https://\", \"ws://\");"
+        "\n   var ide = \"http://app.flowhub.io\";"
+        "\n   var url = ide+\"/#runtime/endpoint?protocol=websocket&address=\"+encodeURIComponent(addr);"
+        "\n   var a = document.getElementById(\"flowhub_url\");"
+        "\n   a.href = url;"
+        "\n</script>"
+        ;
+    //gchar *html = g_strdup_printf(html_template, flowhub_url, "Open in Flowhub");
+
+    const gsize len = strlen(html);
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+    soup_message_set_response(msg, "text/html", SOUP_MEMORY_STATIC, html, len);
+    //g_free(html);
+}
+
+static gboolean
+msg_is_upgrade(SoupMessage *msg) {
+    const char *name, *value;
+    SoupMessageHeadersIter iter;
+    soup_message_headers_iter_init(&iter, msg->request_headers);
+    while (soup_message_headers_iter_next(&iter, &name, &value)) {
+        if (g_strcmp0(name, "Connection") == 0 && g_strcmp0(value, "Upgrade") == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Also for requests which were paused while rendering, once the last byte is written
+static void
+on_request_finished(SoupServer *server, SoupMessage *msg, SoupClientContext *client, gpointer user_data)
+{
+    UiConnection *self = (UiConnection *)user_data;
+    const gint64 *start = (const gint64 *)g_object_get_data(G_OBJECT(msg), "imgflo-request-start");
+    if (!start) {
+        // WebSocket upgrade, or request never got to server_callback()
+        return;
+    }
+    const MetricsEndpoint endpoint = metrics_endpoint_from_path(soup_message_get_uri(msg)->path);
+    metrics_request_done(self->metrics, endpoint, msg->status_code, g_get_monotonic_time() - *start);
+}
+
+static void
+server_callback (SoupServer *server, SoupMessage *msg,
+		 const char *path, GHashTable *query,
+		 SoupClientContext *context, gpointer data)
+{
+    UiConnection *self = (UiConnection *)data;
+
+    imgflo_debug("%s %s HTTP/1.%d\n", msg->method, path,
+         soup_message_get_http_version(msg));
+    ensure_hostname_set(self, soup_message_get_uri(msg));
+    if (!msg_is_upgrade(msg)) {
+        // For latency metrics, see on_request_finished()
+        gint64 *start = g_new(gint64, 1);
+        *start = g_get_monotonic_time();
+        g_object_set_data_full(G_OBJECT(msg), "imgflo-request-start", start, g_free);
+    }
+
+    const gboolean image = g_strcmp0(path, "/process") == 0 || g_strcmp0(path, "/tile") == 0 ||
+        g_str_has_prefix(path, "/graph/");
+    if (image) {
+        // Every response may depend on it, errors included, so caches must not mix them up
+        soup_message_headers_replace(msg->response_headers, "Vary", "Accept");
+    }
+
+    if (self->closing) {
+        soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+    } else if ((msg->method == SOUP_METHOD_GET || msg->method == SOUP_METHOD_POST) &&
+        g_strcmp0(path, "/process") == 0) {
+        process_image_callback(server, msg, path, query, context, self);
+    } else if (msg->method == SOUP_METHOD_GET && g_str_has_prefix(path, "/graph/")) {
+        template_callback(server, msg, path, query, context, self);
+    } else if (msg->method == SOUP_METHOD_GET && g_strcmp0(path, "/tile") == 0) {
+        tile_callback(server, msg, path, query, context, self);
+    } else if (msg->method == SOUP_METHOD_POST && g_strcmp0(path, "/batch") == 0) {
+        batch_callback(server, msg, path, query, context, self);
+    } else if (msg->method == SOUP_METHOD_GET && g_strcmp0(path, "/metrics") == 0) {
+        serve_metrics(server, msg, path, query, context, self);
+    } else if (msg_is_upgrade(msg)) {
+        // fall-through, let libsoup WebSocket handle this
+    } else if (msg->method == SOUP_METHOD_GET && g_strcmp0(path, "/") == 0) {
+        serve_frontpage(server, msg, path, query, context, self);
+    } else {
+        imgflo_warning("Unknown HTTP request: %s, %s", msg->method, path);
+        SoupMessageHeadersIter iter;
+        const char *name, *value;
+        soup_message_headers_iter_init(&iter, msg->request_headers);
+        while (soup_message_headers_iter_next(&iter, &name, &value))
+            imgflo_debug("%s: %s\n", name, value);
+        if (msg->request_body->length)
+            imgflo_debug("%s\n", msg->request_body->data);
+        soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+    }
+}
+
+// Appends @text to @batch unless over the rate limit. Returns FALSE if it was suppressed
+static gboolean
+ui_log_append(UiConnection *self, GString *batch, const gchar *text, guint repeats) {
+    const gint64 now = g_get_monotonic_time();
+    if (now - self->log_window_start >= G_USEC_PER_SEC) {
+        self->log_window_start = now;
+        self->log_window_lines = 0;
+    }
+    if (self->log_window_lines >= UI_LOG_MAX_LINES_PER_SECOND) {
+        return FALSE;
+    }
+    self->log_window_lines++;
+
+    if (batch->len) {
+        g_string_append_c(batch, '\n');
+    }
+    g_string_append(batch, text);
+    if (repeats) {
+        g_string_append_printf(batch, " (repeated %u times)", repeats);
+    }
+    return TRUE;
+}
+
+static void
+ui_log_send_batch(UiConnection *self, const gchar *cmd, GString *batch) {
+    if (batch->len) {
+        JsonObject *msg = json_object_new();
+        json_object_set_string_member(msg, "message", batch->str);
+        broadcast_response(self, NULL, "network", cmd, msg);
+    }
+}
+
+// Runs on main thread, sends what has been logged since last time.
+// Consecutive repeats of a message are collapsed, and lines over the rate limit are counted instead
+static gboolean
+ui_log_flush(gpointer user_data) {
+    UiConnection *self = (UiConnection *)user_data;
+    // Anything logged after this schedules a new flush
+    g_atomic_int_set(&self->log_flush_scheduled, 0);
+
+    GString *output = g_string_new(NULL);
+    GString *errors = g_string_new(NULL);
+    guint suppressed = 0;
+    gchar *previous = NULL;
+    gboolean previous_is_error = FALSE;
+    guint repeats = 0;
+    gboolean is_error = FALSE;
+    gchar *message = NULL;
+    while (log_ring_pop(self->log_ring, &is_error, &message)) {
+        if (previous && is_error == previous_is_error && g_strcmp0(message, previous) == 0) {
+            repeats++;
+            g_free(message);
+            continue;
+        }
+        if (previous && !ui_log_append(self, (previous_is_error) ? errors : output, previous, repeats)) {
+            suppressed += repeats+1;
+        }
+        g_free(previous);
+        previous = message;
+        previous_is_error = is_error;
+        repeats = 0;
+    }
+    if (previous && !ui_log_append(self, (previous_is_error) ? errors : output, previous, repeats)) {
+        suppressed += repeats+1;
+    }
+    g_free(previous);
+
+    const guint dropped = log_ring_take_dropped(self->log_ring);
+    if (dropped || suppressed) {
+        if (errors->len) {
+            g_string_append_c(errors, '\n');
+        }
+        g_string_append_printf(errors, "%u log messages not shown, logging too fast", dropped+suppressed);
+    }
+    if (self->clients) {
+        ui_log_send_batch(self, "output", output);
+        ui_log_send_batch(self, "error", errors);
+    }
+    g_string_free(output, TRUE);
+    g_string_free(errors, TRUE);
+    return FALSE;
+}
+
+// Called from any thread, including render workers. Must not block or send directly,
+// so messages go into a lock-free ring which ui_log_flush() drains from the main loop
+void
+ui_log_handler(const gchar *log_domain, GLogLevelFlags log_level,
+                const gchar *message, gpointer user_data) {
+    UiConnection *ui = (UiConnection *)user_data;
+    g_assert(ui);
+
+    // note, this does not catch errors like
+    // g_return_if_fail, as that goes right to g_critical
+    // same with unexpected failures inside GEGL and libsoup
+    const gboolean is_error = (log_level&G_LOG_LEVEL_CRITICAL) || (log_level&G_LOG_LEVEL_WARNING);
+    const gboolean is_debug = (log_level&G_LOG_LEVEL_DEBUG) == G_LOG_LEVEL_DEBUG;
+    if (is_debug) { // TODO: make configureable?
+        return;
+    }
+    log_ring_push(ui->log_ring, is_error, g_strdup(message));
+    if (g_atomic_int_compare_and_exchange(&ui->log_flush_scheduled, 0, 1)) {
+        ui->log_flush_source = g_timeout_add(UI_LOG_FLUSH_INTERVAL, ui_log_flush, ui);
+    }
+}
+
+void
+setup_log_handlers(UiConnection *ui) {
+    imgflo_log_set_handler("imgflo", G_LOG_FLAG_RECURSION, ui_log_handler, ui);
+}
+
+static void
+ui_compile_progress(Library *lib, const gchar *component, LibraryCompileStatus status,
+                    const gchar *output, gpointer user_data) {
+    UiConnection *self = (UiConnection *)user_data;
+    if (!self->clients) {
+        return;
+    }
+
+    if (status == LibraryCompileSucceeded) {
+        const gchar *msg = library_get_component_message(lib, component);
+        broadcast_text(self, msg, NULL);
+    } else if (status == LibraryCompileFailed) {
+        JsonObject *error = json_object_new();
+        json_object_set_string_member(error, "name", component);
+        json_object_set_string_member(error, "message", (output) ? output : "");
+        broadcast_response(self, NULL, "component", "error", error);
+    } else {
+        const gchar *state = (status == LibraryCompileQueued) ? "queued" : "started";
+        gchar *text = g_strdup_printf("Compilation of %s %s", component, state);
+        JsonObject *info = json_object_new();
+        json_object_set_string_member(info, "message", text);
+        broadcast_response(self, NULL, "network", "output", info);
+        g_free(text);
+    }
+}
+
+// Build the component catalog up-front, so the first client does not have to wait for it
+static gboolean
+warm_component_catalog(gpointer user_data) {
+    UiConnection *self = (UiConnection *)user_data;
+    library_get_catalog(self->component_lib);
+    return FALSE;
+}
+
+gboolean
+ui_connection_try_register(UiConnection *self) {
+    if (self->registry->info->user_id) {
+        gboolean success = registry_register(self->registry);
+        if (success) {
+            registry_start_pinging(self->registry);
+        }
+        return success;
+    }
+    return FALSE;
+}
+
+UiConnection *
+ui_connection_new(const gchar *hostname, int internal_port, int external_port) {
+    UiConnection *self = g_new(UiConnection, 1);
+
+    self->clients = NULL;
+    self->preview_interval = UI_PREVIEW_INTERVAL_DEFAULT;
+    self->fusion = TRUE;
+    self->main_network = NULL;
+    self->network_map = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify)network_unref);
+    self->templates = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify)graph_template_free);
+    self->hostname = g_strdup(hostname);
+    self->registry = registry_new(runtime_info_new_from_env(hostname, external_port));
+    self->response_cache = response_cache_new(UI_RESPONSE_CACHE_SIZE);
+    self->previews_sent = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    self->buffer_pool = buffer_pool_new(UI_BUFFER_POOL_SIZE);
+    self->metrics = metrics_new();
+    self->admission = admission_new(UI_ADMISSION_MAX_TASKS, UI_ADMISSION_MAX_GRAPH_TASKS, UI_ADMISSION_MAX_PIXELS);
+    self->render_pool = g_thread_pool_new(render_task_run, self, g_get_num_processors(), FALSE, NULL);
+    self->results_pending = 0;
+    self->closing = FALSE;
+    self->instance_id = imgflo_uuid_new_string();
+    self->parser = json_parser_new();
+    self->packed_catalog = NULL;
+    self->packed_catalog_source = NULL;
+    self->log_ring = log_ring_new();
+    self->log_flush_scheduled = 0;
+    self->log_flush_source = 0;
+    self->log_window_start = 0;
+    self->log_window_lines = 0;
+    self->component_lib = library_new();
+    self->component_lib->on_compile_progress = ui_compile_progress;
+    self->component_lib->on_compile_progress_data = self;
+
+    setup_log_handlers(self);
+
+    self->server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "imgflo-runtime", NULL);
+    if (!self->server) {
+        g_free(self);
+        return NULL;
+    }
+
+    soup_server_add_handler(self->server, NULL,
+        server_callback, self, NULL);
+    g_signal_connect(self->server, "request-finished", G_CALLBACK(on_request_finished), self);
+
+    soup_server_add_websocket_handler(self->server, NULL, NULL, NULL,
+        websocket_callback, self, NULL);
+
+    soup_server_listen_all(self->server, internal_port, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL);
+
+    g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)warm_component_catalog, self, NULL);
+
+    return self;
+}
+
+// Graph templates in @path are served as /graph/<name>. Returns number added
+gint
+ui_connection_add_template_directory(UiConnection *self, const gchar *path) {
+    // As many instances as render workers, so every worker can be busy with one template
+    return graph_template_add_directory(self->templates, path, self->component_lib, g_get_num_processors());
+}
+
+gchar *
+ui_connection_get_liveurl(UiConnection *self, gchar *ide) {
+    return runtime_info_liveurl(self->registry->info, ide);
+}
+
+void
+ui_connection_free(UiConnection *self) {
+
+    // Queued renders, and the results they hand to the main loop, reference clients, networks
+    // and templates. Take no new work, and let them finish while all of those are still there
+    self->closing = TRUE;
+    g_thread_pool_free(self->render_pool, FALSE, TRUE);
+    while (g_atomic_int_get(&self->results_pending) > 0) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    admission_free(self->admission);
+    g_list_free_full(self->clients, (GDestroyNotify)ui_client_free);
+    g_hash_table_destroy(self->network_map);
+    g_hash_table_destroy(self->templates);
+    g_free(self->hostname);
     g_object_unref(self->server);
     library_free(self->component_lib);
+    response_cache_free(self->response_cache);
+    g_hash_table_destroy(self->previews_sent);
+    buffer_pool_free(self->buffer_pool);
+    metrics_free(self->metrics);
+    if (self->packed_catalog) {
+        g_ptr_array_unref(self->packed_catalog);
+        g_ptr_array_unref(self->packed_catalog_source);
+    }
+    g_free(self->instance_id);
+    g_object_unref(self->parser);
+    imgflo_log_set_handler("imgflo", G_LOG_FLAG_RECURSION, NULL, NULL);
+    // Pending flush would run on a freed connection. Source is gone already if it has run
+    GSource *flush = (self->log_flush_source) ? g_main_context_find_source_by_id(NULL, self->log_flush_source) : NULL;
+    if (flush) {
+        g_source_destroy(flush);
+    }
+    log_ring_free(self->log_ring);
     g_free(self->main_network);
 
     g_free(self);
@@ -3,6 +3,9 @@
 //     imgflo may be freely distributed under the MIT license
 
 #include <json-glib/json-glib.h>
+#include <string.h>
+
+gboolean imgflo_debug_enabled(void);
 
 // Debug handlers. These follow the same semantics as glib handlers
 #define imgflo_error(format...)    G_STMT_START {                 \
@@ -23,9 +26,13 @@
 #define imgflo_info(format...)       imgflo_log (G_LOG_DOMAIN,         \
                                        G_LOG_LEVEL_INFO,     \
                                        format)
-#define imgflo_debug(format...)      imgflo_log (G_LOG_DOMAIN,         \
+// Arguments are not evaluated unless debug is enabled, see imgflo_debug_enabled()
+#define imgflo_debug(format...)      G_STMT_START {                 \
+                                if (imgflo_debug_enabled())  \
+                                    imgflo_log (G_LOG_DOMAIN,     \
                                        G_LOG_LEVEL_DEBUG,    \
-                                       format)
+                                       format);              \
+                              } G_STMT_END
 
 // Note: must not be defined in any externally visible headers!
 #undef G_LOG_DOMAIN
@@ -73,6 +80,19 @@ imgflo_logv (const gchar   *log_domain,
     g_free(message);
 }
 
+// Like for GLib, debug messages are enabled with G_MESSAGES_DEBUG=all or G_MESSAGES_DEBUG=imgflo
+gboolean
+imgflo_debug_enabled(void) {
+    static gsize initialized = 0;
+    static gboolean enabled = FALSE;
+    if (g_once_init_enter(&initialized)) {
+        const gchar *domains = g_getenv("G_MESSAGES_DEBUG");
+        enabled = domains && (strstr(domains, "all") || strstr(domains, "imgflo"));
+        g_once_init_leave(&initialized, 1);
+    }
+    return enabled;
+}
+
 void
 imgflo_log (const gchar   *log_domain,
        GLogLevelFlags log_level,
@@ -86,15 +106,22 @@ imgflo_log (const gchar   *log_domain,
   va_end (args);
 }
 
-gchar *
-json_stringify_node(JsonNode *node, gsize *length_out) {
-    JsonGenerator *generator = json_generator_new();
-    json_generator_set_pretty(generator, TRUE);
+// One generator per thread, reused for all serialization
+static GPrivate json_generator_private = G_PRIVATE_INIT(g_object_unref);
+
+static gchar *
+json_generate(JsonNode *node, gboolean pretty, gsize *length_out) {
+    JsonGenerator *generator = (JsonGenerator *)g_private_get(&json_generator_private);
+    if (!generator) {
+        generator = json_generator_new();
+        g_private_set(&json_generator_private, generator);
+    }
+    json_generator_set_pretty(generator, pretty);
     json_generator_set_root(generator, node);
 
     gsize len = 0;
     gchar *data = json_generator_to_data(generator, &len);
-    g_object_unref(generator);
+    json_generator_set_root(generator, NULL);
 
     if (length_out) {
         *length_out = len;
@@ -102,12 +129,49 @@ json_stringify_node(JsonNode *node, gsize *length_out) {
     return data;
 }
 
+// Compact JSON
+gchar *
+json_stringify_node(JsonNode *node, gsize *length_out) {
+    return json_generate(node, FALSE, length_out);
+}
+
+// Compact JSON. Takes ownership of @root
 gchar *
 json_stringify(JsonObject *root, gsize *length_out) {
     JsonNode *node = json_node_new(JSON_NODE_OBJECT);
     json_node_take_object(node, root);
+    gchar *data = json_generate(node, FALSE, length_out);
+    json_node_free(node);
+    return data;
+}
+
+// Indented JSON, for things people read. Takes ownership of @root
+gchar *
+json_stringify_pretty(JsonObject *root, gsize *length_out) {
+    JsonNode *node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, root);
+    gchar *data = json_generate(node, TRUE, length_out);
+    json_node_free(node);
+    return data;
+}
+
+// FBP protocol message. Takes ownership of @payload
+JsonObject *
+form_response_object(const gchar *protocol, const gchar *command, JsonObject *payload)
+{
+    JsonObject *response = json_object_new();
 
-    return json_stringify_node(node, length_out);
+    json_object_set_string_member(response, "protocol", protocol);
+    json_object_set_string_member(response, "command", command);
+    json_object_set_object_member(response, "payload", payload);
+    return response;
+}
+
+// Serialize a FBP protocol message. Takes ownership of @payload
+gchar *
+form_response(const gchar *protocol, const gchar *command, JsonObject *payload)
+{
+    return json_stringify(form_response_object(protocol, command, payload), NULL);
 }
 
 // imgflo_get_time(): Fast precision timecounting, for benchmarking etc. Returns time in seconds.
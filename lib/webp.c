@@ -0,0 +1,80 @@
+//     imgflo - Flowhub.io Image-processing runtime
+//     (c) 2014 The Grid
+//     imgflo may be freely distributed under the MIT license
+
+#include <webp/encode.h>
+#include <webp/decode.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  char *buffer;
+  size_t size;
+} WebpEncoder;
+
+WebpEncoder *
+webp_encoder_new(void) {
+    WebpEncoder *self = g_new(WebpEncoder, 1);
+    self->buffer = NULL;
+    self->size = 0;
+    return self;
+}
+
+void
+webp_encoder_free(WebpEncoder *self) {
+    if (self->buffer) {
+        g_free(self->buffer);
+    }
+    g_free(self);
+}
+
+// @quality is 0-100
+gboolean
+webp_encoder_encode_rgba(WebpEncoder *self, int width, int height, gchar *buffer, int quality) {
+    g_return_val_if_fail(self, FALSE);
+    g_return_val_if_fail(width > 0, FALSE);
+    g_return_val_if_fail(height > 0, FALSE);
+    g_return_val_if_fail(buffer, FALSE);
+
+    uint8_t *out = NULL;
+    const size_t size = WebPEncodeRGBA((const uint8_t *)buffer, width, height, 4*width,
+                                       (float)CLAMP(quality, 0, 100), &out);
+    if (size == 0) {
+        imgflo_warning("WebP encoding failed");
+        return FALSE;
+    }
+
+    // libwebp allocates with its own allocator, so copy to memory which g_free() can take
+    self->buffer = g_malloc(size);
+    memcpy(self->buffer, out, size);
+    self->size = size;
+    free(out);
+    return TRUE;
+}
+
+// Decode WebP @data in memory to RGBA u8. Images larger than @max_pixels are refused.
+// Returns pixels to be freed with free(), as they are allocated by libwebp, or NULL on error
+gchar *
+webp_decode_rgba(const guint8 *data, size_t size, gint64 max_pixels, int *width_out, int *height_out) {
+    g_return_val_if_fail(data, NULL);
+
+    int width = 0;
+    int height = 0;
+    if (!WebPGetInfo(data, size, &width, &height)) {
+        imgflo_warning("WebP decoding failed: invalid header");
+        return NULL;
+    }
+    if ((gint64)width*height > max_pixels) {
+        imgflo_warning("WebP decoding failed: image too large");
+        return NULL;
+    }
+    uint8_t *pixels = WebPDecodeRGBA(data, size, &width, &height);
+    if (!pixels) {
+        imgflo_warning("WebP decoding failed");
+        return NULL;
+    }
+    *width_out = width;
+    *height_out = height;
+    return (gchar *)pixels;
+}
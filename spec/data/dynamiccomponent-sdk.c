@@ -0,0 +1,51 @@
+/* This file is an image processing operation for GEGL */
+
+#ifdef GEGL_PROPERTIES
+   property_double (gain, "Gain", 1.0)
+#else
+
+#define GEGL_OP_POINT_FILTER
+#ifndef GEGL_OP_NAME
+#define GEGL_OP_NAME imgflo_dynamiccomponentsdk
+#endif
+#include "gegl-op.h"
+#include "imgflo-op.h"
+
+#ifndef IMGFLO_OP_NAME
+#define IMGFLO_OP_NAME(orig) orig
+#endif
+
+static void prepare(GeglOperation *operation)
+{
+    const Babl *format = babl_format("RGBA float");
+    gegl_operation_set_format(operation, "input", format);
+    gegl_operation_set_format(operation, "output", format);
+}
+
+gboolean
+process(GeglOperation *op, void *in_buf, void *out_buf, glong samples,
+        const GeglRectangle *roi, gint level)
+{
+    GeglProperties *o = GEGL_PROPERTIES(op);
+    const imgflo_float4 gain = imgflo_float4_set(o->gain, o->gain, o->gain, 1.0f);
+    IMGFLO_MAP_RGBA(in_buf, out_buf, samples, px,
+        imgflo_float4_clamp(px * gain, 0.0f, 1.0f));
+    return TRUE;
+}
+
+static void
+gegl_op_class_init (GeglOpClass *klass)
+{
+  GeglOperationClass *operation_class = GEGL_OPERATION_CLASS (klass);
+  GeglOperationPointFilterClass *point_filter_class = GEGL_OPERATION_POINT_FILTER_CLASS (klass);
+  point_filter_class->process = process;
+  operation_class->prepare = prepare;
+  gegl_operation_class_set_keys (operation_class,
+      "name",        IMGFLO_OP_NAME("dynamiccomponentsdk"),
+      "title",       "imgflo: Dynamic SDK",
+      "categories" , "dev",
+      "description", "Dynamically loaded component using imgflo-op.h",
+  NULL);
+}
+
+#endif
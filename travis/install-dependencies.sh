@@ -3,7 +3,7 @@ OS=`uname`
 if [[ $OS = "Darwin" ]]
 then
     brew install pkg-config
-    brew install glib json-glib
+    brew install glib json-glib jpeg webp
 else
     echo Travis apt addon should take care of this
 fi